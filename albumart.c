@@ -345,6 +345,21 @@ found_file:
 	return NULL;
 }
 
+int64_t
+get_album_art_id(const char *album_art)
+{
+	int64_t ret;
+
+	ret = sql_get_int_field(db, "SELECT ID from ALBUM_ART where PATH = '%q'", album_art);
+	if( !ret )
+	{
+		if( sql_exec(db, "INSERT into ALBUM_ART (PATH) VALUES ('%q')", album_art) == SQLITE_OK )
+			ret = sqlite3_last_insert_rowid(db);
+	}
+
+	return ret;
+}
+
 int64_t
 find_album_art(const char *path, uint8_t *image_data, int image_size)
 {
@@ -353,14 +368,7 @@ find_album_art(const char *path, uint8_t *image_data, int image_size)
 
 	if( (image_size && (album_art = check_embedded_art(path, image_data, image_size))) ||
 	    (album_art = check_for_album_file(path)) )
-	{
-		ret = sql_get_int_field(db, "SELECT ID from ALBUM_ART where PATH = '%q'", album_art);
-		if( !ret )
-		{
-			if( sql_exec(db, "INSERT into ALBUM_ART (PATH) VALUES ('%q')", album_art) == SQLITE_OK )
-				ret = sqlite3_last_insert_rowid(db);
-		}
-	}
+		ret = get_album_art_id(album_art);
 	free(album_art);
 
 	return ret;
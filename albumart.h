@@ -25,6 +25,7 @@
 #define __ALBUMART_H__
 
 void update_if_album_art(const char *path);
+int64_t get_album_art_id(const char *album_art);
 int64_t find_album_art(const char *path, uint8_t *image_data, int image_size);
 
 #endif
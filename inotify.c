@@ -32,12 +32,22 @@
 #include <sys/time.h>
 #include <sys/resource.h>
 #include <poll.h>
+#include <ftw.h>
+#include <pthread.h>
 #ifdef HAVE_SYS_INOTIFY_H
 #include <sys/inotify.h>
 #else
 #include "linux/inotify.h"
 #include "linux/inotify-syscalls.h"
 #endif
+#ifdef HAVE_SYS_FANOTIFY_H
+#include <fcntl.h>
+#include <sys/fanotify.h>
+#include <sys/vfs.h>
+#ifdef FAN_REPORT_DFID_NAME
+#define USE_FANOTIFY
+#endif
+#endif
 #include "libav.h"
 
 #include "upnpglobalvars.h"
@@ -56,80 +66,515 @@
 
 #define PATH_BUF_SIZE PATH_MAX
 
+/* Watched directories are kept as a tree of path components, so a path
+ * is stored once however many directories are below it, and moving a
+ * directory only touches its own entry.  The entries sit in one array and
+ * refer to each other by index, their names are packed into one buffer,
+ * and they are found by watch descriptor, or by parent and name, through
+ * two hash tables. */
 struct watch
 {
-	int wd;		/* watch descriptor */
-	char *path;	/* watched path */
-	struct watch *next;
+	int wd;			/* watch descriptor, or -1 once it's gone */
+	uint32_t parent;	/* 0 when name is the whole path */
+	uint32_t children;	/* entries naming this one as their parent */
+	uint32_t name;		/* offset into watches.names */
+	uint32_t next_wd;	/* hash chains, and the free list */
+	uint32_t next_name;
 };
 
-static struct watch *watches;
-static struct watch *lastwatch = NULL;
+static struct {
+	struct watch *w;	/* entry 0 is unused, so 0 can mean none */
+	uint32_t used;
+	uint32_t size;
+	uint32_t free;
+	uint32_t *by_wd;
+	uint32_t *by_name;
+	uint32_t hsize;		/* of each table */
+	char *names;
+	uint32_t names_len;
+	uint32_t names_size;
+	uint32_t names_dead;	/* left behind by renamed and removed entries */
+	uint32_t *top;		/* entries named by whole path */
+	uint32_t ntop;
+	uint32_t top_size;
+	unsigned int count;	/* entries, some only kept for those below them */
+	unsigned int watched;	/* entries with a watch descriptor */
+} watches;
+
+static const char *backend;
 static time_t next_pl_fill = 0;
 
-char *get_path_from_wd(int wd)
+#ifdef USE_FANOTIFY
+static int fanotify_add_watch(const char *path);
+static void fanotify_remove_watch(uint32_t i);
+#endif
+
+#define WATCH(i) (&watches.w[i])
+#define WATCH_NAME(i) (watches.names + watches.w[i].name)
+
+static uint32_t
+name_hash(uint32_t parent, const char *name, size_t len)
+{
+	uint32_t hash = 2166136261u ^ (parent * 2654435761u);
+
+	while( len-- )
+		hash = (hash ^ (unsigned char)*name++) * 16777619u;
+
+	return hash;
+}
+
+static uint32_t
+watch_lookup(uint32_t parent, const char *name, size_t len)
+{
+	uint32_t i;
+
+	if( !watches.hsize )
+		return 0;
+	for( i = watches.by_name[name_hash(parent, name, len) & (watches.hsize - 1)]; i; i = WATCH(i)->next_name )
+		if( WATCH(i)->parent == parent && strncmp(WATCH_NAME(i), name, len) == 0 && WATCH_NAME(i)[len] == '\0' )
+			return i;
+
+	return 0;
+}
+
+/* Find the first len bytes of path */
+static uint32_t
+watch_find(const char *path, size_t len)
+{
+	uint32_t parent;
+	const char *slash;
+
+	parent = watch_lookup(0, path, len);
+	if( parent )
+		return parent;
+	for( slash = path + len - 1; slash > path && *slash != '/'; slash-- )
+		continue;
+	if( slash <= path )
+		return 0;
+	parent = watch_find(path, slash - path);
+	if( !parent )
+		return 0;
+
+	return watch_lookup(parent, slash + 1, len - (slash + 1 - path));
+}
+
+static uint32_t
+watch_by_wd(int wd)
+{
+	uint32_t i;
+
+	if( !watches.hsize )
+		return 0;
+	for( i = watches.by_wd[wd & (watches.hsize - 1)]; i; i = WATCH(i)->next_wd )
+		if( WATCH(i)->wd == wd )
+			return i;
+
+	return 0;
+}
+
+static char *
+watch_path(uint32_t i, char *buf, size_t len)
 {
-	struct watch *w = watches;
+	size_t off = 0;
 
-	while( w != NULL )
+	if( WATCH(i)->parent )
 	{
-		if( w->wd == wd )
-			return w->path;
-		w = w->next;
+		if( !watch_path(WATCH(i)->parent, buf, len) )
+			return NULL;
+		off = strlen(buf);
 	}
+	if( snprintf(buf + off, len - off, "%s%s", WATCH(i)->parent ? "/" : "", WATCH_NAME(i)) >= (int)(len - off) )
+		return NULL;
 
-	return NULL;
+	return buf;
+}
+
+static int
+watch_grow_hash(void)
+{
+	uint32_t hsize = watches.hsize ? watches.hsize * 2 : 1024;
+	uint32_t *by_wd, *by_name, i, slot;
+
+	by_wd = calloc(hsize, sizeof(*by_wd));
+	by_name = calloc(hsize, sizeof(*by_name));
+	if( !by_wd || !by_name )
+	{
+		free(by_wd);
+		free(by_name);
+		return -1;
+	}
+	for( i = 1; i < watches.used; i++ )
+	{
+		if( !WATCH(i)->name )
+			continue;
+		slot = name_hash(WATCH(i)->parent, WATCH_NAME(i), strlen(WATCH_NAME(i))) & (hsize - 1);
+		WATCH(i)->next_name = by_name[slot];
+		by_name[slot] = i;
+		if( WATCH(i)->wd < 0 )
+			continue;
+		slot = WATCH(i)->wd & (hsize - 1);
+		WATCH(i)->next_wd = by_wd[slot];
+		by_wd[slot] = i;
+	}
+	free(watches.by_wd);
+	free(watches.by_name);
+	watches.by_wd = by_wd;
+	watches.by_name = by_name;
+	watches.hsize = hsize;
+
+	return 0;
+}
+
+/* Pack the names of the entries still around into a new buffer */
+static int
+watch_compact_names(void)
+{
+	char *names;
+	uint32_t i, len, off = 1;
+
+	names = malloc(watches.names_size);
+	if( !names )
+		return -1;
+	for( i = 1; i < watches.used; i++ )
+	{
+		if( !WATCH(i)->name )
+			continue;
+		len = strlen(WATCH_NAME(i)) + 1;
+		memcpy(names + off, WATCH_NAME(i), len);
+		WATCH(i)->name = off;
+		off += len;
+	}
+	free(watches.names);
+	watches.names = names;
+	watches.names_len = off;
+	watches.names_dead = 0;
+
+	return 0;
+}
+
+static uint32_t
+watch_store_name(const char *name)
+{
+	uint32_t len = strlen(name) + 1, off;
+
+	if( watches.names_dead > watches.names_len / 2 && watches.names_len > 65536 )
+		watch_compact_names();
+	if( watches.names_len + len > watches.names_size )
+	{
+		uint32_t size = watches.names_size ? watches.names_size : 65536;
+		char *names;
+
+		while( watches.names_len + len > size )
+			size *= 2;
+		names = realloc(watches.names, size);
+		if( !names )
+			return 0;
+		watches.names = names;
+		watches.names_size = size;
+	}
+	/* Offset 0 means no name */
+	if( !watches.names_len )
+		watches.names_len = 1;
+	off = watches.names_len;
+	memcpy(watches.names + off, name, len);
+	watches.names_len += len;
+
+	return off;
+}
+
+/* Hang entry i off parent under the name stored at off, where it can
+ * be found by path */
+static void
+watch_link(uint32_t i, uint32_t parent, uint32_t off)
+{
+	const char *name = watches.names + off;
+	uint32_t slot = name_hash(parent, name, strlen(name)) & (watches.hsize - 1);
+
+	WATCH(i)->parent = parent;
+	WATCH(i)->name = off;
+	WATCH(i)->next_name = watches.by_name[slot];
+	watches.by_name[slot] = i;
+	if( parent )
+		WATCH(parent)->children++;
+	else
+	{
+		if( watches.ntop >= watches.top_size )
+		{
+			uint32_t size = watches.top_size ? watches.top_size * 2 : 16;
+			uint32_t *top = realloc(watches.top, size * sizeof(*top));
+
+			/* It just won't be moved under a directory added later */
+			if( !top )
+				return;
+			watches.top = top;
+			watches.top_size = size;
+		}
+		watches.top[watches.ntop++] = i;
+	}
+}
+
+static void
+watch_unlink(uint32_t i)
+{
+	uint32_t *p;
+
+	p = &watches.by_name[name_hash(WATCH(i)->parent, WATCH_NAME(i), strlen(WATCH_NAME(i))) & (watches.hsize - 1)];
+	while( *p != i )
+		p = &WATCH(*p)->next_name;
+	*p = WATCH(i)->next_name;
+	if( WATCH(i)->parent )
+		WATCH(WATCH(i)->parent)->children--;
+	else
+	{
+		uint32_t t;
+
+		for( t = 0; t < watches.ntop; t++ )
+		{
+			if( watches.top[t] == i )
+			{
+				watches.top[t] = watches.top[--watches.ntop];
+				break;
+			}
+		}
+	}
+	watches.names_dead += strlen(WATCH_NAME(i)) + 1;
+	WATCH(i)->name = 0;
+}
+
+static uint32_t watch_add(const char *path);
+
+/* The entry for the directory path is in, adding entries for the ones in
+ * between if something further up is in the table.  0 if nothing is. */
+static uint32_t
+watch_parent(const char *path)
+{
+	const char *slash = strrchr(path, '/');
+	uint32_t parent;
+	char *dir;
+
+	if( !slash || slash == path )
+		return 0;
+	parent = watch_find(path, slash - path);
+	if( parent )
+		return parent;
+	dir = strndup(path, slash - path);
+	if( !dir )
+		return 0;
+	if( watch_parent(dir) )
+		parent = watch_add(dir);
+	free(dir);
+
+	return parent;
+}
+
+/* Move the entries named by whole path that are below path, which is
+ * entry i now, under it.  Watches aren't always added parents first, and
+ * otherwise a rename of the parent wouldn't carry them along. */
+static void
+watch_adopt(uint32_t i, const char *path)
+{
+	size_t len = strlen(path);
+	uint32_t t = 0, j, parent, off;
+	char *name;
+
+	while( t < watches.ntop )
+	{
+		j = watches.top[t];
+		if( j == i || strncmp(WATCH_NAME(j), path, len) != 0 || WATCH_NAME(j)[len] != '/' )
+		{
+			t++;
+			continue;
+		}
+		/* Adding the directories in between can move the names */
+		name = strdup(WATCH_NAME(j));
+		if( !name )
+			return;
+		parent = watch_parent(name);
+		/* Which may have taken care of this one already */
+		if( parent && !WATCH(j)->parent && (off = watch_store_name(strrchr(name, '/') + 1)) )
+		{
+			watch_unlink(j);
+			watch_link(j, parent, off);
+			t = 0;
+		}
+		else
+			t++;
+		free(name);
+	}
+}
+
+/* Take a path that isn't in the table yet.  Its name is relative to the
+ * directory it is in if anything above it is in the table, and is the
+ * whole path otherwise. */
+static uint32_t
+watch_add(const char *path)
+{
+	uint32_t i, off, parent;
+	const char *name = path;
+
+	/* First, as it can add entries of its own */
+	parent = watch_parent(path);
+	if( parent )
+		name = strrchr(path, '/') + 1;
+	if( watches.count >= watches.hsize && watch_grow_hash() != 0 )
+		return 0;
+	if( !watches.free && watches.used >= watches.size )
+	{
+		uint32_t size = watches.size ? watches.size * 2 : 1024;
+		struct watch *w = realloc(watches.w, size * sizeof(struct watch));
+
+		if( !w )
+			return 0;
+		watches.w = w;
+		watches.size = size;
+		if( !watches.used )
+			watches.used = 1;
+	}
+	off = watch_store_name(name);
+	if( !off )
+		return 0;
+	if( watches.free )
+	{
+		i = watches.free;
+		watches.free = WATCH(i)->next_wd;
+	}
+	else
+		i = watches.used++;
+	memset(WATCH(i), 0, sizeof(struct watch));
+	WATCH(i)->wd = -1;
+	watch_link(i, parent, off);
+	watches.count++;
+	if( watches.ntop > 1 )
+		watch_adopt(i, path);
+
+	return i;
+}
+
+static void
+watch_set_wd(uint32_t i, int wd)
+{
+	uint32_t slot = wd & (watches.hsize - 1);
+
+	WATCH(i)->wd = wd;
+	WATCH(i)->next_wd = watches.by_wd[slot];
+	watches.by_wd[slot] = i;
+	watches.watched++;
+}
+
+/* Free entry i, and the directories above it that were only kept for it */
+static void
+watch_release(uint32_t i)
+{
+	uint32_t parent;
+
+	while( i && WATCH(i)->wd < 0 && !WATCH(i)->children )
+	{
+		parent = WATCH(i)->parent;
+		watch_unlink(i);
+		WATCH(i)->next_wd = watches.free;
+		watches.free = i;
+		watches.count--;
+		i = parent;
+	}
+}
+
+static void
+watch_clear_wd(uint32_t i)
+{
+	uint32_t *p;
+
+	p = &watches.by_wd[WATCH(i)->wd & (watches.hsize - 1)];
+	while( *p != i )
+		p = &WATCH(*p)->next_wd;
+	*p = WATCH(i)->next_wd;
+	WATCH(i)->wd = -1;
+	watches.watched--;
+}
+
+/* The kernel is done with wd, because we removed it or the directory went */
+static void
+watch_drop(int wd)
+{
+	uint32_t i = watch_by_wd(wd);
+
+	if( !i )
+		return;
+	watch_clear_wd(i);
+	watch_release(i);
+}
+
+char *
+get_path_from_wd(int wd, char *buf, size_t len)
+{
+	uint32_t i = watch_by_wd(wd);
+
+	return i ? watch_path(i, buf, len) : NULL;
 }
 
 int
 add_watch(int fd, const char * path)
 {
-	struct watch *nw;
+	uint32_t i;
 	int wd;
 
+#ifdef USE_FANOTIFY
+	if( fd < 0 )
+		return fanotify_add_watch(path);
+#endif
 	wd = inotify_add_watch(fd, path, IN_CREATE|IN_CLOSE_WRITE|IN_DELETE|IN_MOVE);
 	if( wd < 0 )
 	{
 		DPRINTF(E_ERROR, L_INOTIFY, "inotify_add_watch(%s) [%s]\n", path, strerror(errno));
 		return -1;
 	}
+	/* Watching a directory again gives back the same descriptor */
+	if( watch_by_wd(wd) )
+		return wd;
 
-	nw = malloc(sizeof(struct watch));
-	if( nw == NULL )
+	i = watch_find(path, strlen(path));
+	if( !i )
+		i = watch_add(path);
+	if( !i )
 	{
 		DPRINTF(E_ERROR, L_INOTIFY, "malloc() error\n");
+		inotify_rm_watch(fd, wd);
 		return -1;
 	}
-	nw->wd = wd;
-	nw->next = NULL;
-	nw->path = strdup(path);
-
-	if( watches == NULL )
-	{
-		watches = nw;
-	}
-
-	if( lastwatch != NULL )
-	{
-		lastwatch->next = nw;
-	}
-	lastwatch = nw;
+	if( WATCH(i)->wd < 0 )
+		watch_set_wd(i, wd);
 
 	return wd;
 }
 
+/* The entry goes once the kernel confirms with IN_IGNORED */
 int
 remove_watch(int fd, const char * path)
 {
-	struct watch *w;
+	uint32_t i;
 
-	for( w = watches; w; w = w->next )
+	i = watch_find(path, strlen(path));
+	if( !i || WATCH(i)->wd < 0 )
+		return 1;
+#ifdef USE_FANOTIFY
+	if( fd < 0 )
 	{
-		if( strcmp(path, w->path) == 0 )
-			return(inotify_rm_watch(fd, w->wd));
+		fanotify_remove_watch(i);
+		return 0;
 	}
+#endif
+	if( fd < 0 )
+		return 1;
+
+	return(inotify_rm_watch(fd, WATCH(i)->wd));
+}
 
-	return 1;
+/* Memory the table takes up */
+static size_t
+watch_bytes(void)
+{
+	return watches.size * sizeof(struct watch) +
+	       watches.hsize * 2 * sizeof(uint32_t) + watches.names_size +
+	       watches.top_size * sizeof(uint32_t);
 }
 
 unsigned int
@@ -158,7 +603,7 @@ inotify_create_watches(int fd)
 		add_watch(fd, media_path->path);
 		num_watches++;
 	}
-	sql_get_table(db, "SELECT PATH from DETAILS where MIME is NULL and PATH is not NULL", &result, &rows, NULL);
+	sql_get_table(db, "SELECT PATH from DETAILS where MIME is NULL and PATH is not NULL ORDER BY PATH", &result, &rows, NULL);
 	for( i=1; i <= rows; i++ )
 	{
 		DPRINTF(E_DEBUG, L_INOTIFY, "Add watch to %s\n", result[i]);
@@ -166,7 +611,10 @@ inotify_create_watches(int fd)
 		num_watches++;
 	}
 	sqlite3_free_table(result);
-		
+	/* fanotify only needs to know the directories, not watch them */
+	if( fd < 0 )
+		return rows;
+
 	max_watches = fopen("/proc/sys/fs/inotify/max_user_watches", "r");
 	if( max_watches )
 	{
@@ -212,19 +660,23 @@ inotify_create_watches(int fd)
 int 
 inotify_remove_watches(int fd)
 {
-	struct watch *w = watches;
-	struct watch *last_w;
+	uint32_t i;
 	int rm_watches = 0;
 
-	while( w )
+	for( i = 1; i < watches.used; i++ )
 	{
-		last_w = w;
-		inotify_rm_watch(fd, w->wd);
-		free(w->path);
-		rm_watches++;
-		w = w->next;
-		free(last_w);
+		if( WATCH(i)->name && WATCH(i)->wd >= 0 && fd >= 0 )
+		{
+			inotify_rm_watch(fd, WATCH(i)->wd);
+			rm_watches++;
+		}
 	}
+	free(watches.w);
+	free(watches.by_wd);
+	free(watches.by_name);
+	free(watches.names);
+	free(watches.top);
+	memset(&watches, 0, sizeof(watches));
 
 	return rm_watches;
 }
@@ -398,7 +850,7 @@ inotify_insert_file(char * name, const char * path)
 				/* Insert newly-found directory */
 				strcpy(base_name, last_dir);
 				base_copy = basename(base_name);
-				insert_directory(base_copy, last_dir, BROWSEDIR_ID, id+2, get_next_available_id("OBJECTS", id));
+				insert_directory(base_copy, last_dir, BROWSEDIR_ID, id+2, get_next_available_id(id));
 				sqlite3_free(id);
 				break;
 			}
@@ -423,7 +875,7 @@ inotify_insert_file(char * name, const char * path)
 	if( !depth )
 	{
 		//DEBUG DPRINTF(E_DEBUG, L_INOTIFY, "Inserting %s\n", name);
-		insert_file(name, path, id+2, get_next_available_id("OBJECTS", id), types);
+		insert_file(name, path, id+2, get_next_available_id(id), types);
 		sqlite3_free(id);
 		if( (is_audio(path) || is_playlist(path)) && next_pl_fill != 1 )
 		{
@@ -463,19 +915,17 @@ inotify_insert_directory(int fd, char *name, const char * path)
 	                            " where d.PATH = '%q' and REF_ID is NULL", dirname(parent_buf));
 	if( !id )
 		id = sqlite3_mprintf("%s", BROWSEDIR_ID);
-	insert_directory(name, path, BROWSEDIR_ID, id+2, get_next_available_id("OBJECTS", id));
+	insert_directory(name, path, BROWSEDIR_ID, id+2, get_next_available_id(id));
 	sqlite3_free(id);
 	free(parent_buf);
 
+	/* fanotify already watches the whole filesystem, but notes the handle
+	 * of one moved in from outside the media_dirs as ours now */
 	wd = add_watch(fd, path);
 	if( wd == -1 )
-	{
 		DPRINTF(E_ERROR, L_INOTIFY, "add_watch() failed\n");
-	}
 	else
-	{
 		DPRINTF(E_INFO, L_INOTIFY, "Added watch to %s [%d]\n", path, wd);
-	}
 
 	media_path = media_dirs;
 	while( media_path )
@@ -522,22 +972,192 @@ inotify_insert_directory(int fd, char *name, const char * path)
 			}
 		}
 		free(esc_name);
+		sql_batch_step(db);
 	}
 	closedir(ds);
 
 	return 0;
 }
 
+/* Remove the DETAILS rows matching where, with their objects, and the
+ * containers that leaves empty, along with those containers' parents if
+ * they empty out too, and the details only those containers used.  Each
+ * step covers the whole set in one statement, and either all of them
+ * happen or none.  Returns the number of DETAILS rows removed. */
+static int
+remove_details(const char *where)
+{
+	char *sql;
+	char **result;
+	int rows, i, level, n = 0;
+	int ret;
+
+	ret = sql_exec(db, "SAVEPOINT REMOVE_DETAILS");
+	if( ret != SQLITE_OK )
+		return 0;
+	ret = sql_exec(db, "CREATE TEMP TABLE if not exists EMPTIED"
+	                   " (ID TEXT PRIMARY KEY, LEVEL INTEGER, DETAIL_ID INTEGER)");
+	/* If any are playlist items, adjust the item counts of their playlists */
+	if( ret == SQLITE_OK )
+	{
+		sql = sqlite3_mprintf("SELECT PARENT_ID, count(*) from OBJECTS"
+		                      " where DETAIL_ID in (SELECT ID from DETAILS where %s)"
+		                      " and PARENT_ID like '" MUSIC_PLIST_ID "$%%' group by PARENT_ID", where);
+		ret = sql_get_table(db, sql, &result, &rows, NULL);
+		sqlite3_free(sql);
+	}
+	if( ret == SQLITE_OK )
+	{
+		for( i = 1; i <= rows && ret == SQLITE_OK; i++ )
+			ret = sql_exec(db, "UPDATE PLAYLISTS set FOUND = (FOUND-%d) where ID = %lld",
+			               atoi(result[i*2+1]), strtoll(strrchr(result[i*2], '$') + 1, NULL, 16));
+		sqlite3_free_table(result);
+	}
+	if( ret == SQLITE_OK )
+		ret = sql_exec(db, "INSERT or IGNORE into temp.EMPTIED"
+		                   " SELECT o.PARENT_ID, 1, p.DETAIL_ID from OBJECTS o"
+		                   " join OBJECTS p on (p.OBJECT_ID = o.PARENT_ID)"
+		                   " where o.DETAIL_ID in (SELECT ID from DETAILS where %s)"
+		                   " and o.PARENT_ID not like '" BROWSEDIR_ID "$%%'", where);
+	/* Now delete the actual objects */
+	if( ret == SQLITE_OK )
+		ret = sql_exec(db, "DELETE from OBJECTS where DETAIL_ID in (SELECT ID from DETAILS where %s)", where);
+	if( ret == SQLITE_OK )
+	{
+		ret = sql_exec(db, "DELETE from DETAILS where %s", where);
+		n = sqlite3_changes(db);
+	}
+	/* Note which parents the emptied containers leave behind before they go */
+	if( ret == SQLITE_OK )
+		ret = sql_exec(db, "INSERT or IGNORE into temp.EMPTIED"
+		                   " SELECT o.PARENT_ID, 2, p.DETAIL_ID from OBJECTS o"
+		                   " join OBJECTS p on (p.OBJECT_ID = o.PARENT_ID)"
+		                   " where o.OBJECT_ID in (SELECT ID from temp.EMPTIED where LEVEL = 1)"
+		                   " and not exists (SELECT 1 from OBJECTS c where c.PARENT_ID = o.OBJECT_ID)");
+	for( level = 1; level <= 2 && ret == SQLITE_OK; level++ )
+		ret = sql_exec(db, "DELETE from OBJECTS"
+		                   " where OBJECT_ID in (SELECT ID from temp.EMPTIED where LEVEL = %d)"
+		                   " and not exists (SELECT 1 from OBJECTS c where c.PARENT_ID = OBJECTS.OBJECT_ID)",
+		                   level);
+	/* Containers can share details through REF_ID */
+	if( ret == SQLITE_OK )
+		ret = sql_exec(db, "DELETE from DETAILS"
+		                   " where ID in (SELECT DETAIL_ID from temp.EMPTIED) and PATH is NULL"
+		                   " and not exists (SELECT 1 from OBJECTS where DETAIL_ID = DETAILS.ID)");
+	if( ret != SQLITE_OK )
+	{
+		sql_exec(db, "ROLLBACK TO REMOVE_DETAILS");
+		n = 0;
+	}
+	sql_exec(db, "DELETE from temp.EMPTIED");
+	sql_exec(db, "RELEASE REMOVE_DETAILS");
+
+	return n;
+}
+
+/* Album art cut out of files in a removed directory is moved aside at once,
+ * so nothing cached afterwards can land in it, and deleted later by a thread
+ * of its own.  Anything left from last time is cleared out at first. */
+static struct {
+	int pending;		/* only used by the inotify thread */
+	int busy;		/* cleared by the cleanup thread when it is done */
+	int started;
+	pthread_t thread;
+} art_trash = { 1, 0, 0 };
+
+static void
+art_trash_path(char *buf, size_t len)
+{
+	snprintf(buf, len, "%s/art_cache/.removed", db_path);
+}
+
+static int
+art_trash_remove(const char *path, const struct stat *st, int flag, struct FTW *ftw)
+{
+	if( quitting )
+		return 1;
+	if( ftw->level > 0 && remove(path) != 0 && errno != ENOENT )
+		DPRINTF(E_WARN, L_INOTIFY, "Removing %s failed [%s]\n", path, strerror(errno));
+	return 0;
+}
+
+static void *
+art_trash_empty(void *arg)
+{
+	char trash[PATH_MAX];
+
+	art_trash_path(trash, sizeof(trash));
+	nftw(trash, art_trash_remove, 16, FTW_DEPTH|FTW_PHYS);
+	__sync_fetch_and_sub(&art_trash.busy, 1);
+
+	return NULL;
+}
+
+/* Wait for the cleanup thread, which stops early when we are quitting */
+static void
+art_trash_join(void)
+{
+	if( !art_trash.started )
+		return;
+	pthread_join(art_trash.thread, NULL);
+	art_trash.started = 0;
+}
+
+static void
+art_trash_start(void)
+{
+	if( !art_trash.pending || __sync_fetch_and_add(&art_trash.busy, 0) )
+		return;
+	art_trash_join();
+	art_trash.pending = 0;
+	__sync_fetch_and_add(&art_trash.busy, 1);
+	if( pthread_create(&art_trash.thread, NULL, art_trash_empty, NULL) == 0 )
+		art_trash.started = 1;
+	else
+	{
+		art_trash.pending = 1;
+		__sync_fetch_and_sub(&art_trash.busy, 1);
+	}
+}
+
+static void
+art_trash_add(const char *path)
+{
+	static unsigned int count;
+	char art_cache[PATH_MAX];
+	char trash[PATH_MAX];
+	int len;
+
+	snprintf(art_cache, sizeof(art_cache), "%s/art_cache%s", db_path, path);
+	art_trash_path(trash, sizeof(trash));
+	make_dir(trash, S_IRWXU);
+	len = strlen(trash);
+	snprintf(trash + len, sizeof(trash) - len, "/%lx.%u", (long)time(NULL), count++);
+	if( rename(art_cache, trash) == 0 )
+		art_trash.pending = 1;
+	else if( errno != ENOENT )
+		DPRINTF(E_WARN, L_INOTIFY, "Moving %s aside failed [%s]\n", art_cache, strerror(errno));
+}
+
+static void
+remove_playlist(int64_t id)
+{
+	sql_exec(db, "DELETE from PLAYLISTS where ID = %lld", id);
+	sql_exec(db, "DELETE from DETAILS where ID ="
+	             " (SELECT DETAIL_ID from OBJECTS where OBJECT_ID = '%s$%llX')",
+	         MUSIC_PLIST_ID, id);
+	sql_exec(db, "DELETE from OBJECTS where OBJECT_ID = '%s$%llX' or PARENT_ID = '%s$%llX'",
+	         MUSIC_PLIST_ID, id, MUSIC_PLIST_ID, id);
+}
+
 int
 inotify_remove_file(const char * path)
 {
-	char sql[128];
 	char art_cache[PATH_MAX];
 	char *id;
-	char *ptr;
-	char **result;
+	char *where;
 	int64_t detailID;
-	int rows, playlist;
+	int len;
 
 	if( is_caption(path) )
 	{
@@ -545,63 +1165,29 @@ inotify_remove_file(const char * path)
 	}
 	/* Invalidate the scanner cache so we don't insert files into non-existent containers */
 	valid_cache = 0;
-	playlist = is_playlist(path);
-	id = sql_get_text_field(db, "SELECT ID from %s where PATH = '%q'", playlist?"PLAYLISTS":"DETAILS", path);
-	if( !id )
-		return 1;
-	detailID = strtoll(id, NULL, 10);
-	sqlite3_free(id);
-	if( playlist )
+	if( is_playlist(path) )
 	{
-		sql_exec(db, "DELETE from PLAYLISTS where ID = %lld", detailID);
-		sql_exec(db, "DELETE from DETAILS where ID ="
-		             " (SELECT DETAIL_ID from OBJECTS where OBJECT_ID = '%s$%llX')",
-		         MUSIC_PLIST_ID, detailID);
-		sql_exec(db, "DELETE from OBJECTS where OBJECT_ID = '%s$%llX' or PARENT_ID = '%s$%llX'",
-		         MUSIC_PLIST_ID, detailID, MUSIC_PLIST_ID, detailID);
+		id = sql_get_text_field(db, "SELECT ID from PLAYLISTS where PATH = '%q'", path);
+		if( !id )
+			return 1;
+		detailID = strtoll(id, NULL, 10);
+		sqlite3_free(id);
+		remove_playlist(detailID);
+		return 0;
 	}
-	else
+	where = sqlite3_mprintf("PATH = '%q'", path);
+	len = remove_details(where);
+	sqlite3_free(where);
+	if( !len )
+		return 1;
+	/* A modified file is parsed again right after this, so its art has to
+	 * be gone now rather than later.  Name it the way albumart.c does. */
+	len = snprintf(art_cache, sizeof(art_cache), "%s/art_cache%s", db_path, path);
+	if( len > 4 && len < sizeof(art_cache) )
 	{
-		/* Delete the parent containers if we are about to empty them. */
-		snprintf(sql, sizeof(sql), "SELECT PARENT_ID from OBJECTS where DETAIL_ID = %lld"
-		                           " and PARENT_ID not like '64$%%'",
-		                           (long long int)detailID);
-		if( (sql_get_table(db, sql, &result, &rows, NULL) == SQLITE_OK) )
-		{
-			int i, children;
-			for( i = 1; i <= rows; i++ )
-			{
-				/* If it's a playlist item, adjust the item count of the playlist */
-				if( strncmp(result[i], MUSIC_PLIST_ID, strlen(MUSIC_PLIST_ID)) == 0 )
-				{
-					sql_exec(db, "UPDATE PLAYLISTS set FOUND = (FOUND-1) where ID = %d",
-					         atoi(strrchr(result[i], '$') + 1));
-				}
-
-				children = sql_get_int_field(db, "SELECT count(*) from OBJECTS where PARENT_ID = '%s'", result[i]);
-				if( children < 0 )
-					continue;
-				if( children < 2 )
-				{
-					sql_exec(db, "DELETE from OBJECTS where OBJECT_ID = '%s'", result[i]);
-
-					ptr = strrchr(result[i], '$');
-					if( ptr )
-						*ptr = '\0';
-					if( sql_get_int_field(db, "SELECT count(*) from OBJECTS where PARENT_ID = '%s'", result[i]) == 0 )
-					{
-						sql_exec(db, "DELETE from OBJECTS where OBJECT_ID = '%s'", result[i]);
-					}
-				}
-			}
-			sqlite3_free_table(result);
-		}
-		/* Now delete the actual objects */
-		sql_exec(db, "DELETE from DETAILS where ID = %lld", detailID);
-		sql_exec(db, "DELETE from OBJECTS where DETAIL_ID = %lld", detailID);
+		strcpy(art_cache + len - 4, ".jpg");
+		remove(art_cache);
 	}
-	snprintf(art_cache, sizeof(art_cache), "%s/art_cache%s", db_path, path);
-	remove(art_cache);
 
 	return 0;
 }
@@ -609,65 +1195,1316 @@ inotify_remove_file(const char * path)
 int
 inotify_remove_directory(int fd, const char * path)
 {
-	char * sql;
+	char *sql;
 	char **result;
-	int64_t detailID = 0;
-	int rows, i, ret = 1;
+	int rows, i, ret;
 
 	/* Invalidate the scanner cache so we don't insert files into non-existent containers */
 	valid_cache = 0;
 	remove_watch(fd, path);
-	sql = sqlite3_mprintf("SELECT ID from DETAILS where (PATH > '%q/' and PATH <= '%q/%c')"
-	                      " or PATH = '%q'", path, path, 0xFF, path);
-	if( (sql_get_table(db, sql, &result, &rows, NULL) == SQLITE_OK) )
+	sql = sqlite3_mprintf("SELECT ID from PLAYLISTS where PATH > '%q/' and PATH <= '%q/%c'",
+	                      path, path, 0xFF);
+	if( sql_get_table(db, sql, &result, &rows, NULL) == SQLITE_OK )
 	{
-		if( rows )
-		{
-			for( i=1; i <= rows; i++ )
-			{
-				detailID = strtoll(result[i], NULL, 10);
-				sql_exec(db, "DELETE from DETAILS where ID = %lld", detailID);
-				sql_exec(db, "DELETE from OBJECTS where DETAIL_ID = %lld", detailID);
-			}
-			ret = 0;
-		}
+		for( i = 1; i <= rows; i++ )
+			remove_playlist(strtoll(result[i], NULL, 10));
 		sqlite3_free_table(result);
 	}
 	sqlite3_free(sql);
-	/* Clean up any album art entries in the deleted directory */
-	sql_exec(db, "DELETE from ALBUM_ART where (PATH > '%q/' and PATH <= '%q/%c')", path, path, 0xFF);
+	sql = sqlite3_mprintf("(PATH > '%q/' and PATH <= '%q/%c') or PATH = '%q'", path, path, 0xFF, path);
+	ret = remove_details(sql) ? 0 : 1;
+	sqlite3_free(sql);
+	/* Clean up any album art entries in the deleted directory, and its art_cache */
+	sql_exec(db, "DELETE from ALBUM_ART where (PATH > '%q/' and PATH <= '%q/%c')"
+	             " or (PATH > '%q/art_cache%q/' and PATH <= '%q/art_cache%q/%c')",
+	         path, path, 0xFF, db_path, path, db_path, path, 0xFF);
+	art_trash_add(path);
 
 	return ret;
 }
 
-void *
-start_inotify(void)
+/* Move the watch on a directory to its new path.  Everything below it
+ * follows along, and the watch descriptors themselves survive the move. */
+static void
+rename_watches(const char *old, const char *new)
 {
-	struct pollfd pollfds[1];
-	int timeout = 1000;
-	char buffer[BUF_LEN];
-	char path_buf[PATH_MAX];
-	int length, i = 0;
-	char * esc_name = NULL;
-	struct stat st;
-	sigset_t set;
+	uint32_t i, off, parent, old_parent;
+	const char *name = new;
 
-	sigfillset(&set);
-	pthread_sigmask(SIG_BLOCK, &set, NULL);
-        
-	pollfds[0].fd = inotify_init();
-	pollfds[0].events = POLLIN;
+	/* Adding it gathers up whatever is below it by whole path */
+	i = watch_find(old, strlen(old));
+	if( !i )
+		i = watch_add(old);
+	if( !i )
+		return;
+	parent = watch_parent(new);
+	if( parent )
+		name = strrchr(new, '/') + 1;
+	off = watch_store_name(name);
+	if( !off )
+		return;
+	old_parent = WATCH(i)->parent;
+	watch_unlink(i);
+	watch_link(i, parent, off);
+	watch_release(old_parent);
+	if( watches.ntop > 1 )
+		watch_adopt(i, new);
+	watch_release(i);
+}
 
-	if ( pollfds[0].fd < 0 )
-		DPRINTF(E_ERROR, L_INOTIFY, "inotify_init() failed!\n");
+/* Which media types the media_dir holding path is scanned for */
+static media_types
+path_media_types(const char *path)
+{
+	struct media_dir_s *media_path;
 
-	while( scanning )
+	for( media_path = media_dirs; media_path; media_path = media_path->next )
 	{
-		if( quitting )
-			goto quitting;
-		sleep(1);
+		if( strncmp(path, media_path->path, strlen(media_path->path)) == 0 )
+			return media_path->types;
+	}
+
+	return ALL_MEDIA;
+}
+
+/* The Browse object ID of a directory */
+static char *
+dir_object_id(const char *path)
+{
+	struct media_dir_s *media_path;
+
+	for( media_path = media_dirs; media_path; media_path = media_path->next )
+	{
+		if( strcmp(path, media_path->path) == 0 &&
+		    (GETFLAG(MERGE_MEDIA_DIRS_MASK) || !media_dirs->next) )
+			return sqlite3_mprintf("%s", BROWSEDIR_ID);
+	}
+
+	return sql_get_text_field(db, "SELECT OBJECT_ID from OBJECTS o left join DETAILS d on (d.ID = o.DETAIL_ID)"
+	                              " where d.PATH = '%q' and REF_ID is NULL and CLASS = 'container.storageFolder'"
+	                              " and OBJECT_ID >= '" BROWSEDIR_ID "$' and OBJECT_ID < '" BROWSEDIR_ID "%%'", path);
+}
+
+/* Move the objects for a renamed file or directory to where it is now,
+ * keeping their DETAILS, so that nothing has to be parsed again.  Object
+ * IDs spell out the path of folders they are in, under Browse as well as
+ * under each media type's Folders, so the whole subtree gets new IDs, and
+ * everything that refers to them follows.  Returns 0 if the move was
+ * handled, otherwise it has to be treated as a removal and an insertion. */
+static int
+inotify_move(const char *old, const char *new, int is_dir)
+{
+	const char *bases[] = { BROWSEDIR_ID, MUSIC_DIR_ID, VIDEO_DIR_ID, IMAGE_DIR_ID, NULL };
+	char *old_id, *parent_id, *old_suffix, *new_suffix = NULL, *p;
+	char *new_dir, *old_name, *new_name, *old_esc, *new_esc;
+	int64_t detailID;
+	int i, ret = -1;
+
+	if( path_media_types(old) != path_media_types(new) )
+		return -1;
+	if( !is_dir )
+	{
+		const char *old_ext = strrchr(old, '.'), *new_ext = strrchr(new, '.');
+		/* What a file is depends on its extension */
+		if( !old_ext || !new_ext || strcmp(old_ext, new_ext) != 0 ||
+		    is_playlist(old) || is_caption(old) )
+			return -1;
+	}
+	old_id = sql_get_text_field(db, "SELECT OBJECT_ID from OBJECTS o join DETAILS d on (d.ID = o.DETAIL_ID)"
+	                                " where d.PATH = '%q' and REF_ID is NULL"
+	                                " and OBJECT_ID >= '" BROWSEDIR_ID "$' and OBJECT_ID < '" BROWSEDIR_ID "%%'", old);
+	if( !old_id )
+		return -1;
+	/* A file that was moved over another one replaces it */
+	if( sql_get_int_field(db, "SELECT count(*) from DETAILS where PATH = '%q'", new) > 0 )
+	{
+		if( is_dir )
+		{
+			sqlite3_free(old_id);
+			return -1;
+		}
+		inotify_remove_file(new);
+	}
+	new_dir = strdup(new);
+	parent_id = dir_object_id(dirname(new_dir));
+	if( !parent_id )
+		goto out;
+	detailID = sql_get_int64_field(db, "SELECT DETAIL_ID from OBJECTS where OBJECT_ID = '%q'", old_id);
+	old_suffix = old_id + strlen(BROWSEDIR_ID);
+	new_suffix = sqlite3_mprintf("%s$%llX", parent_id + strlen(BROWSEDIR_ID),
+	                             (long long)get_next_available_id(parent_id));
+	DPRINTF(E_DEBUG, L_INOTIFY, "Moving %s [%s] to %s [%s%s]\n", old, old_id, new, BROWSEDIR_ID, new_suffix);
+
+	valid_cache = 0;
+	for( i = 0; bases[i]; i++ )
+	{
+		const char *base = bases[i];
+		char *from, *to, *parent;
+		int from_len;
+
+		from = sqlite3_mprintf("%s%s", base, old_suffix);
+		if( sql_get_int_field(db, "SELECT count(*) from OBJECTS where OBJECT_ID = '%q'", from) <= 0 )
+		{
+			sqlite3_free(from);
+			continue;
+		}
+		to = sqlite3_mprintf("%s%s", base, new_suffix);
+		parent = sqlite3_mprintf("%s%s", base, parent_id + strlen(BROWSEDIR_ID));
+		/* The new parent may not have had anything of this type yet */
+		if( strcmp(base, BROWSEDIR_ID) != 0 &&
+		    sql_get_int_field(db, "SELECT count(*) from OBJECTS where OBJECT_ID = '%q'", parent) <= 0 &&
+		    (p = strrchr(parent_id, '$')) )
+		{
+			*p = '\0';
+			insert_directory(NULL, new, base, parent_id + strlen(BROWSEDIR_ID), strtol(p + 1, NULL, 16));
+			*p = '$';
+		}
+		from_len = strlen(from);
+		sql_exec(db, "UPDATE OBJECTS set OBJECT_ID = '%q' || substr(OBJECT_ID, %d),"
+		             " PARENT_ID = '%q' || substr(PARENT_ID, %d)"
+		             " where OBJECT_ID >= '%q$' and OBJECT_ID < '%q%%'",
+		             to, from_len + 1, to, from_len + 1, from, from);
+		sql_exec(db, "UPDATE OBJECTS set OBJECT_ID = '%q', PARENT_ID = '%q',"
+		             " PARENT = (SELECT ID from OBJECTS where OBJECT_ID = '%q') where OBJECT_ID = '%q'",
+		             to, parent, parent, from);
+		/* Don't leave an empty trail behind in the Folders of other types */
+		if( strcmp(base, BROWSEDIR_ID) != 0 )
+		{
+			while( (p = strrchr(from, '$')) && p - from > (int)strlen(base) )
+			{
+				*p = '\0';
+				if( sql_get_int_field(db, "SELECT count(*) from OBJECTS where PARENT_ID = '%q'", from) != 0 )
+					break;
+				sql_exec(db, "DELETE from OBJECTS where OBJECT_ID = '%q'", from);
+			}
+		}
+		sqlite3_free(parent);
+		sqlite3_free(to);
+		sqlite3_free(from);
+	}
+	/* Everything that refers to the Browse objects */
+	i = strlen(old_id);
+	sql_exec(db, "UPDATE OBJECTS set REF_ID = '%q%q' || substr(REF_ID, %d)"
+	             " where REF_ID = '%q' or (REF_ID >= '%q$' and REF_ID < '%q%%')",
+	             BROWSEDIR_ID, new_suffix, i + 1, old_id, old_id, old_id);
+
+	/* Paths, for the moved item and anything below it.  i counts bytes,
+	 * while substr() counts characters in TEXT. */
+	i = strlen(old);
+	sql_exec(db, "UPDATE DETAILS set PATH = '%q' || CAST(substr(CAST(PATH AS BLOB), %d) AS TEXT)"
+	             " where PATH = '%q' or (PATH >= '%q/' and PATH < '%q0')", new, i + 1, old, old, old);
+	sql_exec(db, "UPDATE ALBUM_ART set PATH = '%q' || CAST(substr(CAST(PATH AS BLOB), %d) AS TEXT)"
+	             " where PATH >= '%q/' and PATH < '%q0'", new, i + 1, old, old);
+	sql_exec(db, "UPDATE CAPTIONS set PATH = '%q' || CAST(substr(CAST(PATH AS BLOB), %d) AS TEXT)"
+	             " where PATH >= '%q/' and PATH < '%q0'", new, i + 1, old, old);
+	sql_exec(db, "UPDATE PLAYLISTS set PATH = '%q' || CAST(substr(CAST(PATH AS BLOB), %d) AS TEXT)"
+	             " where PATH >= '%q/' and PATH < '%q0'", new, i + 1, old, old);
+
+	/* And the name, if that changed too */
+	old_name = strrchr(old, '/') + 1;
+	new_name = strrchr(new, '/') + 1;
+	if( strcmp(old_name, new_name) != 0 )
+	{
+		old_esc = escape_tag(old_name, 1);
+		new_esc = escape_tag(new_name, 1);
+		if( is_dir )
+		{
+			sql_exec(db, "UPDATE OBJECTS set NAME = '%q' where DETAIL_ID = %lld and NAME = '%q'",
+			         new_esc, (long long)detailID, old_esc);
+			sql_exec(db, "UPDATE OBJECTS set NAME = '%q' where DETAIL_ID = %lld and NAME = '%q'",
+			         new_name, (long long)detailID, old_name);
+		}
+		else
+		{
+			strip_ext(old_esc);
+			strip_ext(new_esc);
+			sql_exec(db, "UPDATE OBJECTS set NAME = '%q' where DETAIL_ID = %lld and CLASS glob 'item*'",
+			         new_esc, (long long)detailID);
+		}
+		sql_exec(db, "UPDATE DETAILS set TITLE = '%q' where ID = %lld and TITLE = '%q'",
+		         new_esc, (long long)detailID, old_esc);
+		free(old_esc);
+		free(new_esc);
+	}
+	ret = 0;
+out:
+	sqlite3_free(new_suffix);
+	sqlite3_free(parent_id);
+	sqlite3_free(old_id);
+	free(new_dir);
+
+	return ret;
+}
+
+static void
+inotify_remove(int fd, const char *path, int is_dir)
+{
+	if( is_dir )
+		inotify_remove_directory(fd, path);
+	else
+		inotify_remove_file(path);
+}
+
+/* Put a file or directory that turned up (or changed) into the database */
+static void
+apply_appear(int fd, const char *path, uint32_t mask, int is_dir)
+{
+	char * esc_name = NULL;
+	struct stat st;
+
+	esc_name = modifyString(strdup(strrchr(path, '/') + 1), "&", "&amp;amp;", 0);
+	if ( is_dir )
+	{
+		DPRINTF(E_DEBUG, L_INOTIFY,  "The directory %s was %s.\n",
+			path, (mask & IN_MOVED_TO ? "moved here" : "created"));
+		inotify_insert_directory(fd, esc_name, path);
+	}
+	else if ( lstat(path, &st) == 0 )
+	{
+		if( (mask & (IN_MOVED_TO|IN_CREATE)) && (S_ISLNK(st.st_mode) || st.st_nlink > 1) )
+		{
+			DPRINTF(E_DEBUG, L_INOTIFY, "The %s link %s was %s.\n",
+				(S_ISLNK(st.st_mode) ? "symbolic" : "hard"),
+				path, (mask & IN_MOVED_TO ? "moved here" : "created"));
+			if( stat(path, &st) == 0 && S_ISDIR(st.st_mode) )
+				inotify_insert_directory(fd, esc_name, path);
+			else
+				inotify_insert_file(esc_name, path);
+		}
+		else if( mask & (IN_CLOSE_WRITE|IN_MOVED_TO) && st.st_size > 0 )
+		{
+			if( (mask & IN_MOVED_TO) ||
+			    (sql_get_int_field(db, "SELECT TIMESTAMP from DETAILS where PATH = '%q'", path) != st.st_mtime) )
+			{
+				DPRINTF(E_DEBUG, L_INOTIFY, "The file %s was %s.\n",
+					path, (mask & IN_MOVED_TO ? "moved here" : "changed"));
+				inotify_insert_file(esc_name, path);
+			}
+		}
+	}
+	free(esc_name);
+}
+
+static void
+apply_move(int fd, const char *old, const char *new, int is_dir)
+{
+	if( inotify_move(old, new, is_dir) == 0 )
+	{
+		DPRINTF(E_DEBUG, L_INOTIFY, "The %s %s was moved to %s.\n",
+			(is_dir ? "directory" : "file"), old, new);
+		if( is_dir )
+			rename_watches(old, new);
+		return;
+	}
+	inotify_remove(fd, old, is_dir);
+	apply_appear(fd, new, IN_MOVED_TO, is_dir);
+}
+
+/* Changes wait here until their path has been quiet for inotify_delay
+ * seconds, so that a file still being written is parsed once it's done,
+ * and one that comes and goes again is never parsed at all.  Anything
+ * that happens under a directory that is itself waiting to be added is
+ * left to the walk of that directory. */
+struct change
+{
+	struct change *next;		/* in the hash chain */
+	struct change *older, *newer;	/* in order of first event */
+	long long last;			/* when the last event came in */
+	uint32_t mask;			/* IN_CREATE, IN_CLOSE_WRITE and IN_MOVED_TO seen */
+	int is_dir;
+	int created;			/* wasn't there before, so can go without a trace */
+	int gone;			/* was last seen being deleted or moved away */
+	char *from;			/* where it was moved from */
+	char path[];
+};
+
+static struct {
+	struct change **buckets;
+	unsigned int size;
+	unsigned int count;
+	struct change *oldest, *newest;
+} changes;
+
+static long long
+monotonic_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+static unsigned int
+path_hash(const char *path)
+{
+	unsigned int hash = 2166136261u;
+
+	while( *path )
+		hash = (hash ^ (unsigned char)*path++) * 16777619u;
+
+	return hash;
+}
+
+static struct change *
+change_find(const char *path)
+{
+	struct change *c;
+
+	if( !changes.size )
+		return NULL;
+	for( c = changes.buckets[path_hash(path) & (changes.size - 1)]; c; c = c->next )
+		if( strcmp(c->path, path) == 0 )
+			return c;
+
+	return NULL;
+}
+
+static struct change *
+change_add(const char *path, int is_dir)
+{
+	struct change *c, *next, **buckets;
+	unsigned int i, slot;
+
+	if( changes.count >= changes.size )
+	{
+		unsigned int size = changes.size ? changes.size * 2 : 256;
+
+		buckets = calloc(size, sizeof(*buckets));
+		if( !buckets )
+			return NULL;
+		for( i = 0; i < changes.size; i++ )
+		{
+			for( c = changes.buckets[i]; c; c = next )
+			{
+				next = c->next;
+				slot = path_hash(c->path) & (size - 1);
+				c->next = buckets[slot];
+				buckets[slot] = c;
+			}
+		}
+		free(changes.buckets);
+		changes.buckets = buckets;
+		changes.size = size;
+	}
+	c = calloc(1, sizeof(*c) + strlen(path) + 1);
+	if( !c )
+		return NULL;
+	strcpy(c->path, path);
+	c->is_dir = is_dir;
+	slot = path_hash(path) & (changes.size - 1);
+	c->next = changes.buckets[slot];
+	changes.buckets[slot] = c;
+	c->older = changes.newest;
+	if( changes.newest )
+		changes.newest->newer = c;
+	else
+		changes.oldest = c;
+	changes.newest = c;
+	changes.count++;
+
+	return c;
+}
+
+static void
+change_free(struct change *c)
+{
+	struct change **p;
+
+	for( p = &changes.buckets[path_hash(c->path) & (changes.size - 1)]; *p != c; p = &(*p)->next )
+		continue;
+	*p = c->next;
+	if( c->older )
+		c->older->newer = c->newer;
+	else
+		changes.oldest = c->newer;
+	if( c->newer )
+		c->newer->older = c->older;
+	else
+		changes.newest = c->older;
+	changes.count--;
+	free(c->from);
+	free(c);
+}
+
+/* Whatever is waiting under a directory that was moved, or was moved
+ * from there, now waits at its new place.  The events named the old one. */
+static void
+changes_move_under(const char *old, const char *new)
+{
+	char path[PATH_MAX];
+	struct change *c, *n, *newer;
+	size_t len = strlen(old);
+
+	for( c = changes.oldest; c; c = newer )
+	{
+		newer = c->newer;
+		if( c->from && strncmp(c->from, old, len) == 0 && c->from[len] == '/' )
+		{
+			snprintf(path, sizeof(path), "%s%s", new, c->from + len);
+			free(c->from);
+			c->from = strdup(path);
+		}
+		if( strncmp(c->path, old, len) != 0 || c->path[len] != '/' )
+			continue;
+		snprintf(path, sizeof(path), "%s%s", new, c->path + len);
+		n = change_find(path);
+		if( !n )
+			n = change_add(path, c->is_dir);
+		if( !n )
+			continue;
+		n->last = c->last;
+		n->mask |= c->mask;
+		n->created = c->created;
+		n->gone = c->gone;
+		if( c->from && !n->from )
+		{
+			n->from = c->from;
+			c->from = NULL;
+		}
+		change_free(c);
+	}
+}
+
+/* Forget whatever was waiting under a directory that has gone */
+static void
+changes_drop_under(const char *path)
+{
+	struct change *c, *newer;
+	size_t len = strlen(path);
+
+	for( c = changes.oldest; c; c = newer )
+	{
+		newer = c->newer;
+		if( strncmp(c->path, path, len) == 0 && (c->path[len] == '/' || c->path[len] == '\0') )
+			change_free(c);
+	}
+}
+
+/* Whether path is under a directory that is waiting to be added, and
+ * will be picked up along with it.  That directory waits a little longer. */
+static int
+change_covered(const char *path, long long now)
+{
+	char dir[PATH_MAX];
+	struct change *c;
+	char *p;
+
+	if( !changes.count )
+		return 0;
+	strncpyt(dir, path, sizeof(dir));
+	while( (p = strrchr(dir, '/')) && p != dir )
+	{
+		*p = '\0';
+		c = change_find(dir);
+		if( c && c->is_dir && !c->gone )
+		{
+			c->last = now;
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+static void
+change_apply(int fd, struct change *c)
+{
+	if( c->gone )
+	{
+		DPRINTF(E_DEBUG, L_INOTIFY, "The %s %s is gone.\n",
+			(c->is_dir ? "directory" : "file"), c->path);
+		if( c->from )
+			inotify_remove(fd, c->from, c->is_dir);
+		if( !c->created )
+			inotify_remove(fd, c->path, c->is_dir);
+		return;
+	}
+	if( c->from )
+		apply_move(fd, c->from, c->path, c->is_dir);
+	/* Directories were watched as soon as they turned up */
+	if( c->mask )
+		apply_appear(c->is_dir ? -1 : fd, c->path, c->mask, c->is_dir);
+}
+
+/* Apply the changes that have been quiet for long enough, or all of them */
+static void
+changes_flush(int fd, int all)
+{
+	struct change *c, *newer;
+	long long now = monotonic_ms();
+	long long delay = runtime_vars.inotify_delay * 1000LL;
+
+	for( c = changes.oldest; c; c = newer )
+	{
+		newer = c->newer;
+		if( !all && now - c->last < delay )
+			continue;
+		change_apply(fd, c);
+		change_free(c);
+		sql_batch_step(db);
+	}
+}
+
+/* How long poll() can wait before something is due */
+static int
+changes_timeout(void)
+{
+	struct change *c;
+	long long now = monotonic_ms();
+	long long delay = runtime_vars.inotify_delay * 1000LL;
+	long long wait = 1000;
+
+	for( c = changes.oldest; c; c = c->newer )
+	{
+		if( c->last + delay - now < wait )
+			wait = c->last + delay - now;
+	}
+
+	return wait > 0 ? wait : 0;
+}
+
+static void
+queue_appear(int fd, const char *path, uint32_t mask, int is_dir)
+{
+	long long now = monotonic_ms();
+	struct change *c;
+
+	if( !runtime_vars.inotify_delay )
+	{
+		apply_appear(fd, path, mask, is_dir);
+		return;
+	}
+	if( is_dir )
+		add_dir_watch(fd, (char *)path, NULL);
+	if( change_covered(path, now) )
+		return;
+	c = change_find(path);
+	if( !c )
+	{
+		c = change_add(path, is_dir);
+		if( !c )
+		{
+			apply_appear(fd, path, mask, is_dir);
+			return;
+		}
+		c->created = !!(mask & (IN_CREATE|IN_MOVED_TO));
+	}
+	c->gone = 0;
+	c->is_dir = is_dir;
+	c->mask |= mask;
+	c->last = now;
+}
+
+static void
+queue_gone(int fd, const char *path, int is_dir)
+{
+	long long now = monotonic_ms();
+	struct change *c;
+
+	if( !runtime_vars.inotify_delay )
+	{
+		inotify_remove(fd, path, is_dir);
+		return;
+	}
+	if( change_covered(path, now) )
+		return;
+	c = change_find(path);
+	if( is_dir )
+	{
+		int created = c && c->created;
+
+		/* Nothing is left to wait for underneath */
+		changes_drop_under(path);
+		if( created )
+			return;
+		/* Everything else goes in first, in case it came from here */
+		changes_flush(fd, 1);
+		DPRINTF(E_DEBUG, L_INOTIFY, "The directory %s is gone.\n", path);
+		inotify_remove(fd, path, is_dir);
+		return;
+	}
+	if( !c )
+	{
+		c = change_add(path, is_dir);
+		if( !c )
+		{
+			inotify_remove(fd, path, is_dir);
+			return;
+		}
+	}
+	c->gone = 1;
+	c->last = now;
+}
+
+static void
+queue_move(int fd, const char *old, const char *new, int is_dir)
+{
+	long long now = monotonic_ms();
+	struct change *c;
+
+	if( !runtime_vars.inotify_delay )
+	{
+		apply_move(fd, old, new, is_dir);
+		return;
+	}
+	/* Either end waiting on something else means a move is of no help */
+	if( change_covered(old, now) || change_covered(new, now) ||
+	    change_find(old) || change_find(new) )
+	{
+		queue_gone(fd, old, is_dir);
+		queue_appear(fd, new, IN_MOVED_TO, is_dir);
+		return;
+	}
+	if( is_dir )
+	{
+		apply_move(fd, old, new, is_dir);
+		changes_move_under(old, new);
+		return;
+	}
+	c = change_add(new, is_dir);
+	if( !c || !(c->from = strdup(old)) )
+	{
+		if( c )
+			change_free(c);
+		apply_move(fd, old, new, is_dir);
+		return;
+	}
+	c->last = now;
+}
+
+/* Something that was moved away, held back in case the next
+ * event says where it went */
+static struct {
+	uint32_t cookie;
+	int is_dir;
+	char path[PATH_MAX];
+} moved;
+
+/* Act on a change to name in the directory dir.  mask holds IN_* flags,
+ * and fd is the inotify descriptor, or -1 when no watches are needed. */
+static void
+inotify_handle(int fd, uint32_t mask, uint32_t cookie, const char *dir, const char *name)
+{
+	char path_buf[PATH_MAX];
+
+	if( *name == '.' )
+		return;
+	snprintf(path_buf, sizeof(path_buf), "%s/%s", dir, name);
+	if( moved.cookie && (mask & IN_MOVED_TO) && cookie == moved.cookie )
+	{
+		moved.cookie = 0;
+		queue_move(fd, moved.path, path_buf, moved.is_dir);
+		return;
+	}
+	else if( moved.cookie )
+	{
+		queue_gone(fd, moved.path, moved.is_dir);
+		moved.cookie = 0;
+	}
+	if ( mask & (IN_CLOSE_WRITE|IN_MOVED_TO|IN_CREATE) )
+	{
+		queue_appear(fd, path_buf, mask & (IN_CLOSE_WRITE|IN_MOVED_TO|IN_CREATE), mask & IN_ISDIR);
+	}
+	else if ( mask & (IN_DELETE|IN_MOVED_FROM) )
+	{
+		DPRINTF(E_DEBUG, L_INOTIFY, "The %s %s was %s.\n",
+			(mask & IN_ISDIR ? "directory" : "file"),
+			path_buf, (mask & IN_MOVED_FROM ? "moved away" : "deleted"));
+		/* Without a cookie there is nothing to pair it with */
+		if( (mask & IN_MOVED_FROM) && cookie )
+		{
+			moved.cookie = cookie;
+			moved.is_dir = !!(mask & IN_ISDIR);
+			strncpyt(moved.path, path_buf, sizeof(moved.path));
+		}
+		else
+			queue_gone(fd, path_buf, mask & IN_ISDIR);
+	}
+}
+
+#ifdef USE_FANOTIFY
+/* A media_dir as fanotify sees it.  Paths come back from the kernel fully
+ * resolved, so real is what gets matched and path what gets stored. */
+struct fan_root
+{
+	const char *path;
+	char *real;
+	size_t len;
+	fsid_t fsid;
+	int fd;		/* for open_by_handle_at() */
+	struct fan_root *next;
+};
+
+static struct fan_root *fan_roots;
+static size_t fan_bytes;
+
+/* Events name a directory by its file handle, and resolving that gives
+ * where the directory is by the time we read the event, which after a
+ * burst of moves isn't where it was.  So the directories are kept in the
+ * watch table, which follows moves as they are applied, like inotify's,
+ * under a made up watch descriptor that is looked up by handle. */
+struct fan_dir
+{
+	struct fan_dir *next;
+	int wd;
+	unsigned int len;
+	unsigned char handle[];	/* a struct file_handle */
+};
+
+static struct {
+	struct fan_dir **by_handle;
+	struct fan_dir **by_wd;	/* indexed by descriptor */
+	unsigned int hsize;
+	unsigned int count;
+	int used;		/* descriptors handed out */
+	int free;		/* none below this one is free */
+} fan_dirs;
+
+static uint32_t
+handle_hash(const unsigned char *handle, unsigned int len)
+{
+	uint32_t hash = 2166136261u;
+
+	while( len-- )
+		hash = (hash ^ *handle++) * 16777619u;
+
+	return hash;
+}
+
+static int
+fan_dir_find(const struct file_handle *handle, unsigned int len)
+{
+	struct fan_dir *d;
+
+	if( !fan_dirs.hsize )
+		return -1;
+	for( d = fan_dirs.by_handle[handle_hash((const unsigned char *)handle, len) & (fan_dirs.hsize - 1)]; d; d = d->next )
+		if( d->len == len && memcmp(d->handle, handle, len) == 0 )
+			return d->wd;
+
+	return -1;
+}
+
+static int
+fan_dir_add(const struct file_handle *handle, unsigned int len)
+{
+	struct fan_dir *d, *next, **by_handle;
+	unsigned int i, slot;
+	int wd;
+
+	if( fan_dirs.count >= fan_dirs.hsize )
+	{
+		unsigned int hsize = fan_dirs.hsize ? fan_dirs.hsize * 2 : 1024;
+
+		by_handle = calloc(hsize, sizeof(*by_handle));
+		if( !by_handle )
+			return -1;
+		for( i = 0; i < fan_dirs.hsize; i++ )
+		{
+			for( d = fan_dirs.by_handle[i]; d; d = next )
+			{
+				next = d->next;
+				slot = handle_hash(d->handle, d->len) & (hsize - 1);
+				d->next = by_handle[slot];
+				by_handle[slot] = d;
+			}
+		}
+		free(fan_dirs.by_handle);
+		fan_dirs.by_handle = by_handle;
+		fan_bytes += (hsize - fan_dirs.hsize) * sizeof(*by_handle);
+		fan_dirs.hsize = hsize;
+	}
+	while( fan_dirs.free < fan_dirs.used && fan_dirs.by_wd[fan_dirs.free] )
+		fan_dirs.free++;
+	wd = fan_dirs.free;
+	if( wd >= fan_dirs.used )
+	{
+		if( !(wd & (wd - 1)) )
+		{
+			struct fan_dir **by_wd = realloc(fan_dirs.by_wd, (wd ? wd * 2 : 1024) * sizeof(*by_wd));
+
+			if( !by_wd )
+				return -1;
+			fan_dirs.by_wd = by_wd;
+			fan_bytes += (wd ? wd : 1024) * sizeof(*by_wd);
+		}
+		fan_dirs.used++;
+	}
+	d = malloc(sizeof(struct fan_dir) + len);
+	if( !d )
+		return -1;
+	d->wd = wd;
+	d->len = len;
+	memcpy(d->handle, handle, len);
+	slot = handle_hash(d->handle, len) & (fan_dirs.hsize - 1);
+	d->next = fan_dirs.by_handle[slot];
+	fan_dirs.by_handle[slot] = d;
+	fan_dirs.by_wd[wd] = d;
+	fan_dirs.count++;
+	fan_bytes += sizeof(struct fan_dir) + len;
+
+	return wd;
+}
+
+static void
+fan_dir_drop(int wd)
+{
+	struct fan_dir *d, **p;
+
+	if( wd < 0 || wd >= fan_dirs.used || !(d = fan_dirs.by_wd[wd]) )
+		return;
+	p = &fan_dirs.by_handle[handle_hash(d->handle, d->len) & (fan_dirs.hsize - 1)];
+	while( *p != d )
+		p = &(*p)->next;
+	*p = d->next;
+	fan_dirs.by_wd[wd] = NULL;
+	if( wd < fan_dirs.free )
+		fan_dirs.free = wd;
+	fan_dirs.count--;
+	fan_bytes -= sizeof(struct fan_dir) + d->len;
+	free(d);
+}
+
+/* The mark covers the whole filesystem, so most events can be for
+ * directories outside the media_dirs.  Finding that out costs an
+ * open_by_handle_at() and a readlink(), so the ones seen last are
+ * remembered, one per slot. */
+#define FAN_FOREIGN_SLOTS 256
+
+struct fan_foreign
+{
+	const struct fan_root *root;	/* the filesystem it is on */
+	unsigned int len;
+	unsigned char handle[];
+};
+
+static struct fan_foreign *fan_foreign[FAN_FOREIGN_SLOTS];
+
+static struct fan_foreign **
+fan_foreign_slot(const struct file_handle *handle, unsigned int len)
+{
+	return &fan_foreign[handle_hash((const unsigned char *)handle, len) & (FAN_FOREIGN_SLOTS - 1)];
+}
+
+static int
+fan_foreign_find(const struct fan_root *r, const struct file_handle *handle, unsigned int len)
+{
+	struct fan_foreign *f = *fan_foreign_slot(handle, len);
+
+	return f && f->root == r && f->len == len && memcmp(f->handle, handle, len) == 0;
+}
+
+/* A directory moved in from elsewhere on the filesystem keeps its handle */
+static void
+fan_foreign_forget(const struct file_handle *handle, unsigned int len)
+{
+	struct fan_foreign **slot = fan_foreign_slot(handle, len);
+
+	if( !*slot || (*slot)->len != len || memcmp((*slot)->handle, handle, len) != 0 )
+		return;
+	fan_bytes -= sizeof(struct fan_foreign) + (*slot)->len;
+	free(*slot);
+	*slot = NULL;
+}
+
+/* Takes the slot over from whichever one had it */
+static void
+fan_foreign_add(const struct fan_root *r, const struct file_handle *handle, unsigned int len)
+{
+	struct fan_foreign **slot = fan_foreign_slot(handle, len);
+	struct fan_foreign *f;
+
+	f = malloc(sizeof(struct fan_foreign) + len);
+	if( !f )
+		return;
+	f->root = r;
+	f->len = len;
+	memcpy(f->handle, handle, len);
+	if( *slot )
+	{
+		fan_bytes -= sizeof(struct fan_foreign) + (*slot)->len;
+		free(*slot);
+	}
+	*slot = f;
+	fan_bytes += sizeof(struct fan_foreign) + len;
+}
+
+/* Note that the directory at path, which has this handle, is one of ours */
+static int
+fan_watch(const char *path, const struct file_handle *handle, unsigned int len)
+{
+	uint32_t i;
+	int wd;
+
+	wd = fan_dir_find(handle, len);
+	i = watch_find(path, strlen(path));
+	if( i && WATCH(i)->wd >= 0 )
+	{
+		if( WATCH(i)->wd == wd )
+			return wd;
+		/* Something else used to be there */
+		fan_dir_drop(WATCH(i)->wd);
+		watch_clear_wd(i);
+	}
+	if( wd >= 0 )
+		watch_drop(wd);
+	else
+	{
+		fan_foreign_forget(handle, len);
+		wd = fan_dir_add(handle, len);
+	}
+	if( wd < 0 )
+		return -1;
+	if( !i )
+		i = watch_find(path, strlen(path));
+	if( !i )
+		i = watch_add(path);
+	if( !i )
+	{
+		fan_dir_drop(wd);
+		return -1;
+	}
+	watch_set_wd(i, wd);
+
+	return wd;
+}
+
+static int
+fanotify_add_watch(const char *path)
+{
+	union {
+		struct file_handle handle;
+		unsigned char buf[sizeof(struct file_handle) + MAX_HANDLE_SZ];
+	} h;
+	int mount_id;
+
+	if( !fan_roots )
+		return -1;
+	h.handle.handle_bytes = MAX_HANDLE_SZ;
+	if( name_to_handle_at(AT_FDCWD, path, &h.handle, &mount_id, 0) != 0 )
+		return -1;
+
+	return fan_watch(path, &h.handle, sizeof(struct file_handle) + h.handle.handle_bytes);
+}
+
+static int
+watch_is_below(uint32_t j, uint32_t i)
+{
+	while( (j = WATCH(j)->parent) )
+		if( j == i )
+			return 1;
+
+	return 0;
+}
+
+/* There are no IN_IGNORED events to clear up after a directory that went,
+ * so it and anything still below it are dropped here */
+static void
+fanotify_remove_watch(uint32_t i)
+{
+	uint32_t j;
+	int wd;
+
+	if( WATCH(i)->children )
+	{
+		for( j = 1; j < watches.used; j++ )
+		{
+			if( !WATCH(j)->name || WATCH(j)->wd < 0 || !watch_is_below(j, i) )
+				continue;
+			wd = WATCH(j)->wd;
+			fan_dir_drop(wd);
+			watch_drop(wd);
+		}
+	}
+	wd = WATCH(i)->wd;
+	fan_dir_drop(wd);
+	watch_drop(wd);
+}
+
+static void
+fanotify_stop(void)
+{
+	struct fan_root *r;
+	struct fan_dir *d;
+	int wd;
+
+	for( wd = 0; wd < fan_dirs.used; wd++ )
+		if( (d = fan_dirs.by_wd[wd]) )
+			free(d);
+	free(fan_dirs.by_handle);
+	free(fan_dirs.by_wd);
+	memset(&fan_dirs, 0, sizeof(fan_dirs));
+	for( wd = 0; wd < FAN_FOREIGN_SLOTS; wd++ )
+	{
+		free(fan_foreign[wd]);
+		fan_foreign[wd] = NULL;
+	}
+	fan_bytes = 0;
+	while( (r = fan_roots) )
+	{
+		fan_roots = r->next;
+		close(r->fd);
+		free(r->real);
+		free(r);
+	}
+}
+
+/* Mark the filesystem of every media_dir.  Returns the fanotify descriptor,
+ * or -1 if the kernel or our privileges won't allow it. */
+static int
+fanotify_start(void)
+{
+	struct media_dir_s *media_path;
+	struct fan_root *r;
+	struct statfs sfs;
+	uint64_t mask = FAN_CREATE|FAN_DELETE|FAN_CLOSE_WRITE|FAN_ONDIR;
+	int fd;
+
+	fd = fanotify_init(FAN_CLASS_NOTIF|FAN_REPORT_DFID_NAME, O_RDONLY|O_LARGEFILE);
+	if( fd < 0 )
+	{
+		DPRINTF(E_WARN, L_INOTIFY, "fanotify_init() failed [%s]\n", strerror(errno));
+		return -1;
+	}
+#ifdef FAN_RENAME
+	/* Both ends of a rename in one event, where the kernel has it */
+	mask |= FAN_RENAME;
+#endif
+	for( media_path = media_dirs; media_path != NULL; media_path = media_path->next )
+	{
+		if( fanotify_mark(fd, FAN_MARK_ADD|FAN_MARK_FILESYSTEM, mask, AT_FDCWD, media_path->path) != 0 )
+		{
+#ifdef FAN_RENAME
+			if( errno == EINVAL && (mask & FAN_RENAME) )
+			{
+				mask = (mask & ~FAN_RENAME) | FAN_MOVED_FROM|FAN_MOVED_TO;
+				if( fanotify_mark(fd, FAN_MARK_ADD|FAN_MARK_FILESYSTEM, mask, AT_FDCWD, media_path->path) == 0 )
+					goto marked;
+			}
+#endif
+			DPRINTF(E_WARN, L_INOTIFY, "fanotify_mark(%s) failed [%s]\n",
+				media_path->path, strerror(errno));
+			goto error;
+		}
+#ifdef FAN_RENAME
+marked:
+#endif
+		r = calloc(1, sizeof(struct fan_root));
+		if( !r )
+			goto error;
+		r->next = fan_roots;
+		fan_roots = r;
+		r->path = media_path->path;
+		r->fd = open(media_path->path, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+		r->real = realpath(media_path->path, NULL);
+		if( r->fd < 0 || !r->real || fstatfs(r->fd, &sfs) != 0 )
+		{
+			DPRINTF(E_WARN, L_INOTIFY, "Could not open %s [%s]\n",
+				media_path->path, strerror(errno));
+			goto error;
+		}
+		r->len = strlen(r->real);
+		r->fsid = sfs.f_fsid;
+		fan_bytes += sizeof(struct fan_root) + r->len + 1;
+		DPRINTF(E_DEBUG, L_INOTIFY, "Watching the filesystem of %s\n", media_path->path);
+	}
+
+	return fd;
+error:
+	fanotify_stop();
+	close(fd);
+	return -1;
+}
+
+/* Turn the directory in an info record into the path we store it under.
+ * Returns the name of the entry, or NULL for anything outside the
+ * media_dirs and anything hidden, which is remembered as foreign. */
+static const char *
+fanotify_path(const struct fanotify_event_info_fid *fid, char *dir, size_t len)
+{
+	struct file_handle *handle = (struct file_handle *)fid->handle;
+	size_t hlen = sizeof(struct file_handle) + handle->handle_bytes;
+	const char *name = (const char *)handle->f_handle + handle->handle_bytes;
+	struct fan_root *fs, *r;
+	char proc[32];
+	char real[PATH_MAX];
+	const char *p;
+	ssize_t n;
+	int dfd, wd;
+
+	wd = fan_dir_find(handle, hlen);
+	if( wd >= 0 && get_path_from_wd(wd, dir, len) )
+		return name;
+
+	/* One we haven't seen yet, so ask where it is now */
+	for( fs = fan_roots; fs; fs = fs->next )
+		if( memcmp(&fs->fsid, &fid->fsid, sizeof(fs->fsid)) == 0 )
+			break;
+	if( !fs || fan_foreign_find(fs, handle, hlen) )
+		return NULL;
+	dfd = open_by_handle_at(fs->fd, handle, O_PATH);
+	if( dfd < 0 )
+	{
+		if( errno != ESTALE )
+			DPRINTF(E_WARN, L_INOTIFY, "open_by_handle_at() failed [%s]\n", strerror(errno));
+		return NULL;
+	}
+	snprintf(proc, sizeof(proc), "/proc/self/fd/%d", dfd);
+	n = readlink(proc, real, sizeof(real) - 1);
+	close(dfd);
+	if( n <= 0 )
+		return NULL;
+	real[n] = '\0';
+	for( r = fan_roots; r; r = r->next )
+	{
+		p = real + r->len;
+		if( strncmp(real, r->real, r->len) == 0 && (*p == '\0' || *p == '/') )
+			break;
+	}
+	if( !r || strstr(p, "/.") )
+	{
+		fan_foreign_add(fs, handle, hlen);
+		return NULL;
+	}
+	snprintf(dir, len, "%s%s", r->path, p);
+	fan_watch(dir, handle, hlen);
+
+	return name;
+}
+
+static void
+fanotify_handle(int length, const char *buffer)
+{
+	static uint32_t cookie;
+	const struct fanotify_event_metadata *event;
+	const struct fanotify_event_info_header *info;
+	const char *name, *end;
+	char dir[PATH_MAX];
+	uint32_t mask;
+
+	for( event = (const struct fanotify_event_metadata *)buffer;
+	     FAN_EVENT_OK(event, length);
+	     event = FAN_EVENT_NEXT(event, length) )
+	{
+		if( event->mask & FAN_Q_OVERFLOW )
+		{
+			DPRINTF(E_WARN, L_INOTIFY, "fanotify queue overflowed, some changes were missed\n");
+			continue;
+		}
+		mask = 0;
+		if( event->mask & FAN_CREATE )
+			mask |= IN_CREATE;
+		if( event->mask & FAN_DELETE )
+			mask |= IN_DELETE;
+		if( event->mask & FAN_CLOSE_WRITE )
+			mask |= IN_CLOSE_WRITE;
+		if( event->mask & FAN_MOVED_FROM )
+			mask |= IN_MOVED_FROM;
+		if( event->mask & FAN_MOVED_TO )
+			mask |= IN_MOVED_TO;
+		if( event->mask & FAN_ONDIR )
+			mask |= IN_ISDIR;
+		if( ++cookie == 0 )
+			cookie = 1;
+		end = (const char *)event + event->event_len;
+		for( info = (const void *)((const char *)event + event->metadata_len);
+		     (const char *)info + sizeof(*info) <= end && info->len;
+		     info = (const void *)((const char *)info + info->len) )
+		{
+			uint32_t m = mask, c = 0;
+
+			switch( info->info_type )
+			{
+			case FAN_EVENT_INFO_TYPE_DFID_NAME:
+				break;
+#ifdef FAN_RENAME
+			/* Fed through as an inotify style move, with a cookie
+			 * of our own to pair the halves */
+			case FAN_EVENT_INFO_TYPE_OLD_DFID_NAME:
+				m |= IN_MOVED_FROM;
+				c = cookie;
+				break;
+			case FAN_EVENT_INFO_TYPE_NEW_DFID_NAME:
+				m |= IN_MOVED_TO;
+				c = cookie;
+				break;
+#endif
+			default:
+				continue;
+			}
+			name = fanotify_path((const struct fanotify_event_info_fid *)info, dir, sizeof(dir));
+			if( !name || !*name )
+				continue;
+			inotify_handle(-1, m, c, dir, name);
+			sql_batch_step(db);
+		}
+	}
+}
+#endif
+
+void
+inotify_watch_stats(struct watch_stats *stats)
+{
+	stats->backend = backend;
+	stats->watches = watches.watched;
+	stats->bytes = watch_bytes();
+#ifdef USE_FANOTIFY
+	stats->bytes += fan_bytes;
+#endif
+}
+
+void *
+start_inotify(void)
+{
+	struct pollfd pollfds[1];
+	int timeout;
+	char buffer[BUF_LEN] __attribute__((aligned(8)));
+	char path_buf[PATH_MAX];
+	int length, i = 0;
+	int fd = -1;	/* for watches, when inotify is what we got */
+	sigset_t set;
+
+	sigfillset(&set);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+	pollfds[0].fd = -1;
+	pollfds[0].events = POLLIN;
+
+	while( scanning || updating )
+	{
+		if( quitting )
+			goto quitting;
+		sleep(1);
+	}
+	/* The scanner is done with the database, so open our own
+	 * connection for writing changes */
+	snprintf(path_buf, sizeof(path_buf), "%s/files.db", db_path);
+	if (sql_open(path_buf, &db) != 0)
+	{
+		DPRINTF(E_ERROR, L_INOTIFY, "Failed to open sqlite database!\n");
+		goto quitting;
+	}
+#ifdef USE_FANOTIFY
+	if( GETFLAG(FANOTIFY_MASK) )
+	{
+		pollfds[0].fd = fanotify_start();
+		if( pollfds[0].fd < 0 )
+			DPRINTF(E_WARN, L_INOTIFY, "Falling back to inotify\n");
+		else
+		{
+			inotify_create_watches(-1);
+			backend = "fanotify";
+		}
+	}
+#endif
+	if( pollfds[0].fd < 0 )
+	{
+		fd = pollfds[0].fd = inotify_init();
+		if ( pollfds[0].fd < 0 )
+			DPRINTF(E_ERROR, L_INOTIFY, "inotify_init() failed!\n");
+		inotify_create_watches(fd);
+		backend = "inotify";
 	}
-	inotify_create_watches(pollfds[0].fd);
 	if (setpriority(PRIO_PROCESS, 0, 19) == -1)
 		DPRINTF(E_WARN, L_INOTIFY,  "Failed to reduce inotify thread priority\n");
 	sqlite3_release_memory(1<<31);
@@ -675,9 +2512,27 @@ start_inotify(void)
         
 	while( !quitting )
 	{
+		timeout = changes_timeout();
+		/* Give the other half of a move time to turn up */
+		if( moved.cookie && timeout < 100 )
+			timeout = 100;
                 length = poll(pollfds, 1, timeout);
 		if( !length )
 		{
+			/* Nothing turned up to pair with a move, so it left the media_dirs */
+			if( moved.cookie )
+			{
+				queue_gone(fd, moved.path, moved.is_dir);
+				moved.cookie = 0;
+			}
+			if( changes.count )
+			{
+				sql_batch_begin(db);
+				changes_flush(fd, 0);
+			}
+			/* Things have gone quiet, so let Browse see the changes */
+			sql_batch_end(db);
+			art_trash_start();
 			if( next_pl_fill && (time(NULL) >= next_pl_fill) )
 			{
 				fill_playlists();
@@ -698,67 +2553,36 @@ start_inotify(void)
 			buffer[BUF_LEN-1] = '\0';
 		}
 
-		i = 0;
-		while( i < length )
+		sql_batch_begin(db);
+#ifdef USE_FANOTIFY
+		if( fd < 0 )
+			fanotify_handle(length, buffer);
+		else
+#endif
+		for( i = 0; i < length; i += EVENT_SIZE + ((struct inotify_event *)&buffer[i])->len )
 		{
 			struct inotify_event * event = (struct inotify_event *) &buffer[i];
-			if( event->len )
+			if( event->mask & IN_IGNORED )
+				watch_drop(event->wd);
+			else if( event->len && get_path_from_wd(event->wd, path_buf, sizeof(path_buf)) )
 			{
-				if( *(event->name) == '.' )
-				{
-					i += EVENT_SIZE + event->len;
-					continue;
-				}
-				esc_name = modifyString(strdup(event->name), "&", "&amp;amp;", 0);
-				snprintf(path_buf, sizeof(path_buf), "%s/%s", get_path_from_wd(event->wd), event->name);
-				if ( event->mask & IN_ISDIR && (event->mask & (IN_CREATE|IN_MOVED_TO)) )
-				{
-					DPRINTF(E_DEBUG, L_INOTIFY,  "The directory %s was %s.\n",
-						path_buf, (event->mask & IN_MOVED_TO ? "moved here" : "created"));
-					inotify_insert_directory(pollfds[0].fd, esc_name, path_buf);
-				}
-				else if ( (event->mask & (IN_CLOSE_WRITE|IN_MOVED_TO|IN_CREATE)) &&
-				          (lstat(path_buf, &st) == 0) )
-				{
-					if( (event->mask & (IN_MOVED_TO|IN_CREATE)) && (S_ISLNK(st.st_mode) || st.st_nlink > 1) )
-					{
-						DPRINTF(E_DEBUG, L_INOTIFY, "The %s link %s was %s.\n",
-							(S_ISLNK(st.st_mode) ? "symbolic" : "hard"),
-							path_buf, (event->mask & IN_MOVED_TO ? "moved here" : "created"));
-						if( stat(path_buf, &st) == 0 && S_ISDIR(st.st_mode) )
-							inotify_insert_directory(pollfds[0].fd, esc_name, path_buf);
-						else
-							inotify_insert_file(esc_name, path_buf);
-					}
-					else if( event->mask & (IN_CLOSE_WRITE|IN_MOVED_TO) && st.st_size > 0 )
-					{
-						if( (event->mask & IN_MOVED_TO) ||
-						    (sql_get_int_field(db, "SELECT TIMESTAMP from DETAILS where PATH = '%q'", path_buf) != st.st_mtime) )
-						{
-							DPRINTF(E_DEBUG, L_INOTIFY, "The file %s was %s.\n",
-								path_buf, (event->mask & IN_MOVED_TO ? "moved here" : "changed"));
-							inotify_insert_file(esc_name, path_buf);
-						}
-					}
-				}
-				else if ( event->mask & (IN_DELETE|IN_MOVED_FROM) )
-				{
-					DPRINTF(E_DEBUG, L_INOTIFY, "The %s %s was %s.\n",
-						(event->mask & IN_ISDIR ? "directory" : "file"),
-						path_buf, (event->mask & IN_MOVED_FROM ? "moved away" : "deleted"));
-					if ( event->mask & IN_ISDIR )
-						inotify_remove_directory(pollfds[0].fd, path_buf);
-					else
-						inotify_remove_file(path_buf);
-				}
-				free(esc_name);
+				inotify_handle(fd, event->mask, event->cookie, path_buf, event->name);
+				sql_batch_step(db);
 			}
-			i += EVENT_SIZE + event->len;
 		}
+		/* Events that keep coming elsewhere don't hold up what's done */
+		changes_flush(fd, 0);
 	}
-	inotify_remove_watches(pollfds[0].fd);
+	changes_flush(fd, 1);
+	sql_batch_end(db);
+	inotify_remove_watches(fd);
+#ifdef USE_FANOTIFY
+	fanotify_stop();
+#endif
+	art_trash_join();
 quitting:
 	close(pollfds[0].fd);
+	sqlite3_close(db);
 
 	return 0;
 }
@@ -1,7 +1,17 @@
 #ifdef HAVE_INOTIFY
+struct watch_stats
+{
+	const char *backend;	/* "inotify" or "fanotify", NULL until watching starts */
+	unsigned int watches;	/* directories watched, or filesystems marked */
+	size_t bytes;		/* memory used to keep track of them */
+};
+
 int
 inotify_remove_file(const char * path);
 
+void
+inotify_watch_stats(struct watch_stats *stats);
+
 void *
 start_inotify();
 #endif
@@ -0,0 +1,339 @@
+/* MiniDLNA media server
+ *
+ * This file is part of MiniDLNA.
+ *
+ * MiniDLNA is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * MiniDLNA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MiniDLNA. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <libgen.h>
+#include <sys/stat.h>
+
+#include "upnpglobalvars.h"
+#include "metacache.h"
+#include "metadata.h"
+#include "albumart.h"
+#include "utils.h"
+#include "sql.h"
+#include "log.h"
+
+/* What the metadata parsers made of each file, kept in metadata.db next to
+ * files.db, which survives the database being rebuilt.  Files are known by
+ * device and inode, and only match while their size, mtime and name are
+ * the same as when they were parsed.  Bump the version when the parsers
+ * start extracting something different, to throw the old results away. */
+#define METACACHE_VERSION 1
+
+/* The DETAILS columns that come from parsing a file */
+#define METACACHE_COLUMNS "TITLE, DURATION, BITRATE, SAMPLERATE, CREATOR, ARTIST, ALBUM, GENRE, " \
+                          "COMMENT, CHANNELS, DISC, TRACK, DATE, RESOLUTION, THUMBNAIL, ROTATION, " \
+                          "DLNA_PN, MIME"
+
+/* Embedded album art is only kept as a file in art_cache, which is removed
+ * along with files.db, so the cache holds on to a copy. */
+#define METACACHE_ART_MAX (1024*1024)
+
+static const char create_metadataTable_sqlite[] = "CREATE TABLE CACHE.METADATA ("
+					"ID INTEGER PRIMARY KEY, "
+					"DEV INTEGER NOT NULL, "
+					"INODE INTEGER NOT NULL, "
+					"SIZE INTEGER, "
+					"TIMESTAMP INTEGER, "
+					"FILE TEXT NOT NULL, "
+					"NAME TEXT NOT NULL, "
+					"TYPES INTEGER, "
+					"CLASS TEXT NOT NULL, "
+					"USED INTEGER, "
+					"ART_PATH TEXT, "
+					"ART BLOB, "
+					"TITLE TEXT, "
+					"DURATION TEXT, "
+					"BITRATE INTEGER, "
+					"SAMPLERATE INTEGER, "
+					"CREATOR TEXT, "
+					"ARTIST TEXT, "
+					"ALBUM TEXT, "
+					"GENRE TEXT, "
+					"COMMENT TEXT, "
+					"CHANNELS INTEGER, "
+					"DISC INTEGER, "
+					"TRACK INTEGER, "
+					"DATE DATE, "
+					"RESOLUTION TEXT, "
+					"THUMBNAIL BOOL DEFAULT 0, "
+					"ROTATION INTEGER, "
+					"DLNA_PN TEXT, "
+					"MIME TEXT"
+					");";
+
+static __thread struct {
+	int attached;
+	time_t opened;
+	sqlite3_stmt *find;
+	sqlite3_stmt *add;
+} cache;
+
+static const char *
+file_name(const char *path)
+{
+	const char *p = strrchr(path, '/');
+
+	return p ? p + 1 : path;
+}
+
+static int
+prepare(const char *sql, sqlite3_stmt **stmt)
+{
+	if (sqlite3_prepare_v2(db, sql, -1, stmt, NULL) == SQLITE_OK)
+		return 0;
+	DPRINTF(E_ERROR, L_DB_SQL, "prepare failed: %s\n%s\n", sqlite3_errmsg(db), sql);
+	*stmt = NULL;
+	return -1;
+}
+
+int
+metacache_open(void)
+{
+	char path[PATH_MAX];
+	int ret;
+
+	if (cache.attached)
+		return 0;
+	snprintf(path, sizeof(path), "%s/metadata.db", db_path);
+	if (sql_exec(db, "ATTACH %Q as CACHE", path) != SQLITE_OK)
+		return -1;
+	sql_exec(db, "pragma CACHE.journal_mode = WAL");
+	sql_exec(db, "pragma CACHE.synchronous = NORMAL");
+	ret = SQLITE_OK;
+	if (sql_get_int_field(db, "pragma CACHE.user_version") != METACACHE_VERSION)
+	{
+		DPRINTF(E_WARN, L_SCANNER, "Creating new metadata cache at %s\n", path);
+		sql_exec(db, "DROP TABLE IF EXISTS CACHE.METADATA");
+		ret = sql_exec(db, create_metadataTable_sqlite);
+		if (ret == SQLITE_OK)
+			ret = sql_exec(db, "CREATE UNIQUE INDEX CACHE.IDX_METADATA_FILE on METADATA(DEV, INODE)");
+		if (ret == SQLITE_OK)
+			ret = sql_exec(db, "pragma CACHE.user_version = %d", METACACHE_VERSION);
+	}
+	if (ret != SQLITE_OK ||
+	    prepare("SELECT ID, CLASS from CACHE.METADATA where DEV = ?1 and INODE = ?2"
+	            " and SIZE = ?3 and TIMESTAMP = ?4 and FILE = ?5 and TYPES = ?6", &cache.find) != 0 ||
+	    prepare("INSERT OR REPLACE into CACHE.METADATA (DEV, INODE, SIZE, TIMESTAMP, FILE, NAME,"
+	            " TYPES, CLASS, USED, ART_PATH, ART, " METACACHE_COLUMNS ") "
+	            "SELECT ?1, ?2, SIZE, TIMESTAMP, ?3, ?4, ?5, ?6, ?7, ?8, ?9, " METACACHE_COLUMNS
+	            " from DETAILS where ID = ?10", &cache.add) != 0)
+	{
+		DPRINTF(E_WARN, L_SCANNER, "Metadata cache %s is unusable\n", path);
+		sqlite3_finalize(cache.find);
+		sqlite3_finalize(cache.add);
+		sql_exec(db, "DETACH CACHE");
+		return -1;
+	}
+	cache.opened = time(NULL);
+	cache.attached = 1;
+
+	return 0;
+}
+
+void
+metacache_close(int prune)
+{
+	if (!cache.attached)
+		return;
+	sqlite3_finalize(cache.find);
+	sqlite3_finalize(cache.add);
+	cache.find = cache.add = NULL;
+	if (prune)
+		sql_exec(db, "DELETE from CACHE.METADATA where USED < %lld", (long long)cache.opened);
+	sql_exec(db, "DETACH CACHE");
+	cache.attached = 0;
+}
+
+int64_t
+metacache_find(const char *path, const struct stat *st, media_types types,
+               char *class, size_t len)
+{
+	int64_t id = 0;
+
+	if (!cache.attached)
+		return 0;
+	sqlite3_bind_int64(cache.find, 1, (sqlite3_int64)st->st_dev);
+	sqlite3_bind_int64(cache.find, 2, (sqlite3_int64)st->st_ino);
+	sqlite3_bind_int64(cache.find, 3, (sqlite3_int64)st->st_size);
+	sqlite3_bind_int64(cache.find, 4, (sqlite3_int64)st->st_mtime);
+	sqlite3_bind_text(cache.find, 5, file_name(path), -1, SQLITE_STATIC);
+	sqlite3_bind_int(cache.find, 6, types);
+	if (sqlite3_step(cache.find) == SQLITE_ROW)
+	{
+		id = sqlite3_column_int64(cache.find, 0);
+		strncpyt(class, (const char *)sqlite3_column_text(cache.find, 1), len);
+	}
+	sqlite3_reset(cache.find);
+
+	return id;
+}
+
+/* Put the copy of embedded album art back where the parser left it */
+static void
+restore_art(int64_t id, const char *art_path)
+{
+	char dir[PATH_MAX];
+	sqlite3_stmt *stmt;
+	FILE *f;
+	int size;
+
+	if (access(art_path, F_OK) == 0)
+		return;
+	if (prepare("SELECT ART from CACHE.METADATA where ID = ?", &stmt) != 0)
+		return;
+	sqlite3_bind_int64(stmt, 1, id);
+	if (sqlite3_step(stmt) == SQLITE_ROW)
+	{
+		size = sqlite3_column_bytes(stmt, 0);
+		strncpyt(dir, art_path, sizeof(dir));
+		make_dir(dirname(dir), S_IRWXU|S_IRGRP|S_IXGRP|S_IROTH|S_IXOTH);
+		f = fopen(art_path, "w");
+		if (f)
+		{
+			if (fwrite(sqlite3_column_blob(stmt, 0), 1, size, f) != (size_t)size)
+				unlink(art_path);
+			fclose(f);
+		}
+	}
+	sqlite3_finalize(stmt);
+}
+
+int64_t
+metacache_store(int64_t id, const char *path, char *name)
+{
+	char **result = NULL;
+	const char *cached_name, *class, *art_path;
+	int64_t album_art = 0, ret = 0;
+	int rows = 0;
+	char *sql;
+
+	sql = sqlite3_mprintf("SELECT NAME, CLASS, ART_PATH, length(ART) from CACHE.METADATA"
+	                      " where ID = %lld", (long long)id);
+	if (sql_get_table(db, sql, &result, &rows, NULL) != SQLITE_OK)
+		rows = 0;
+	sqlite3_free(sql);
+	if (rows != 1)
+		goto out;
+	cached_name = result[4];
+	class = result[5];
+	art_path = result[6];
+	if (strlen(cached_name) > strlen(name))
+		goto out;
+
+	if (strncmp(class, "item.imageItem", 14) != 0)
+	{
+		if (art_path && result[7])
+		{
+			restore_art(id, art_path);
+			if (access(art_path, F_OK) == 0)
+				album_art = get_album_art_id(art_path);
+		}
+		if (!album_art)
+			album_art = find_album_art(path, NULL, 0);
+	}
+	if (sql_exec(db, "INSERT into DETAILS (PATH, SIZE, TIMESTAMP, ALBUM_ART, " METACACHE_COLUMNS ") "
+	                 "SELECT %Q, SIZE, TIMESTAMP, %lld, " METACACHE_COLUMNS
+	                 " from CACHE.METADATA where ID = %lld",
+	                 path, (long long)album_art, (long long)id) != SQLITE_OK)
+		goto out;
+	ret = sqlite3_last_insert_rowid(db);
+	strcpy(name, cached_name);
+	if (strncmp(class, "item.videoItem", 14) == 0)
+		check_for_captions(path, ret);
+	sql_exec(db, "UPDATE CACHE.METADATA set USED = %lld where ID = %lld",
+	         (long long)cache.opened, (long long)id);
+out:
+	sqlite3_free_table(result);
+
+	return ret;
+}
+
+/* Read an art_cache file, or return NULL if it's anything else */
+static void *
+read_art(const char *art_path, int *size)
+{
+	char prefix[PATH_MAX];
+	struct stat st;
+	void *data;
+	FILE *f;
+	int len;
+
+	len = snprintf(prefix, sizeof(prefix), "%s/art_cache/", db_path);
+	if (strncmp(art_path, prefix, len) != 0)
+		return NULL;
+	if (stat(art_path, &st) != 0 || st.st_size <= 0 || st.st_size > METACACHE_ART_MAX)
+		return NULL;
+	f = fopen(art_path, "r");
+	if (!f)
+		return NULL;
+	data = malloc(st.st_size);
+	if (data && fread(data, 1, st.st_size, f) != (size_t)st.st_size)
+	{
+		free(data);
+		data = NULL;
+	}
+	fclose(f);
+	*size = st.st_size;
+
+	return data;
+}
+
+void
+metacache_add(const char *path, const char *name, const struct stat *st,
+              media_types types, const char *class, int64_t detailID)
+{
+	char *art_path;
+	void *art = NULL;
+	int art_size = 0;
+
+	if (!cache.attached)
+		return;
+	art_path = sql_get_text_field(db, "SELECT a.PATH from DETAILS d"
+	                                  " join ALBUM_ART a on (a.ID = d.ALBUM_ART)"
+	                                  " where d.ID = %lld", (long long)detailID);
+	if (art_path)
+		art = read_art(art_path, &art_size);
+	sqlite3_bind_int64(cache.add, 1, (sqlite3_int64)st->st_dev);
+	sqlite3_bind_int64(cache.add, 2, (sqlite3_int64)st->st_ino);
+	sqlite3_bind_text(cache.add, 3, file_name(path), -1, SQLITE_STATIC);
+	sqlite3_bind_text(cache.add, 4, name, -1, SQLITE_STATIC);
+	sqlite3_bind_int(cache.add, 5, types);
+	sqlite3_bind_text(cache.add, 6, class, -1, SQLITE_STATIC);
+	sqlite3_bind_int64(cache.add, 7, (sqlite3_int64)cache.opened);
+	if (art)
+	{
+		sqlite3_bind_text(cache.add, 8, art_path, -1, SQLITE_STATIC);
+		sqlite3_bind_blob(cache.add, 9, art, art_size, SQLITE_STATIC);
+	}
+	else
+	{
+		sqlite3_bind_null(cache.add, 8);
+		sqlite3_bind_null(cache.add, 9);
+	}
+	sqlite3_bind_int64(cache.add, 10, (sqlite3_int64)detailID);
+	if (sqlite3_step(cache.add) != SQLITE_DONE)
+		DPRINTF(E_DEBUG, L_SCANNER, "Failed to cache metadata for %s: %s\n",
+			path, sqlite3_errmsg(db));
+	sqlite3_reset(cache.add);
+	sqlite3_clear_bindings(cache.add);
+	free(art);
+	sqlite3_free(art_path);
+}
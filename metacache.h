@@ -0,0 +1,47 @@
+/* MiniDLNA media server
+ *
+ * This file is part of MiniDLNA.
+ *
+ * MiniDLNA is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * MiniDLNA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MiniDLNA. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __METACACHE_H__
+#define __METACACHE_H__
+
+#include <stdint.h>
+#include <sys/stat.h>
+
+#include "upnpglobalvars.h"
+
+/* Attach the cache to this thread's database connection.  Must be called
+ * outside of a transaction. */
+int metacache_open(void);
+
+/* Detach it again.  After a complete scan, prune drops the entries that
+ * weren't used, since their files are gone. */
+void metacache_close(int prune);
+
+/* Look for what was parsed out of this file before.  Returns the cache
+ * entry, or 0, and copies the class the file was stored with. */
+int64_t metacache_find(const char *path, const struct stat *st, media_types types,
+                       char *class, size_t len);
+
+/* Store a DETAILS row from a cache entry, with its album art and captions.
+ * name is replaced with the name the file was stored under, which is never
+ * longer.  Returns the DETAILS ID, or 0. */
+int64_t metacache_store(int64_t id, const char *path, char *name);
+
+/* Remember how a file that was just parsed ended up in DETAILS */
+void metacache_add(const char *path, const char *name, const struct stat *st,
+                   media_types types, const char *class, int64_t detailID);
+
+#endif
@@ -55,6 +55,7 @@
 #define FLAG_MIME	0x00000100
 #define FLAG_DURATION	0x00000200
 #define FLAG_RESOLUTION	0x00000400
+#define FLAG_THUMB	0x00000800
 
 /* Audio profile flags */
 enum audio_profiles {
@@ -257,6 +258,8 @@ free_metadata(metadata_t *m, uint32_t flags)
 		free(m->duration);
 	if( flags & FLAG_RESOLUTION )
 		free(m->resolution);
+	if( flags & FLAG_THUMB )
+		free(m->thumb_data);
 }
 
 int64_t
@@ -277,23 +280,21 @@ GetFolderMetadata(const char *name, const char *path, const char *artist, const
 	return ret;
 }
 
-int64_t
-GetAudioMetadata(const char *path, char *name)
+int
+ParseAudioMetadata(const char *path, char *name, struct media_details *d)
 {
 	char type[4];
-	static char lang[6] = { '\0' };
+	char lang[6];
 	struct stat file;
-	int64_t ret;
 	char *esc_tag;
 	int i;
-	int64_t album_art = 0;
 	struct song_metadata song;
 	metadata_t m;
 	uint32_t free_flags = FLAG_MIME|FLAG_DURATION|FLAG_DLNA_PN|FLAG_DATE;
 	memset(&m, '\0', sizeof(metadata_t));
 
 	if ( stat(path, &file) != 0 )
-		return 0;
+		return -1;
 	strip_ext(name);
 
 	if( ends_with(path, ".mp3") )
@@ -340,23 +341,20 @@ GetAudioMetadata(const char *path, char *name)
 	else
 	{
 		DPRINTF(E_WARN, L_METADATA, "Unhandled file extension on %s\n", path);
-		return 0;
+		return -1;
 	}
 
-	if( !(*lang) )
-	{
-		if( !getenv("LANG") )
-			strcpy(lang, "en_US");
-		else
-			strncpyt(lang, getenv("LANG"), sizeof(lang));
-	}
+	if( !getenv("LANG") )
+		strcpy(lang, "en_US");
+	else
+		strncpyt(lang, getenv("LANG"), sizeof(lang));
 
 	if( readtags((char *)path, &song, &file, lang, type) != 0 )
 	{
 		DPRINTF(E_WARN, L_METADATA, "Cannot extract tags from %s!\n", path);
         	freetags(&song);
 		free_metadata(&m, free_flags);
-		return 0;
+		return -1;
 	}
 
 	if( song.dlna_pn )
@@ -452,33 +450,29 @@ GetAudioMetadata(const char *path, char *name)
 		}
 	}
 
-	album_art = find_album_art(path, song.image, song.image_size);
-
-	ret = sql_exec(db, "INSERT into DETAILS"
-	                   " (PATH, SIZE, TIMESTAMP, DURATION, CHANNELS, BITRATE, SAMPLERATE, DATE,"
-	                   "  TITLE, CREATOR, ARTIST, ALBUM, GENRE, COMMENT, DISC, TRACK, DLNA_PN, MIME, ALBUM_ART) "
-	                   "VALUES"
-	                   " (%Q, %lld, %lld, '%s', %d, %d, %d, %Q, %Q, %Q, %Q, %Q, %Q, %Q, %d, %d, %Q, '%s', %lld);",
-	                   path, (long long)file.st_size, (long long)file.st_mtime, m.duration, song.channels, song.bitrate,
-	                   song.samplerate, m.date, m.title, m.creator, m.artist, m.album, m.genre, m.comment, song.disc,
-	                   song.track, m.dlna_pn, song.mime?song.mime:m.mime, album_art);
-	if( ret != SQLITE_OK )
-	{
-		DPRINTF(E_ERROR, L_METADATA, "Error inserting details for '%s'!\n", path);
-		ret = 0;
-	}
-	else
+	/* The tag strings are still referenced from m, so keep them until
+	 * the details have been stored */
+	d->song = malloc(sizeof(song));
+	if( !d->song )
 	{
-		ret = sqlite3_last_insert_rowid(db);
+		freetags(&song);
+		free_metadata(&m, free_flags);
+		return -1;
 	}
-        freetags(&song);
-	free_metadata(&m, free_flags);
+	*d->song = song;
+	m.thumb_data = song.image;
+	m.thumb_size = song.image_size;
+	d->type = TYPE_AUDIO;
+	d->m = m;
+	d->free_flags = free_flags;
+	d->size = file.st_size;
+	d->mtime = file.st_mtime;
 
-	return ret;
+	return 0;
 }
 
 /* For libjpeg error handling */
-jmp_buf setjmp_buffer;
+static __thread jmp_buf setjmp_buffer;
 static void
 libjpeg_error_handler(j_common_ptr cinfo)
 {
@@ -487,8 +481,8 @@ libjpeg_error_handler(j_common_ptr cinfo)
 	return;
 }
 
-int64_t
-GetImageMetadata(const char *path, char *name)
+int
+ParseImageMetadata(const char *path, char *name, struct media_details *d)
 {
 	ExifData *ed;
 	ExifEntry *e = NULL;
@@ -500,7 +494,6 @@ GetImageMetadata(const char *path, char *name)
 	char make[32], model[64] = {'\0'};
 	char b[1024];
 	struct stat file;
-	int64_t ret;
 	image_s *imsrc;
 	metadata_t m;
 	uint32_t free_flags = 0xFFFFFFFF;
@@ -508,7 +501,7 @@ GetImageMetadata(const char *path, char *name)
 
 	//DEBUG DPRINTF(E_DEBUG, L_METADATA, "Parsing %s...\n", path);
 	if ( stat(path, &file) != 0 )
-		return 0;
+		return -1;
 	strip_ext(name);
 	//DEBUG DPRINTF(E_DEBUG, L_METADATA, " * size: %jd\n", file.st_size);
 
@@ -625,7 +618,7 @@ no_exifdata:
 	if( !width || !height )
 	{
 		free_metadata(&m, free_flags);
-		return 0;
+		return -1;
 	}
 	if( width <= 640 && height <= 480 )
 		m.dlna_pn = strdup("JPEG_SM");
@@ -635,39 +628,28 @@ no_exifdata:
 		m.dlna_pn = strdup("JPEG_LRG");
 	xasprintf(&m.resolution, "%dx%d", width, height);
 
-	ret = sql_exec(db, "INSERT into DETAILS"
-	                   " (PATH, TITLE, SIZE, TIMESTAMP, DATE, RESOLUTION,"
-	                    " ROTATION, THUMBNAIL, CREATOR, DLNA_PN, MIME) "
-	                   "VALUES"
-	                   " (%Q, '%q', %lld, %lld, %Q, %Q, %u, %d, %Q, %Q, %Q);",
-	                   path, name, (long long)file.st_size, (long long)file.st_mtime, m.date,
-	                   m.resolution, m.rotation, thumb, m.creator, m.dlna_pn, m.mime);
-	if( ret != SQLITE_OK )
-	{
-		DPRINTF(E_ERROR, L_METADATA, "Error inserting details for '%s'!\n", path);
-		ret = 0;
-	}
-	else
-	{
-		ret = sqlite3_last_insert_rowid(db);
-	}
-	free_metadata(&m, free_flags);
+	d->type = TYPE_IMAGES;
+	d->m = m;
+	d->free_flags = free_flags;
+	d->song = NULL;
+	d->size = file.st_size;
+	d->mtime = file.st_mtime;
+	d->thumb = thumb;
 
-	return ret;
+	return 0;
 }
 
-int64_t
-GetVideoMetadata(const char *path, char *name)
+int
+ParseVideoMetadata(const char *path, char *name, struct media_details *d)
 {
 	struct stat file;
 	int ret, i;
-	struct tm *modtime;
+	struct tm modtime;
 	AVFormatContext *ctx = NULL;
 	AVStream *astream = NULL, *vstream = NULL;
 	int audio_stream = -1, video_stream = -1;
 	enum audio_profiles audio_profile = PROFILE_AUDIO_UNKNOWN;
 	char fourcc[4];
-	int64_t album_art = 0;
 	char nfo[MAXPATHLEN], *ext;
 	struct song_metadata video;
 	metadata_t m;
@@ -679,7 +661,7 @@ GetVideoMetadata(const char *path, char *name)
 
 	//DEBUG DPRINTF(E_DEBUG, L_METADATA, "Parsing video %s...\n", name);
 	if ( stat(path, &file) != 0 )
-		return 0;
+		return -1;
 	strip_ext(name);
 	//DEBUG DPRINTF(E_DEBUG, L_METADATA, " * size: %jd\n", file.st_size);
 
@@ -689,7 +671,7 @@ GetVideoMetadata(const char *path, char *name)
 		char err[128];
 		av_strerror(ret, err, sizeof(err));
 		DPRINTF(E_WARN, L_METADATA, "Opening %s failed! [%s]\n", path, err);
-		return 0;
+		return -1;
 	}
 	//dump_format(ctx, 0, NULL, 0);
 	for( i=0; i < ctx->nb_streams; i++)
@@ -719,7 +701,7 @@ GetVideoMetadata(const char *path, char *name)
 		if( !is_audio(path) )
 			DPRINTF(E_DEBUG, L_METADATA, "File %s does not contain a video stream.\n", basepath);
 		free(path_cpy);
-		return 0;
+		return -1;
 	}
 
 	if( astream )
@@ -1530,26 +1512,98 @@ video_no_dlna:
 	if( !m.date )
 	{
 		m.date = malloc(20);
-		modtime = localtime(&file.st_mtime);
-		strftime(m.date, 20, "%FT%T", modtime);
+		localtime_r(&file.st_mtime, &modtime);
+		strftime(m.date, 20, "%FT%T", &modtime);
 	}
 
 	if( !m.title )
 		m.title = strdup(name);
 
-	album_art = find_album_art(path, m.thumb_data, m.thumb_size);
+	/* The thumbnail belongs to ctx or video, which we're about to free */
+	if( m.thumb_data )
+	{
+		uint8_t *thumb = malloc(m.thumb_size);
+
+		if( thumb )
+			memcpy(thumb, m.thumb_data, m.thumb_size);
+		else
+			m.thumb_size = 0;
+		m.thumb_data = thumb;
+	}
 	freetags(&video);
 	lav_close(ctx);
+	free(path_cpy);
 
-	ret = sql_exec(db, "INSERT into DETAILS"
-	                   " (PATH, SIZE, TIMESTAMP, DURATION, DATE, CHANNELS, BITRATE, SAMPLERATE, RESOLUTION,"
-	                   "  TITLE, CREATOR, ARTIST, GENRE, COMMENT, DLNA_PN, MIME, ALBUM_ART) "
-	                   "VALUES"
-	                   " (%Q, %lld, %lld, %Q, %Q, %u, %u, %u, %Q, '%q', %Q, %Q, %Q, %Q, %Q, '%q', %lld);",
-	                   path, (long long)file.st_size, (long long)file.st_mtime, m.duration,
-	                   m.date, m.channels, m.bitrate, m.frequency, m.resolution,
-			   m.title, m.creator, m.artist, m.genre, m.comment, m.dlna_pn,
-                           m.mime, album_art);
+	d->type = TYPE_VIDEO;
+	d->m = m;
+	d->free_flags = free_flags;
+	d->song = NULL;
+	d->size = file.st_size;
+	d->mtime = file.st_mtime;
+
+	return 0;
+}
+
+void
+FreeMetadata(struct media_details *d)
+{
+	free_metadata(&d->m, d->free_flags);
+	if( d->song )
+	{
+		freetags(d->song);
+		free(d->song);
+		d->song = NULL;
+	}
+}
+
+/* Write out what one of the Parse*Metadata() functions found, as DETAILS
+ * row id if it is non-zero, or as a new row otherwise */
+int64_t
+StoreMetadata(int64_t id, const char *path, const char *name, struct media_details *d)
+{
+	metadata_t *m = &d->m;
+	struct song_metadata *song = d->song;
+	int64_t album_art = 0;
+	int64_t ret;
+
+	switch( d->type )
+	{
+	case TYPE_AUDIO:
+		album_art = find_album_art(path, m->thumb_data, m->thumb_size);
+		ret = sql_exec(db, "INSERT into DETAILS"
+		                   " (ID, PATH, SIZE, TIMESTAMP, DURATION, CHANNELS, BITRATE, SAMPLERATE, DATE,"
+		                   "  TITLE, CREATOR, ARTIST, ALBUM, GENRE, COMMENT, DISC, TRACK, DLNA_PN, MIME, ALBUM_ART) "
+		                   "VALUES"
+		                   " (nullif(%lld, 0), %Q, %lld, %lld, '%s', %d, %d, %d, %Q, %Q, %Q, %Q, %Q, %Q, %Q, %d, %d, %Q, '%s', %lld);",
+		                   (long long)id, path, (long long)d->size, (long long)d->mtime, m->duration, song->channels, song->bitrate,
+		                   song->samplerate, m->date, m->title, m->creator, m->artist, m->album, m->genre, m->comment, song->disc,
+		                   song->track, m->dlna_pn, song->mime?song->mime:m->mime, album_art);
+		break;
+	case TYPE_IMAGES:
+		ret = sql_exec(db, "INSERT into DETAILS"
+		                   " (ID, PATH, TITLE, SIZE, TIMESTAMP, DATE, RESOLUTION,"
+		                    " ROTATION, THUMBNAIL, CREATOR, DLNA_PN, MIME) "
+		                   "VALUES"
+		                   " (nullif(%lld, 0), %Q, '%q', %lld, %lld, %Q, %Q, %u, %d, %Q, %Q, %Q);",
+		                   (long long)id, path, name, (long long)d->size, (long long)d->mtime, m->date,
+		                   m->resolution, m->rotation, d->thumb, m->creator, m->dlna_pn, m->mime);
+		break;
+	case TYPE_VIDEO:
+		album_art = find_album_art(path, m->thumb_data, m->thumb_size);
+		ret = sql_exec(db, "INSERT into DETAILS"
+		                   " (ID, PATH, SIZE, TIMESTAMP, DURATION, DATE, CHANNELS, BITRATE, SAMPLERATE, RESOLUTION,"
+		                   "  TITLE, CREATOR, ARTIST, GENRE, COMMENT, DLNA_PN, MIME, ALBUM_ART) "
+		                   "VALUES"
+		                   " (nullif(%lld, 0), %Q, %lld, %lld, %Q, %Q, %u, %u, %u, %Q, '%q', %Q, %Q, %Q, %Q, %Q, '%q', %lld);",
+		                   (long long)id, path, (long long)d->size, (long long)d->mtime, m->duration,
+		                   m->date, m->channels, m->bitrate, m->frequency, m->resolution,
+		                   m->title, m->creator, m->artist, m->genre, m->comment, m->dlna_pn,
+		                   m->mime, album_art);
+		break;
+	default:
+		ret = SQLITE_ERROR;
+		break;
+	}
 	if( ret != SQLITE_OK )
 	{
 		DPRINTF(E_ERROR, L_METADATA, "Error inserting details for '%s'!\n", path);
@@ -1558,10 +1612,40 @@ video_no_dlna:
 	else
 	{
 		ret = sqlite3_last_insert_rowid(db);
-		check_for_captions(path, ret);
+		if( d->type == TYPE_VIDEO )
+			check_for_captions(path, ret);
 	}
-	free_metadata(&m, free_flags);
-	free(path_cpy);
+	FreeMetadata(d);
 
 	return ret;
 }
+
+int64_t
+GetAudioMetadata(const char *path, char *name)
+{
+	struct media_details d;
+
+	if( ParseAudioMetadata(path, name, &d) != 0 )
+		return 0;
+	return StoreMetadata(0, path, name, &d);
+}
+
+int64_t
+GetImageMetadata(const char *path, char *name)
+{
+	struct media_details d;
+
+	if( ParseImageMetadata(path, name, &d) != 0 )
+		return 0;
+	return StoreMetadata(0, path, name, &d);
+}
+
+int64_t
+GetVideoMetadata(const char *path, char *name)
+{
+	struct media_details d;
+
+	if( ParseVideoMetadata(path, name, &d) != 0 )
+		return 0;
+	return StoreMetadata(0, path, name, &d);
+}
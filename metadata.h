@@ -46,6 +46,21 @@ typedef struct metadata_s {
 	uint8_t *    thumb_data;
 } metadata_t;
 
+struct song_metadata;
+
+/* What Parse*Metadata() found out about a file.  Parsing doesn't touch
+ * the database, so the scanner can run it on worker threads and leave
+ * StoreMetadata() to the thread that writes. */
+struct media_details {
+	int          type;	/* TYPE_AUDIO, TYPE_VIDEO or TYPE_IMAGES */
+	metadata_t   m;
+	uint32_t     free_flags;
+	struct song_metadata *song;
+	off_t        size;
+	time_t       mtime;
+	int          thumb;
+};
+
 typedef enum {
   AAC_INVALID   =  0,
   AAC_MAIN      =  1, /* AAC Main */
@@ -91,6 +106,21 @@ check_for_captions(const char *path, int64_t detailID);
 int64_t
 GetFolderMetadata(const char *name, const char *path, const char *artist, const char *genre, int64_t album_art);
 
+int
+ParseAudioMetadata(const char *path, char *name, struct media_details *d);
+
+int
+ParseImageMetadata(const char *path, char *name, struct media_details *d);
+
+int
+ParseVideoMetadata(const char *path, char *name, struct media_details *d);
+
+int64_t
+StoreMetadata(int64_t id, const char *path, const char *name, struct media_details *d);
+
+void
+FreeMetadata(struct media_details *d);
+
 int64_t
 GetAudioMetadata(const char *path, char *name);
 
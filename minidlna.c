@@ -90,6 +90,7 @@
 #include "process.h"
 #include "upnpevents.h"
 #include "scanner.h"
+#include "snapshot.h"
 #include "inotify.h"
 #include "log.h"
 #include "tivo_beacon.h"
@@ -266,19 +267,60 @@ open_db(sqlite3 **sq3)
 		new_db = 1;
 		make_dir(db_path, S_ISVTX|S_IRWXU|S_IRWXG|S_IRWXO);
 	}
-	if (sqlite3_open(path, &db) != SQLITE_OK)
+	if (sql_open(path, &db) != 0)
 		DPRINTF(E_FATAL, L_GENERAL, "ERROR: Failed to open sqlite database!  Exiting...\n");
 	if (sq3)
 		*sq3 = db;
-	sqlite3_busy_timeout(db, 5000);
-	sql_exec(db, "pragma page_size = 4096");
-	sql_exec(db, "pragma journal_mode = OFF");
-	sql_exec(db, "pragma synchronous = OFF;");
-	sql_exec(db, "pragma default_cache_size = 8192;");
 
 	return new_db;
 }
 
+/* Copy the WAL back into the database.  Serving files is what matters
+ * most, so while any are being streamed we leave the WAL alone until it
+ * gets big. */
+static void
+checkpoint_db(time_t now)
+{
+	static time_t last;
+	static int last_changes;
+	char path[PATH_MAX];
+	struct stat st;
+	int changes;
+
+	if (now - last < 5)
+		return;
+	last = now;
+	changes = sql_changes(db);
+	if (changes == last_changes && !scanning)
+		return;
+	if (number_of_children)
+	{
+		snprintf(path, sizeof(path), "%s/files.db-wal", db_path);
+		if (stat(path, &st) != 0 || st.st_size < WAL_SIZE_LIMIT)
+			return;
+	}
+	if (sql_exec(db, "pragma wal_checkpoint(PASSIVE)") == SQLITE_OK)
+		last_changes = changes;
+}
+
+/* With several media_dirs each gets its own container under BROWSEDIR_ID,
+ * otherwise their contents go straight into it.  Returns 1 if the
+ * database was built with the other layout. */
+static int
+media_layout_changed(sqlite3 *db)
+{
+	int was_split, split;
+
+	was_split = sql_get_int_field(db, "SELECT count(*) from OBJECTS o"
+	                                  " join DETAILS d on (d.ID = o.DETAIL_ID)"
+	                                  " where o.PARENT_ID = '%s' and d.PATH in"
+	                                  " (SELECT VALUE from SETTINGS where KEY = 'media_dir')",
+	                                  BROWSEDIR_ID) > 0;
+	split = !GETFLAG(MERGE_MEDIA_DIRS_MASK) && media_dirs && media_dirs->next;
+
+	return was_split != split;
+}
+
 static void
 check_db(sqlite3 *db, int new_db, pid_t *scanner_pid)
 {
@@ -286,7 +328,7 @@ check_db(sqlite3 *db, int new_db, pid_t *scanner_pid)
 	char cmd[PATH_MAX*2];
 	char **result;
 	int i, rows = 0;
-	int ret;
+	int ret, changed = 0;
 
 	if (!new_db)
 	{
@@ -297,14 +339,14 @@ check_db(sqlite3 *db, int new_db, pid_t *scanner_pid)
 			ret = sql_get_int_field(db, "SELECT TIMESTAMP from DETAILS where PATH = %Q", media_path->path);
 			if (ret != media_path->types)
 			{
-				ret = 1;
-				goto rescan;
+				changed = 1;
+				break;
 			}
 			media_path = media_path->next;
 		}
 		/* Check if any media dirs disappeared */
 		sql_get_table(db, "SELECT VALUE from SETTINGS where KEY = 'media_dir'", &result, &rows, NULL);
-		for (i=1; i <= rows; i++)
+		for (i=1; i <= rows && !changed; i++)
 		{
 			media_path = media_dirs;
 			while (media_path)
@@ -314,19 +356,29 @@ check_db(sqlite3 *db, int new_db, pid_t *scanner_pid)
 				media_path = media_path->next;
 			}
 			if (!media_path)
-			{
-				ret = 2;
-				sqlite3_free_table(result);
-				goto rescan;
-			}
+				changed = 2;
 		}
 		sqlite3_free_table(result);
 	}
 
 	ret = db_upgrade(db);
+	/* Older versions the scanner knows how to migrate are kept */
+	if (ret > 0 && UpgradeDatabase(ret) == 0)
+		ret = 0;
+	/* Only the media_dirs that changed need to be scanned, unless
+	 * the top level of the ContentDirectory has to be rearranged. */
+	if (ret == 0 && changed && media_layout_changed(db))
+		ret = changed;
+	else if (ret == 0)
+	{
+		/* Pick up whatever changed while we weren't watching */
+		if (changed)
+			DPRINTF(E_WARN, L_GENERAL, "%s media_dir detected; updating...\n",
+				changed == 1 ? "New" : "Removed");
+		SETFLAG(RESCAN_MASK);
+	}
 	if (ret != 0)
 	{
-rescan:
 		if (ret < 0)
 			DPRINTF(E_WARN, L_GENERAL, "Creating new database at %s/files.db\n", db_path);
 		else if (ret == 1)
@@ -338,36 +390,55 @@ rescan:
 				ret, DB_VERSION);
 		sqlite3_close(db);
 
-		snprintf(cmd, sizeof(cmd), "rm -rf %s/files.db %s/art_cache", db_path, db_path);
+		snprintf(cmd, sizeof(cmd), "rm -rf %s/files.db %s/files.db-wal %s/files.db-shm %s/art_cache",
+			db_path, db_path, db_path, db_path);
 		if (system(cmd) != 0)
 			DPRINTF(E_FATAL, L_GENERAL, "Failed to clean old file cache!  Exiting...\n");
 
 		open_db(&db);
 		if (CreateDatabase() != 0)
 			DPRINTF(E_FATAL, L_GENERAL, "ERROR: Failed to create sqlite database!  Exiting...\n");
+	}
 #if USE_FORK
+	if (GETFLAG(RESCAN_MASK))
+		updating = 1;
+	else
 		scanning = 1;
+	sqlite3_close(db);
+	scan_hints_open();
+	*scanner_pid = fork();
+	open_db(&db);
+	if (*scanner_pid == 0) /* child (scanner) process */
+	{
+		scan_hints_close(1);
+		start_scanner();
 		sqlite3_close(db);
-		*scanner_pid = fork();
-		open_db(&db);
-		if (*scanner_pid == 0) /* child (scanner) process */
-		{
-			start_scanner();
-			sqlite3_close(db);
-			free(children);
-			log_close();
-			freeoptions();
-			free(children);
-			exit(EXIT_SUCCESS);
-		}
-		else if (*scanner_pid < 0)
-		{
-			start_scanner();
-		}
-#else
+		free(children);
+		log_close();
+		freeoptions();
+		free(children);
+		exit(EXIT_SUCCESS);
+	}
+	else if (*scanner_pid < 0)
+	{
+		scan_hints_close(1);
 		start_scanner();
-#endif
 	}
+	else
+		scan_hints_close(0);
+#else
+	start_scanner();
+#endif
+}
+
+/* Searches use the full-text index only once the scanner has built it */
+static void
+check_search_index(void)
+{
+	if (sql_get_int_field(db, "SELECT count(*) from sqlite_master where NAME = 'DETAILS_FTS'") > 0)
+		SETFLAG(FTS_SEARCH_MASK);
+	else
+		CLEARFLAG(FTS_SEARCH_MASK);
 }
 
 static int
@@ -519,6 +590,7 @@ init(int argc, char **argv)
 	runtime_vars.port = 8200;
 	runtime_vars.notify_interval = 895;	/* seconds between SSDP announces */
 	runtime_vars.max_connections = 50;
+	runtime_vars.inotify_delay = 2;
 	runtime_vars.root_container = NULL;
 	runtime_vars.ifaces[0] = NULL;
 
@@ -663,6 +735,10 @@ init(int argc, char **argv)
 			if (!strtobool(ary_options[i].value))
 				CLEARFLAG(INOTIFY_MASK);
 			break;
+		case UPNPFANOTIFY:
+			if (strtobool(ary_options[i].value))
+				SETFLAG(FANOTIFY_MASK);
+			break;
 		case ENABLE_TIVO:
 			if (strtobool(ary_options[i].value))
 				SETFLAG(TIVO_MASK);
@@ -731,6 +807,22 @@ init(int argc, char **argv)
 			if (strtobool(ary_options[i].value))
 				SETFLAG(WIDE_LINKS_MASK);
 			break;
+		case MAX_SEARCH_COUNT:
+			runtime_vars.max_search_count = atoi(ary_options[i].value);
+			break;
+		case BROWSE_SNAPSHOT:
+			if (strtobool(ary_options[i].value))
+				SETFLAG(BROWSE_SNAPSHOT_MASK);
+			break;
+		case SCAN_THREADS:
+			runtime_vars.scan_threads = atoi(ary_options[i].value);
+			break;
+		case SCAN_READ_RATE:
+			runtime_vars.scan_read_rate = atoi(ary_options[i].value);
+			break;
+		case INOTIFY_DELAY:
+			runtime_vars.inotify_delay = atoi(ary_options[i].value);
+			break;
 		default:
 			DPRINTF(E_ERROR, L_GENERAL, "Unknown option in file %s\n",
 				optionsfile);
@@ -831,7 +923,10 @@ init(int argc, char **argv)
 			runtime_vars.port = -1; // triggers help display
 			break;
 		case 'R':
-			snprintf(buf, sizeof(buf), "rm -rf %s/files.db %s/art_cache", db_path, db_path);
+			/* A forced rescan parses everything again */
+			snprintf(buf, sizeof(buf), "rm -rf %s/files.db %s/files.db-wal %s/files.db-shm "
+				"%s/metadata.db %s/metadata.db-wal %s/metadata.db-shm %s/art_cache",
+				db_path, db_path, db_path, db_path, db_path, db_path, db_path);
 			if (system(buf) != 0)
 				DPRINTF(E_FATAL, L_GENERAL, "Failed to clean old file cache. EXITING\n");
 			break;
@@ -982,6 +1077,7 @@ init(int argc, char **argv)
 		DPRINTF(E_ERROR, L_GENERAL, "Allocation failed\n");
 		return 1;
 	}
+	process_stats_init();
 
 	return 0;
 }
@@ -1002,7 +1098,7 @@ main(int argc, char **argv)
 	struct timeval timeout, timeofday, lastnotifytime = {0, 0};
 	time_t lastupdatetime = 0;
 	int max_fd = -1;
-	int last_changecnt = 0;
+	int last_changecnt = 0, scan_changecnt;
 	pid_t scanner_pid = 0;
 	pthread_t inotify_thread = 0;
 #ifdef TIVO_SUPPORT
@@ -1036,6 +1132,8 @@ main(int argc, char **argv)
 			ret = -1;
 	}
 	check_db(db, ret, &scanner_pid);
+	scan_changecnt = sql_changes(db);
+	check_search_index();
 #ifdef HAVE_INOTIFY
 	if( GETFLAG(INOTIFY_MASK) )
 	{
@@ -1146,13 +1244,19 @@ main(int argc, char **argv)
 #endif
 		}
 
-		if (scanning)
+		if (scanning || updating)
 		{
 			if (!scanner_pid || kill(scanner_pid, 0) != 0)
 			{
-				scanning = 0;
-				updateID++;
+				if (scanning || sql_changes(db) != scan_changecnt)
+					updateID++;
+				scanning = updating = 0;
+				scan_hints_close(1);
+				check_search_index();
 			}
+			/* Checking for changes only counts as a scan once it finds some */
+			else if (!scanning && sql_changes(db) != scan_changecnt)
+				scanning = 1;
 		}
 
 		/* select open sockets (SSDP, HTTP listen, and all HTTP soap sockets) */
@@ -1225,14 +1329,16 @@ main(int argc, char **argv)
 		 * and if there is an active HTTP connection, at most once every 2 seconds */
 		if (i && (timeofday.tv_sec >= (lastupdatetime + 2)))
 		{
-			if (scanning || sqlite3_total_changes(db) != last_changecnt)
+			if (scanning || sql_changes(db) != last_changecnt)
 			{
 				updateID++;
-				last_changecnt = sqlite3_total_changes(db);
+				last_changecnt = sql_changes(db);
 				upnp_event_var_change_notify(EContentDirectory);
 				lastupdatetime = timeofday.tv_sec;
 			}
 		}
+		snapshot_update(timeofday.tv_sec);
+		checkpoint_db(timeofday.tv_sec);
 		/* process active HTTP connections */
 		for (e = upnphttphead.lh_first; e != NULL; e = e->entries.le_next)
 		{
@@ -1289,7 +1395,7 @@ main(int argc, char **argv)
 
 shutdown:
 	/* kill the scanner */
-	if (scanning && scanner_pid)
+	if ((scanning || updating) && scanner_pid)
 		kill(scanner_pid, SIGKILL);
 
 	/* close out open sockets */
@@ -1324,7 +1430,9 @@ shutdown:
 	free(children);
 
 	sql_exec(db, "UPDATE SETTINGS set VALUE = '%u' where KEY = 'UPDATE_ID'", updateID);
+	sql_finalize_cached(db);
 	sqlite3_close(db);
+	snapshot_close();
 
 	upnpevents_removeSubscribers();
 
@@ -49,6 +49,10 @@ struct runtime_vars_s {
 	int port;	/* HTTP Port */
 	int notify_interval;	/* seconds between SSDP announces */
 	int max_connections;	/* max number of simultaneous conenctions */
+	int max_search_count;	/* max number of Search matches to count */
+	int scan_threads;	/* threads parsing metadata during a scan, 0 for one per CPU */
+	int scan_read_rate;	/* KiB/s the scanner may read from disk, 0 for no limit */
+	int inotify_delay;	/* seconds a path must be quiet before its changes are applied */
 	const char *root_container;	/* root ObjectID (instead of "0") */
 	const char *ifaces[MAX_LAN_ADDR];	/* list of configured network interfaces */
 };
@@ -54,6 +54,7 @@ static const struct {
 	{ UPNPMEDIADIR, "media_dir"},
 	{ UPNPALBUMART_NAMES, "album_art_names"},
 	{ UPNPINOTIFY, "inotify" },
+	{ UPNPFANOTIFY, "fanotify" },
 	{ UPNPDBDIR, "db_dir" },
 	{ UPNPLOGDIR, "log_dir" },
 	{ UPNPLOGLEVEL, "log_level" },
@@ -65,7 +66,12 @@ static const struct {
 	{ FORCE_SORT_CRITERIA, "force_sort_criteria" },
 	{ MAX_CONNECTIONS, "max_connections" },
 	{ MERGE_MEDIA_DIRS, "merge_media_dirs" },
-	{ WIDE_LINKS, "wide_links" }
+	{ WIDE_LINKS, "wide_links" },
+	{ MAX_SEARCH_COUNT, "max_search_count" },
+	{ BROWSE_SNAPSHOT, "browse_snapshot" },
+	{ SCAN_THREADS, "scan_threads" },
+	{ SCAN_READ_RATE, "scan_read_rate" },
+	{ INOTIFY_DELAY, "inotify_delay" }
 };
 
 int
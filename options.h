@@ -47,6 +47,7 @@ enum upnpconfigoptions {
 	UPNPMEDIADIR,			/* directory to search for UPnP-A/V content */
 	UPNPALBUMART_NAMES,		/* list of '/'-delimited file names to check for album art */
 	UPNPINOTIFY,			/* enable inotify on the media directories */
+	UPNPFANOTIFY,			/* watch whole filesystems with fanotify instead */
 	UPNPDBDIR,			/* base directory to store the database and album art cache */
 	UPNPLOGDIR,			/* base directory to store the log file */
 	UPNPLOGLEVEL,			/* logging verbosity */
@@ -58,7 +59,12 @@ enum upnpconfigoptions {
 	FORCE_SORT_CRITERIA,		/* force sorting by a given sort criteria */
 	MAX_CONNECTIONS,		/* maximum number of simultaneous connections */
 	MERGE_MEDIA_DIRS,		/* don't add an extra directory level when there are multiple media dirs */
-	WIDE_LINKS			/* allow following symlinks outside the defined media_dirs */
+	WIDE_LINKS,			/* allow following symlinks outside the defined media_dirs */
+	MAX_SEARCH_COUNT,		/* stop counting Search matches after this many */
+	BROWSE_SNAPSHOT,		/* serve Browse from a memory-mapped copy of the database */
+	SCAN_THREADS,			/* number of threads parsing metadata during a scan */
+	SCAN_READ_RATE,			/* limit on how fast the scanner reads from disk */
+	INOTIFY_DELAY			/* how long changes settle before they are applied */
 };
 
 /* readoptionsfile()
@@ -130,6 +130,7 @@ fill_playlists(void)
 		goto done;
 
 	rows++;
+	sql_batch_begin(db);
 	for( i=3; i<rows*3; i++ )
 	{
 		plID = strtoll(result[i], NULL, 10);
@@ -214,7 +215,7 @@ found:
 				             " (OBJECT_ID, PARENT_ID, CLASS, DETAIL_ID, NAME, REF_ID) "
 				             "SELECT"
 				             " '%s$%llX$%d', '%s$%llX', CLASS, DETAIL_ID, NAME, OBJECT_ID from OBJECTS"
-				             " where DETAIL_ID = %lld and OBJECT_ID glob '" BROWSEDIR_ID "$*'",
+				             " where DETAIL_ID = %lld and OBJECT_ID >= '" BROWSEDIR_ID "$' and OBJECT_ID < '" BROWSEDIR_ID "%%'",
 				             MUSIC_PLIST_ID, plID, plist.track,
 				             MUSIC_PLIST_ID, plID,
 				             detailID);
@@ -230,6 +231,7 @@ found:
 					last_hash = hash;
 				}
 				found++;
+				sql_batch_step(db);
 			}
 			else
 			{
@@ -254,6 +256,7 @@ found:
 		}
 		sql_exec(db, "UPDATE PLAYLISTS set FOUND = %d where ID = %lld", found, plID);
 	}
+	sql_batch_end(db);
 done:
 	sqlite3_free_table(result);
 	DPRINTF(E_WARN, L_SCANNER, "Finished parsing playlists.\n");
@@ -37,6 +37,7 @@
 #include <string.h>
 #include <signal.h>
 #include <sys/wait.h>
+#include <sys/mman.h>
 
 #include "upnpglobalvars.h"
 #include "process.h"
@@ -45,6 +46,22 @@
 
 struct child *children = NULL;
 int number_of_children = 0;
+struct stream_stats *stream_stats = NULL;
+
+void
+process_stats_init(void)
+{
+	void *stats;
+
+	stats = mmap(NULL, sizeof(struct stream_stats), PROT_READ|PROT_WRITE,
+	             MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+	if (stats == MAP_FAILED)
+	{
+		DPRINTF(E_WARN, L_GENERAL, "Failed to map stream statistics: %s\n", strerror(errno));
+		return;
+	}
+	stream_stats = stats;
+}
 
 static void
 add_process_info(pid_t pid, struct client_cache_s *client)
@@ -100,6 +117,8 @@ process_fork(struct client_cache_s *client)
 			client->connections++;
 		add_process_info(pid, client);
 		number_of_children++;
+		if (stream_stats)
+			stream_stats->streams = number_of_children;
 	}
 
 	return pid;
@@ -120,6 +139,8 @@ process_handle_child_termination(int signal)
 				break;
 		}
 		number_of_children--;
+		if (stream_stats)
+			stream_stats->streams = number_of_children;
 		remove_process_info(pid);
 	}
 }
@@ -41,6 +41,21 @@ struct child {
 extern struct child *children;
 extern int number_of_children;
 
+/* Shared with the scanner process, so that it can keep out of the way of
+ * the children that are streaming */
+struct stream_stats {
+	volatile int streams;		/* number_of_children */
+	volatile unsigned long sent;	/* bytes sent by all children, wrapping around */
+};
+
+extern struct stream_stats *stream_stats;
+
+/**
+ * Set up stream_stats in memory that processes forked afterwards share.
+ * stream_stats stays NULL if that fails.
+ */
+void process_stats_init(void);
+
 /**
  * Fork a new child (just like fork()) but keep track of how many childs are
  * already running, and refuse fo fork if there are too many.
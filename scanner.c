@@ -19,14 +19,20 @@
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
 #include <dirent.h>
 #include <locale.h>
 #include <libgen.h>
 #include <inttypes.h>
+#include <fcntl.h>
+#include <time.h>
 #include <sys/param.h>
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/resource.h>
+#include <sys/syscall.h>
 
 #include "config.h"
 
@@ -44,6 +50,8 @@
 #include "sql.h"
 #include "scanner.h"
 #include "albumart.h"
+#include "metacache.h"
+#include "process.h"
 #include "containers.h"
 #include "log.h"
 
@@ -65,15 +73,141 @@ struct virtual_item
 	char name[256];
 };
 
-int64_t
-get_next_available_id(const char *table, const char *parentID)
+/* Object IDs remembered by name, for as long as the scanner (or the
+ * inotify thread) runs */
+struct id_entry {
+	struct id_entry *next;
+	int64_t id;
+	char key[];
+};
+
+struct id_map {
+	struct id_entry **buckets;
+	unsigned int size;
+	unsigned int count;
+};
+
+static unsigned int
+id_hash(const char *key)
+{
+	unsigned int hash = 2166136261u;
+
+	while( *key )
+		hash = (hash ^ (unsigned char)*key++) * 16777619u;
+
+	return hash;
+}
+
+static struct id_entry *
+id_map_find(struct id_map *map, const char *key)
+{
+	struct id_entry *e;
+
+	if( !map->size )
+		return NULL;
+	for( e = map->buckets[id_hash(key) & (map->size - 1)]; e; e = e->next )
+		if( strcmp(e->key, key) == 0 )
+			return e;
+
+	return NULL;
+}
+
+static struct id_entry *
+id_map_add(struct id_map *map, const char *key, int64_t id)
+{
+	struct id_entry *e, *next, **buckets;
+	unsigned int i, slot;
+
+	if( map->count >= map->size )
+	{
+		unsigned int size = map->size ? map->size * 2 : 1024;
+
+		buckets = calloc(size, sizeof(*buckets));
+		if( !buckets )
+			return NULL;
+		for( i = 0; i < map->size; i++ )
+		{
+			for( e = map->buckets[i]; e; e = next )
+			{
+				next = e->next;
+				slot = id_hash(e->key) & (size - 1);
+				e->next = buckets[slot];
+				buckets[slot] = e;
+			}
+		}
+		free(map->buckets);
+		map->buckets = buckets;
+		map->size = size;
+	}
+	e = malloc(sizeof(*e) + strlen(key) + 1);
+	if( !e )
+		return NULL;
+	strcpy(e->key, key);
+	e->id = id;
+	slot = id_hash(key) & (map->size - 1);
+	e->next = map->buckets[slot];
+	map->buckets[slot] = e;
+	map->count++;
+
+	return e;
+}
+
+static void
+id_map_free(struct id_map *map)
+{
+	struct id_entry *e, *next;
+	unsigned int i;
+
+	for( i = 0; i < map->size; i++ )
+	{
+		for( e = map->buckets[i]; e; e = next )
+		{
+			next = e->next;
+			free(e);
+		}
+	}
+	free(map->buckets);
+	memset(map, 0, sizeof(*map));
+}
+
+/* The next free child ID of every container we have handed out IDs for.
+ * Entries are only ever moved forward, so an ID is never handed out twice
+ * even if the child it went to is still waiting in the scan queue, or has
+ * since been removed. */
+static struct id_map next_ids;
+
+/* The virtual containers found so far, keyed by their parent, name, artist
+ * and class.  Unlike next_ids, this has to be dropped whenever something
+ * is removed, along with the rest of the valid_cache state. */
+static struct id_map containers;
+
+/* Reserve count consecutive child IDs under parentID.  The first time we
+ * see a container its next ID is looked up in the database, unless the
+ * caller knows it was just created. */
+static int64_t
+next_available_ids(const char *parentID, int count, int created)
 {
+	struct id_entry *e;
+	int64_t objectID = 0;
+
+	e = id_map_find(&next_ids, parentID);
+	if( e )
+	{
+		objectID = e->id;
+		e->id += count;
+		return objectID;
+	}
+
+	if( !created )
+	{
 		char *ret, *base;
-		int64_t objectID = 0;
 
-		ret = sql_get_text_field(db, "SELECT OBJECT_ID from %s where ID = "
-		                             "(SELECT max(ID) from %s where PARENT_ID = '%s')",
-		                             table, table, parentID);
+		/* Not necessarily the newest row, since moves renumber in place.
+		 * Child IDs are parentID$ plus an unpadded number, so the longest
+		 * sorts last. */
+		ret = sql_get_text_field(db, "SELECT OBJECT_ID from OBJECTS where PARENT_ID = '%s'"
+		                             " order by length(OBJECT_ID) desc, OBJECT_ID desc limit 1",
+		                             parentID);
 		if( ret )
 		{
 			base = strrchr(ret, '$');
@@ -81,39 +215,68 @@ get_next_available_id(const char *table, const char *parentID)
 				objectID = strtoll(base+1, NULL, 16) + 1;
 			sqlite3_free(ret);
 		}
+	}
+	id_map_add(&next_ids, parentID, objectID + count);
 
-		return objectID;
+	return objectID;
+}
+
+int64_t
+get_next_available_id(const char *parentID)
+{
+	return next_available_ids(parentID, 1, 0);
 }
 
 int
 insert_container(const char *item, const char *rootParent, const char *refID, const char *class,
                  const char *artist, const char *genre, const char *album_art, int64_t *objectID, int64_t *parentID)
 {
-	char *result;
-	char *base;
+	struct id_entry *e;
+	char *result = NULL;
+	char *base, *key, *p;
+	char id_buf[64];
 	int ret = 0;
 
-	result = sql_get_text_field(db, "SELECT OBJECT_ID from OBJECTS o "
-	                                "left join DETAILS d on (o.DETAIL_ID = d.ID)"
-	                                " where o.PARENT_ID = '%s'"
-			                " and o.NAME like '%q'"
-			                " and d.ARTIST %s %Q"
-	                                " and o.CLASS = 'container.%s' limit 1",
-	                                rootParent, item, artist?"like":"is", artist, class);
-	if( result )
-	{
-		base = strrchr(result, '$');
-		if( base )
-			*parentID = strtoll(base+1, NULL, 16);
+	if( !valid_cache )
+		id_map_free(&containers);
+	/* The database lookup matches the names with LIKE, so ignore ASCII case here as well */
+	key = sqlite3_mprintf("%s\t%s\t%c%s\t%s", rootParent, item, artist ? '+' : '-', artist ? artist : "", class);
+	if( !key )
+		return -1;
+	for( p = key; *p; p++ )
+		if( *p >= 'A' && *p <= 'Z' )
+			*p += 'a' - 'A';
+	e = id_map_find(&containers, key);
+	if( !e )
+		result = sql_get_text_field(db, "SELECT OBJECT_ID from OBJECTS o "
+		                                "left join DETAILS d on (o.DETAIL_ID = d.ID)"
+		                                " where o.PARENT_ID = '%s'"
+		                                " and o.NAME like '%q'"
+		                                " and d.ARTIST %s %Q"
+		                                " and o.CLASS = 'container.%s' limit 1",
+		                                rootParent, item, artist?"like":"is", artist, class);
+	if( e || result )
+	{
+		if( e )
+			*parentID = e->id;
 		else
-			*parentID = 0;
-		*objectID = get_next_available_id("OBJECTS", result);
+		{
+			base = strrchr(result, '$');
+			*parentID = base ? strtoll(base+1, NULL, 16) : 0;
+			id_map_add(&containers, key, *parentID);
+		}
+		snprintf(id_buf, sizeof(id_buf), "%s$%llX", rootParent, (long long)*parentID);
+		if( objectID )
+			*objectID = get_next_available_id(id_buf);
 	}
 	else
 	{
 		int64_t detailID = 0;
-		*objectID = 0;
-		*parentID = get_next_available_id("OBJECTS", rootParent);
+		*parentID = get_next_available_id(rootParent);
+		snprintf(id_buf, sizeof(id_buf), "%s$%llX", rootParent, (long long)*parentID);
+		next_available_ids(id_buf, 0, 1);
+		if( objectID )
+			*objectID = next_available_ids(id_buf, 1, 1);
 		if( refID )
 		{
 			result = sql_get_text_field(db, "SELECT DETAIL_ID from OBJECTS where OBJECT_ID = %Q", refID);
@@ -130,8 +293,11 @@ insert_container(const char *item, const char *rootParent, const char *refID, co
 		                   " ('%s$%llX', '%s', %Q, %lld, 'container.%s', '%q')",
 		                   rootParent, (long long)*parentID, rootParent,
 		                   refID, (long long)detailID, class, item);
+		if( ret == SQLITE_OK )
+			id_map_add(&containers, key, *parentID);
 	}
 	sqlite3_free(result);
+	sqlite3_free(key);
 
 	return ret;
 }
@@ -151,8 +317,6 @@ insert_containers(const char *name, const char *path, const char *refID, const c
 		static struct virtual_item last_date;
 		static struct virtual_item last_cam;
 		static struct virtual_item last_camdate;
-		static long long last_all_objectID = 0;
-
 		snprintf(sql, sizeof(sql), "SELECT DATE, CREATOR from DETAILS where ID = %lld", (long long)detailID);
 		ret = sql_get_table(db, sql, &result, &row, &cols);
 		if( ret == SQLITE_OK )
@@ -169,7 +333,7 @@ insert_containers(const char *name, const char *path, const char *refID, const c
 
 		if( valid_cache && strcmp(last_date.name, date_taken) == 0 )
 		{
-			last_date.objectID++;
+			last_date.objectID = get_next_available_id(last_date.parentID);
 			//DEBUG DPRINTF(E_DEBUG, L_SCANNER, "Using last date item: %s/%s/%X\n", last_date.name, last_date.parentID, last_date.objectID);
 		}
 		else
@@ -188,7 +352,7 @@ insert_containers(const char *name, const char *path, const char *refID, const c
 
 		if( !valid_cache || strcmp(camera, last_cam.name) != 0 )
 		{
-			insert_container(camera, IMAGE_CAMERA_ID, NULL, "storageFolder", NULL, NULL, NULL, &objectID, &parentID);
+			insert_container(camera, IMAGE_CAMERA_ID, NULL, "storageFolder", NULL, NULL, NULL, NULL, &parentID);
 			sprintf(last_cam.parentID, IMAGE_CAMERA_ID"$%llX", (long long)parentID);
 			strncpyt(last_cam.name, camera, sizeof(last_cam.name));
 			/* Invalidate last_camdate cache */
@@ -196,7 +360,7 @@ insert_containers(const char *name, const char *path, const char *refID, const c
 		}
 		if( valid_cache && strcmp(last_camdate.name, date_taken) == 0 )
 		{
-			last_camdate.objectID++;
+			last_camdate.objectID = get_next_available_id(last_camdate.parentID);
 			//DEBUG DPRINTF(E_DEBUG, L_SCANNER, "Using last camdate item: %s/%s/%s/%X\n", camera, last_camdate.name, last_camdate.parentID, last_camdate.objectID);
 		}
 		else
@@ -213,15 +377,11 @@ insert_containers(const char *name, const char *path, const char *refID, const c
 		             " ('%s$%llX', '%s', '%s', '%s', %lld, %Q)",
 		             last_camdate.parentID, last_camdate.objectID, last_camdate.parentID, refID, class, (long long)detailID, name);
 		/* All Images */
-		if( !last_all_objectID )
-		{
-			last_all_objectID = get_next_available_id("OBJECTS", IMAGE_ALL_ID);
-		}
 		sql_exec(db, "INSERT into OBJECTS"
 		             " (OBJECT_ID, PARENT_ID, REF_ID, CLASS, DETAIL_ID, NAME) "
 		             "VALUES"
 		             " ('"IMAGE_ALL_ID"$%llX', '"IMAGE_ALL_ID"', '%s', '%s', %lld, %Q)",
-		             last_all_objectID++, refID, class, (long long)detailID, name);
+		             (long long)get_next_available_id(IMAGE_ALL_ID), refID, class, (long long)detailID, name);
 	}
 	else if( strstr(class, "audioItem") )
 	{
@@ -243,13 +403,12 @@ insert_containers(const char *name, const char *path, const char *refID, const c
 		static struct virtual_item last_genre;
 		static struct virtual_item last_genreArtist;
 		static struct virtual_item last_genreArtistAll;
-		static long long last_all_objectID = 0;
 
 		if( album )
 		{
 			if( valid_cache && strcmp(album, last_album.name) == 0 )
 			{
-				last_album.objectID++;
+				last_album.objectID = get_next_available_id(last_album.parentID);
 				//DEBUG DPRINTF(E_DEBUG, L_SCANNER, "Using last album item: %s/%s/%X\n", last_album.name, last_album.parentID, last_album.objectID);
 			}
 			else
@@ -270,7 +429,7 @@ insert_containers(const char *name, const char *path, const char *refID, const c
 		{
 			if( !valid_cache || strcmp(artist, last_artist.name) != 0 )
 			{
-				insert_container(artist, MUSIC_ARTIST_ID, NULL, "person.musicArtist", NULL, genre, NULL, &objectID, &parentID);
+				insert_container(artist, MUSIC_ARTIST_ID, NULL, "person.musicArtist", NULL, genre, NULL, NULL, &parentID);
 				sprintf(last_artist.parentID, MUSIC_ARTIST_ID"$%llX", (long long)parentID);
 				strncpyt(last_artist.name, artist, sizeof(last_artist.name));
 				last_artistAlbum.name[0] = '\0';
@@ -281,11 +440,11 @@ insert_containers(const char *name, const char *path, const char *refID, const c
 			}
 			else
 			{
-				last_artistAlbumAll.objectID++;
+				last_artistAlbumAll.objectID = get_next_available_id(last_artistAlbumAll.parentID);
 			}
 			if( valid_cache && strcmp(album?album:_("Unknown Album"), last_artistAlbum.name) == 0 )
 			{
-				last_artistAlbum.objectID++;
+				last_artistAlbum.objectID = get_next_available_id(last_artistAlbum.parentID);
 				//DEBUG DPRINTF(E_DEBUG, L_SCANNER, "Using last artist/album item: %s/%s/%X\n", last_artist.name, last_artist.parentID, last_artist.objectID);
 			}
 			else
@@ -312,7 +471,7 @@ insert_containers(const char *name, const char *path, const char *refID, const c
 		{
 			if( !valid_cache || strcmp(genre, last_genre.name) != 0 )
 			{
-				insert_container(genre, MUSIC_GENRE_ID, NULL, "genre.musicGenre", NULL, NULL, NULL, &objectID, &parentID);
+				insert_container(genre, MUSIC_GENRE_ID, NULL, "genre.musicGenre", NULL, NULL, NULL, NULL, &parentID);
 				sprintf(last_genre.parentID, MUSIC_GENRE_ID"$%llX", (long long)parentID);
 				strncpyt(last_genre.name, genre, sizeof(last_genre.name));
 				/* Add this file to the "- All Artists -" container as well */
@@ -322,11 +481,11 @@ insert_containers(const char *name, const char *path, const char *refID, const c
 			}
 			else
 			{
-				last_genreArtistAll.objectID++;
+				last_genreArtistAll.objectID = get_next_available_id(last_genreArtistAll.parentID);
 			}
 			if( valid_cache && strcmp(artist?artist:_("Unknown Artist"), last_genreArtist.name) == 0 )
 			{
-				last_genreArtist.objectID++;
+				last_genreArtist.objectID = get_next_available_id(last_genreArtist.parentID);
 			}
 			else
 			{
@@ -349,30 +508,20 @@ insert_containers(const char *name, const char *path, const char *refID, const c
 			             last_genreArtistAll.parentID, last_genreArtistAll.objectID, last_genreArtistAll.parentID, refID, class, (long long)detailID, name);
 		}
 		/* All Music */
-		if( !last_all_objectID )
-		{
-			last_all_objectID = get_next_available_id("OBJECTS", MUSIC_ALL_ID);
-		}
 		sql_exec(db, "INSERT into OBJECTS"
 		             " (OBJECT_ID, PARENT_ID, REF_ID, CLASS, DETAIL_ID, NAME) "
 		             "VALUES"
 		             " ('"MUSIC_ALL_ID"$%llX', '"MUSIC_ALL_ID"', '%s', '%s', %lld, %Q)",
-		             last_all_objectID++, refID, class, (long long)detailID, name);
+		             (long long)get_next_available_id(MUSIC_ALL_ID), refID, class, (long long)detailID, name);
 	}
 	else if( strstr(class, "videoItem") )
 	{
-		static long long last_all_objectID = 0;
-
 		/* All Videos */
-		if( !last_all_objectID )
-		{
-			last_all_objectID = get_next_available_id("OBJECTS", VIDEO_ALL_ID);
-		}
 		sql_exec(db, "INSERT into OBJECTS"
 		             " (OBJECT_ID, PARENT_ID, REF_ID, CLASS, DETAIL_ID, NAME) "
 		             "VALUES"
 		             " ('"VIDEO_ALL_ID"$%llX', '"VIDEO_ALL_ID"', '%s', '%s', %lld, %Q)",
-		             last_all_objectID++, refID, class, (long long)detailID, name);
+		             (long long)get_next_available_id(VIDEO_ALL_ID), refID, class, (long long)detailID, name);
 		return;
 	}
 	else
@@ -445,59 +594,266 @@ insert_directory(const char *name, const char *path, const char *base, const cha
 	return detailID;
 }
 
-int
-insert_file(char *name, const char *path, const char *parentID, int object, media_types types)
-{
-	char class[32];
-	char objectID[64];
-	int64_t detailID = 0;
+/* A file or directory found by the walk.  Files have their metadata parsed
+ * by parse_file(), which doesn't touch the database, and are then written
+ * out by store_file().  During a scan the walk only stores a stub for each
+ * file, which is enough to browse it, and the files are parsed afterwards
+ * by a second pass over the PENDING table. */
+struct scan_job {
+	enum {
+		JOB_QUEUED,
+		JOB_PARSING,
+		JOB_PARSED
+	} state;
+	int is_dir;
+	char *name;
+	char *path;
+	char *parentID;
+	int object;
+	media_types types;
+	time_t changed;		/* ctime of a directory, taken before listing it */
+	/* Set by parse_file() */
+	enum {
+		PARSE_FAILED,
+		PARSE_SKIP,
+		PARSE_PLAYLIST,
+		PARSE_CACHED,
+		PARSE_STUB,
+		PARSE_OK
+	} status;
 	char base[8];
-	char *typedir_parentID;
-	char *baseid;
-	char *orig_name = NULL;
+	char class[32];
+	struct media_details details;
+	/* Set when the file was looked up in the metadata cache */
+	struct stat st;
+	int64_t cached;
+	/* The stub this job replaces, in the second pass */
+	int64_t pending;
+};
+
+/* The MIME type a stub goes out with, going by the extension, until the
+ * file is parsed.  Extensions that can hold either audio or video are
+ * listed once for each. */
+static const struct {
+	const char *ext;
+	const char *mime;
+} stub_mimes[] = {
+	{ ".jpg",  "image/jpeg" },
+	{ ".jpeg", "image/jpeg" },
+	{ ".mpg",  "video/mpeg" },
+	{ ".mpeg", "video/mpeg" },
+	{ ".vob",  "video/mpeg" },
+	{ ".ts",   "video/mpeg" },
+	{ ".mts",  "video/mpeg" },
+	{ ".m2ts", "video/mpeg" },
+	{ ".m2t",  "video/mpeg" },
+	{ ".avi",  "video/x-msvideo" },
+	{ ".divx", "video/x-msvideo" },
+	{ ".xvid", "video/x-msvideo" },
+	{ ".asf",  "video/x-ms-wmv" },
+	{ ".wmv",  "video/x-ms-wmv" },
+	{ ".mp4",  "video/mp4" },
+	{ ".m4v",  "video/mp4" },
+	{ ".mkv",  "video/x-matroska" },
+	{ ".flv",  "video/x-flv" },
+	{ ".mov",  "video/quicktime" },
+	{ ".3gp",  "video/3gpp" },
+	{ ".TiVo", "video/x-tivo-mpeg" },
+	{ ".mp3",  "audio/mpeg" },
+	{ ".flac", "audio/x-flac" },
+	{ ".fla",  "audio/x-flac" },
+	{ ".flc",  "audio/x-flac" },
+	{ ".wma",  "audio/x-ms-wma" },
+	{ ".asf",  "audio/x-ms-wma" },
+	{ ".m4a",  "audio/mp4" },
+	{ ".m4p",  "audio/mp4" },
+	{ ".mp4",  "audio/mp4" },
+	{ ".aac",  "audio/mp4" },
+	{ ".3gp",  "audio/3gpp" },
+	{ ".wav",  "audio/x-wav" },
+	{ ".ogg",  "audio/ogg" },
+	{ ".pcm",  "audio/L16" },
+	{ NULL, NULL }
+};
+
+static const char *
+stub_mime(const struct scan_job *job)
+{
+	int i;
+
+	/* "item.xxxxx" */
+	for( i = 0; stub_mimes[i].ext; i++ )
+	{
+		if( *stub_mimes[i].mime == job->class[5] && ends_with(job->name, stub_mimes[i].ext) )
+			return stub_mimes[i].mime;
+	}
+	return NULL;
+}
+
+/* Decide what a file will probably turn out to be, the way parse_file()
+ * would, without opening it.  Returns 0 for files that can't be stubbed. */
+static int
+stub_file(struct scan_job *job)
+{
+	const char *name = job->name;
+	media_types types = job->types;
 
 	if( (types & TYPE_IMAGES) && is_image(name) )
 	{
 		if( is_album_art(name) )
-			return -1;
-		strcpy(base, IMAGE_DIR_ID);
-		strcpy(class, "item.imageItem.photo");
-		detailID = GetImageMetadata(path, name);
+			return 0;
+		strcpy(job->class, "item.imageItem.photo");
+	}
+	else if( (types & TYPE_VIDEO) && is_video(name) )
+		strcpy(job->class, "item.videoItem");
+	else if( (types & TYPE_AUDIO) && is_audio(name) )
+		strcpy(job->class, "item.audioItem.musicTrack");
+	else
+		return 0;
+	if( !stub_mime(job) )
+		return 0;
+	job->status = PARSE_STUB;
+
+	return 1;
+}
+
+static int64_t
+store_stub(struct scan_job *job)
+{
+	const char *mime = stub_mime(job);
+
+	strip_ext(job->name);
+	if( sql_exec(db, "INSERT into DETAILS (PATH, SIZE, TIMESTAMP, TITLE, MIME) "
+	                 "VALUES (%Q, %lld, %lld, '%q', '%s')",
+	                 job->path, (long long)job->st.st_size, (long long)job->st.st_mtime,
+	                 job->name, mime) != SQLITE_OK )
+		return 0;
+	job->pending = sqlite3_last_insert_rowid(db);
+	sql_exec(db, "INSERT into PENDING (ID, TIMESTAMP, TYPES) VALUES (%lld, %lld, %d)",
+	         (long long)job->pending, (long long)job->st.st_mtime, job->types);
+
+	return job->pending;
+}
+
+static void
+parse_file(struct scan_job *job)
+{
+	char *name = job->name;
+	const char *path = job->path;
+	media_types types = job->types;
+	char *orig_name;
+
+	job->status = PARSE_FAILED;
+	if( (types & TYPE_IMAGES) && is_image(name) )
+	{
+		if( is_album_art(name) )
+		{
+			job->status = PARSE_SKIP;
+			return;
+		}
+		strcpy(job->base, IMAGE_DIR_ID);
+		strcpy(job->class, "item.imageItem.photo");
+		if( ParseImageMetadata(path, name, &job->details) == 0 )
+			job->status = PARSE_OK;
 	}
 	else if( (types & TYPE_VIDEO) && is_video(name) )
 	{
  		orig_name = strdup(name);
-		strcpy(base, VIDEO_DIR_ID);
-		strcpy(class, "item.videoItem");
-		detailID = GetVideoMetadata(path, name);
-		if( !detailID )
+		strcpy(job->base, VIDEO_DIR_ID);
+		strcpy(job->class, "item.videoItem");
+		if( ParseVideoMetadata(path, name, &job->details) == 0 )
+			job->status = PARSE_OK;
+		else
 			strcpy(name, orig_name);
+		free(orig_name);
 	}
 	else if( is_playlist(name) )
 	{
-		if( insert_playlist(path, name) == 0 )
-			return 1;
+		/* Playlists are read while they are stored */
+		job->status = PARSE_PLAYLIST;
+		return;
+	}
+	if( job->status != PARSE_OK && (types & TYPE_AUDIO) && is_audio(name) )
+	{
+		strcpy(job->base, MUSIC_DIR_ID);
+		strcpy(job->class, "item.audioItem.musicTrack");
+		if( ParseAudioMetadata(path, name, &job->details) == 0 )
+			job->status = PARSE_OK;
+	}
+}
+
+static int
+store_file(struct scan_job *job)
+{
+	char *name = job->name;
+	const char *path = job->path;
+	const char *parentID = job->parentID;
+	const char *base = job->base;
+	const char *class = job->class;
+	int object = job->object;
+	char objectID[64];
+	int64_t detailID = 0;
+	char *typedir_parentID;
+	char *baseid;
+
+	/* The stub is replaced by whatever the file turned out to be, under
+	 * the same IDs */
+	if( job->pending && job->status != PARSE_STUB )
+	{
+		sql_exec(db, "DELETE from PENDING where ID = %lld", (long long)job->pending);
+		sql_exec(db, "DELETE from DETAILS where ID = %lld", (long long)job->pending);
 	}
-	if( !detailID && (types & TYPE_AUDIO) && is_audio(name) )
+	switch( job->status )
 	{
-		strcpy(base, MUSIC_DIR_ID);
-		strcpy(class, "item.audioItem.musicTrack");
-		detailID = GetAudioMetadata(path, name);
+	case PARSE_SKIP:
+		return -1;
+	case PARSE_STUB:
+		detailID = store_stub(job);
+		break;
+	case PARSE_PLAYLIST:
+		if( insert_playlist(path, name) == 0 )
+			return 1;
+		break;
+	case PARSE_CACHED:
+		detailID = metacache_store(job->cached, path, name);
+		if( detailID )
+			break;
+		/* Parse it after all */
+		parse_file(job);
+		if( job->status != PARSE_OK )
+			break;
+		/* fall through */
+	case PARSE_OK:
+		detailID = StoreMetadata(job->pending, path, name, &job->details);
+		if( detailID && job->st.st_ino )
+			metacache_add(path, name, &job->st, job->types, class, detailID);
+		break;
+	default:
+		break;
 	}
-	free(orig_name);
 	if( !detailID )
 	{
+		if( job->pending )
+			sql_exec(db, "DELETE from OBJECTS where DETAIL_ID = %lld", (long long)job->pending);
 		DPRINTF(E_WARN, L_SCANNER, "Unsuccessful getting details for %s!\n", path);
 		return -1;
 	}
 
 	sprintf(objectID, "%s%s$%X", BROWSEDIR_ID, parentID, object);
 
-	sql_exec(db, "INSERT into OBJECTS"
-	             " (OBJECT_ID, PARENT_ID, CLASS, DETAIL_ID, NAME) "
-	             "VALUES"
-	             " ('%s', '%s%s', '%s', %lld, '%q')",
-	             objectID, BROWSEDIR_ID, parentID, class, detailID, name);
+	if( job->pending && job->status != PARSE_STUB )
+		sql_exec(db, "UPDATE OBJECTS set CLASS = '%s', (SORT_TITLE, SORT_DATE, SORT_DISC, SORT_TRACK) ="
+		             " (SELECT TITLE, DATE, DISC, TRACK from DETAILS where ID = %lld)"
+		             " where OBJECT_ID = '%s'", class, (long long)detailID, objectID);
+	else
+		sql_exec(db, "INSERT into OBJECTS"
+		             " (OBJECT_ID, PARENT_ID, CLASS, DETAIL_ID, NAME) "
+		             "VALUES"
+		             " ('%s', '%s%s', '%s', %lld, '%q')",
+		             objectID, BROWSEDIR_ID, parentID, class, detailID, name);
+	/* The Folders views and the virtual containers wait for the metadata */
+	if( job->status == PARSE_STUB )
+		return 0;
 
 	if( *parentID )
 	{
@@ -522,6 +878,22 @@ insert_file(char *name, const char *path, const char *parentID, int object, medi
 	return 0;
 }
 
+int
+insert_file(char *name, const char *path, const char *parentID, int object, media_types types)
+{
+	struct scan_job job;
+
+	memset(&job, 0, sizeof(job));
+	job.name = name;
+	job.path = (char *)path;
+	job.parentID = (char *)parentID;
+	job.object = object;
+	job.types = types;
+	parse_file(&job);
+
+	return store_file(&job);
+}
+
 int
 CreateDatabase(void)
 {
@@ -564,9 +936,15 @@ CreateDatabase(void)
 	if( ret != SQLITE_OK )
 		goto sql_failed;
 	ret = sql_exec(db, create_playlistTable_sqlite);
+	if( ret != SQLITE_OK )
+		goto sql_failed;
+	ret = sql_exec(db, create_pendingTable_sqlite);
 	if( ret != SQLITE_OK )
 		goto sql_failed;
 	ret = sql_exec(db, create_settingsTable_sqlite);
+	if( ret != SQLITE_OK )
+		goto sql_failed;
+	ret = sql_exec(db, create_objectTriggers_sqlite);
 	if( ret != SQLITE_OK )
 		goto sql_failed;
 	ret = sql_exec(db, "INSERT into SETTINGS values ('UPDATE_ID', '0')");
@@ -601,14 +979,14 @@ CreateDatabase(void)
 				goto sql_failed;
 		}
 	}
-	sql_exec(db, "create INDEX IDX_OBJECTS_OBJECT_ID ON OBJECTS(OBJECT_ID);");
-	sql_exec(db, "create INDEX IDX_OBJECTS_PARENT_ID ON OBJECTS(PARENT_ID);");
+	/* OBJECT_ID and DETAILS.ID are already indexed as UNIQUE and as the rowid */
+	sql_exec(db, "create INDEX IDX_OBJECTS_PARENT ON OBJECTS(PARENT, NAME);");
 	sql_exec(db, "create INDEX IDX_OBJECTS_DETAIL_ID ON OBJECTS(DETAIL_ID);");
 	sql_exec(db, "create INDEX IDX_OBJECTS_CLASS ON OBJECTS(CLASS);");
 	sql_exec(db, "create INDEX IDX_DETAILS_PATH ON DETAILS(PATH);");
-	sql_exec(db, "create INDEX IDX_DETAILS_ID ON DETAILS(ID);");
 	sql_exec(db, "create INDEX IDX_ALBUM_ART ON ALBUM_ART(ID);");
 	sql_exec(db, "create INDEX IDX_SCANNER_OPT ON OBJECTS(PARENT_ID, NAME, OBJECT_ID);");
+	sql_exec(db, "create INDEX IDX_PENDING_TIMESTAMP ON PENDING(TIMESTAMP);");
 
 sql_failed:
 	if( ret != SQLITE_OK )
@@ -616,6 +994,101 @@ sql_failed:
 	return (ret != SQLITE_OK);
 }
 
+int
+CreateSearchIndex(void)
+{
+	int ret;
+
+	/* FTS5 and the trigram tokenizer are optional in SQLite, so searches fall
+	 * back to plain LIKE matching if we can't create the index. */
+	ret = sqlite3_exec(db, create_detailFtsTable_sqlite, NULL, NULL, NULL);
+	if( ret != SQLITE_OK )
+	{
+		DPRINTF(E_WARN, L_DB_SQL, "SQLite full-text search is unavailable; searches will be slower\n");
+		return -1;
+	}
+	ret = sql_exec(db, "INSERT into DETAILS_FTS (DETAILS_FTS) values ('rebuild')");
+	if( ret == SQLITE_OK )
+		ret = sql_exec(db, create_detailFtsTriggers_sqlite);
+	if( ret != SQLITE_OK )
+	{
+		sql_exec(db, "DROP TRIGGER IF EXISTS DETAILS_FTS_AI; "
+		             "DROP TRIGGER IF EXISTS DETAILS_FTS_AD; "
+		             "DROP TRIGGER IF EXISTS DETAILS_FTS_AU; "
+		             "DROP TABLE DETAILS_FTS;");
+		return -1;
+	}
+
+	return 0;
+}
+
+/* These let SQLite return a container's children in the common sort
+ * orders straight from an index, instead of sorting them for every Browse. */
+static int
+CreateSortIndexes(void)
+{
+	return sql_exec(db, create_sortIndexes_sqlite);
+}
+
+/* Bring a database written by an older version up to DB_VERSION without
+ * rescanning.  Returns non-zero if that isn't possible, in which case the
+ * caller has to start over with a new database. */
+int
+UpgradeDatabase(int db_vers)
+{
+	int ret = SQLITE_OK;
+
+	if( db_vers < 9 )
+		return -1;
+	DPRINTF(E_WARN, L_DB_SQL, "Upgrading database from version %d to %d\n", db_vers, DB_VERSION);
+	sql_exec(db, "BEGIN");
+	if( db_vers < 11 )
+		ret = sql_exec(db, "ALTER TABLE OBJECTS ADD COLUMN SORT_TITLE TEXT COLLATE NOCASE DEFAULT NULL; "
+		                   "ALTER TABLE OBJECTS ADD COLUMN SORT_DATE DATE DEFAULT NULL; "
+		                   "ALTER TABLE OBJECTS ADD COLUMN SORT_DISC INTEGER DEFAULT NULL; "
+		                   "ALTER TABLE OBJECTS ADD COLUMN SORT_TRACK INTEGER DEFAULT NULL;");
+	if( ret == SQLITE_OK && db_vers < 12 )
+		ret = sql_exec(db, "ALTER TABLE OBJECTS ADD COLUMN PARENT INTEGER DEFAULT NULL; "
+		                   "DROP TRIGGER IF EXISTS OBJECTS_SORT_AI; "
+		                   "DROP TRIGGER IF EXISTS OBJECTS_SORT_AU; "
+		                   "DROP TRIGGER IF EXISTS DETAILS_SORT_AU; "
+		                   "DROP INDEX IF EXISTS IDX_OBJECTS_OBJECT_ID; "
+		                   "DROP INDEX IF EXISTS IDX_OBJECTS_PARENT_ID; "
+		                   "DROP INDEX IF EXISTS IDX_DETAILS_ID; "
+		                   "DROP INDEX IF EXISTS IDX_SORT_TITLE; "
+		                   "DROP INDEX IF EXISTS IDX_SORT_DATE; "
+		                   "DROP INDEX IF EXISTS IDX_SORT_CLASS_TITLE; "
+		                   "DROP INDEX IF EXISTS IDX_SORT_CLASS_TRACK; "
+		                   "UPDATE OBJECTS set "
+		                   "PARENT = (SELECT p.ID from OBJECTS p where p.OBJECT_ID = OBJECTS.PARENT_ID), "
+		                   "(SORT_TITLE, SORT_DATE, SORT_DISC, SORT_TRACK) = "
+		                   "(SELECT TITLE, DATE, DISC, TRACK from DETAILS where ID = OBJECTS.DETAIL_ID); "
+		                   "create INDEX IDX_OBJECTS_PARENT ON OBJECTS(PARENT, NAME);");
+	if( ret == SQLITE_OK && db_vers < 12 )
+		ret = sql_exec(db, create_objectTriggers_sqlite);
+	if( ret == SQLITE_OK && db_vers < 12 )
+		ret = CreateSortIndexes();
+	/* Folders remember their ctime, for the startup check */
+	if( ret == SQLITE_OK && db_vers < 13 )
+		ret = sql_exec(db, "ALTER TABLE DETAILS ADD COLUMN DIR_CHANGED INTEGER DEFAULT NULL;");
+	if( ret == SQLITE_OK && db_vers < 14 )
+		ret = sql_exec(db, "%s create INDEX IDX_PENDING_TIMESTAMP ON PENDING(TIMESTAMP);",
+		               create_pendingTable_sqlite);
+	if( ret == SQLITE_OK )
+		ret = sql_exec(db, "pragma user_version = %d;", DB_VERSION);
+	if( ret != SQLITE_OK )
+	{
+		sql_exec(db, "ROLLBACK");
+		return -1;
+	}
+	sql_exec(db, "COMMIT");
+	/* Version 10 added the full-text index, which is optional anyway */
+	if( db_vers < 10 )
+		CreateSearchIndex();
+
+	return 0;
+}
+
 static inline int
 filter_hidden(scan_filter *d)
 {
@@ -714,106 +1187,755 @@ filter_avp(scan_filter *d)
 	       );
 }
 
+/* Parsing metadata is what makes a scan slow, so it runs on a pool of
+ * worker threads.  The walk queues every file and directory it finds, and
+ * this thread writes them out strictly in queue order, parsing a file
+ * itself if no worker has got to it yet.  The database therefore comes
+ * out the same whatever the number of workers. */
+#define SCAN_QUEUE_SIZE 256
+
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t queued;
+	pthread_cond_t parsed;
+	struct scan_job jobs[SCAN_QUEUE_SIZE];
+	unsigned int head;	/* next job to write out */
+	unsigned int next;	/* next job to parse */
+	unsigned int tail;	/* next free slot */
+	int done;
+	int nworkers;
+	pthread_t *workers;
+} scan_queue = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.queued = PTHREAD_COND_INITIALIZER,
+	.parsed = PTHREAD_COND_INITIALIZER,
+};
+static long long unsigned int scan_files = 0;
+static int use_metacache = 0;
+static int defer_parsing = 0;
+
+/* The scanner reads at the idle I/O priority, but not every I/O scheduler
+ * honours that, so reading metadata is also held to scan_read_rate, and to
+ * SCAN_STREAMING_RATE KiB/s while anything is being streamed.  If the
+ * streams' throughput falls to under half of what it has been, parsing
+ * stops for a while in case it's the scanner that's holding them up. */
+#define SCAN_STREAMING_RATE	1024
+#define SCAN_STARVED_PAUSE	5000	/* ms */
+
+#ifndef IOPRIO_CLASS_IDLE
+#define IOPRIO_CLASS_IDLE	3
+#define IOPRIO_CLASS_SHIFT	13
+#define IOPRIO_WHO_PROCESS	1
+#define IOPRIO_PRIO_VALUE(class, data)	(((class) << IOPRIO_CLASS_SHIFT) | (data))
+#endif
+
+static struct {
+	pthread_mutex_t lock;
+	long long last;		/* ms, when the bucket was last filled */
+	long long tokens;	/* bytes that can be read without waiting */
+	long long read;		/* bytes read from disk by then */
+	long long sample;	/* ms, when the stream throughput was sampled */
+	unsigned long sent;	/* bytes streamed by then */
+	long long average;	/* bytes streamed per second */
+	long long resume;	/* ms, end of a pause */
+} throttle = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static long long
+monotonic_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* What this process and its threads have read from disk, as opposed to
+ * from the page cache */
+static long long
+disk_read_bytes(void)
+{
+	struct rusage ru;
+
+	if (getrusage(RUSAGE_SELF, &ru) != 0)
+		return 0;
+	return (long long)ru.ru_inblock * 512;
+}
+
+/* Wait until the next file may be parsed */
 static void
-ScanDirectory(const char *dir, const char *parent, media_types dir_types)
+scan_throttle(void)
 {
-	struct dirent **namelist;
-	int i, n, startID = 0;
-	char *full_path;
-	char *name = NULL;
-	static long long unsigned int fileno = 0;
-	enum file_types type;
+	long long now, rate, bytes, wait = 0;
+	int streams = stream_stats ? stream_stats->streams : 0;
 
-	DPRINTF(parent?E_INFO:E_WARN, L_SCANNER, _("Scanning %s\n"), dir);
-	switch( dir_types )
+	rate = runtime_vars.scan_read_rate * 1024LL;
+	if (streams > 0 && (!rate || rate > SCAN_STREAMING_RATE * 1024LL))
+		rate = SCAN_STREAMING_RATE * 1024LL;
+
+	pthread_mutex_lock(&throttle.lock);
+	now = monotonic_ms();
+	if (!rate)
 	{
-		case ALL_MEDIA:
-			n = scandir(dir, &namelist, filter_avp, alphasort);
-			break;
-		case TYPE_AUDIO:
-			n = scandir(dir, &namelist, filter_a, alphasort);
-			break;
-		case TYPE_AUDIO|TYPE_VIDEO:
-			n = scandir(dir, &namelist, filter_av, alphasort);
-			break;
-		case TYPE_AUDIO|TYPE_IMAGES:
-			n = scandir(dir, &namelist, filter_ap, alphasort);
-			break;
-		case TYPE_VIDEO:
-			n = scandir(dir, &namelist, filter_v, alphasort);
-			break;
-		case TYPE_VIDEO|TYPE_IMAGES:
-			n = scandir(dir, &namelist, filter_vp, alphasort);
-			break;
-		case TYPE_IMAGES:
-			n = scandir(dir, &namelist, filter_p, alphasort);
-			break;
-		default:
-			n = -1;
-			errno = EINVAL;
-			break;
+		throttle.last = 0;
+		pthread_mutex_unlock(&throttle.lock);
+		return;
 	}
-	if( n < 0 )
+	bytes = disk_read_bytes();
+	if (!throttle.last)
 	{
-		DPRINTF(E_WARN, L_SCANNER, "Error scanning %s [%s]\n",
-			dir, strerror(errno));
-		return;
+		/* Start with a second's worth */
+		throttle.last = now;
+		throttle.tokens = rate;
+		throttle.read = bytes;
 	}
+	throttle.tokens += (now - throttle.last) * rate / 1000;
+	if (throttle.tokens > rate)
+		throttle.tokens = rate;
+	throttle.tokens -= bytes - throttle.read;
+	throttle.last = now;
+	throttle.read = bytes;
 
-	full_path = malloc(PATH_MAX);
-	if (!full_path)
+	if (streams <= 0)
 	{
-		DPRINTF(E_ERROR, L_SCANNER, "Memory allocation failed scanning %s\n", dir);
-		return;
+		throttle.sample = 0;
+		throttle.average = 0;
 	}
-
-	if( !parent )
+	else if (!throttle.sample)
 	{
-		startID = get_next_available_id("OBJECTS", BROWSEDIR_ID);
+		throttle.sample = now;
+		throttle.sent = stream_stats->sent;
 	}
-
-	for (i=0; i < n; i++)
+	else if (now - throttle.sample >= 1000)
 	{
-#if !USE_FORK
-		if( quitting )
-			break;
-#endif
-		type = TYPE_UNKNOWN;
-		snprintf(full_path, PATH_MAX, "%s/%s", dir, namelist[i]->d_name);
-		name = escape_tag(namelist[i]->d_name, 1);
-		if( is_dir(namelist[i]) == 1 )
-		{
-			type = TYPE_DIR;
-		}
-		else if( is_reg(namelist[i]) == 1 )
+		unsigned long sent = stream_stats->sent;
+		long long speed = (long long)(sent - throttle.sent) * 1000 / (now - throttle.sample);
+
+		if (throttle.average && speed < throttle.average / 2)
 		{
-			type = TYPE_FILE;
+			DPRINTF(E_DEBUG, L_SCANNER, "Streaming slowed down to %lld KiB/s, pausing the scan\n",
+			        speed / 1024);
+			throttle.resume = now + SCAN_STARVED_PAUSE;
+			/* Once is enough if the streams just need less now */
+			throttle.average = speed;
 		}
 		else
-		{
-			type = resolve_unknown_type(full_path, dir_types);
-		}
-		if( (type == TYPE_DIR) && (access(full_path, R_OK|X_OK) == 0) )
-		{
-			char *parent_id;
-			insert_directory(name, full_path, BROWSEDIR_ID, THISORNUL(parent), i+startID);
-			xasprintf(&parent_id, "%s$%X", THISORNUL(parent), i+startID);
-			ScanDirectory(full_path, parent_id, dir_types);
-			free(parent_id);
-		}
-		else if( type == TYPE_FILE && (access(full_path, R_OK) == 0) )
-		{
-			if( insert_file(name, full_path, THISORNUL(parent), i+startID, dir_types) == 0 )
-				fileno++;
-		}
-		free(name);
-		free(namelist[i]);
+			throttle.average = throttle.average ? (throttle.average * 3 + speed) / 4 : speed;
+		throttle.sample = now;
+		throttle.sent = sent;
 	}
-	free(namelist);
-	free(full_path);
-	if( !parent )
+
+	if (throttle.resume > now)
+		wait = throttle.resume - now;
+	if (throttle.tokens < 0)
+		wait = MAX(wait, -throttle.tokens * 1000 / rate);
+	/* Everyone else waits too */
+	if (wait > 0)
+	{
+		struct timespec ts = { wait / 1000, (wait % 1000) * 1000000 };
+		nanosleep(&ts, NULL);
+	}
+	pthread_mutex_unlock(&throttle.lock);
+}
+
+static void *
+scan_worker(void *arg)
+{
+	struct scan_job *job;
+	sigset_t set;
+
+	sigfillset(&set);
+	pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+	pthread_mutex_lock(&scan_queue.lock);
+	for (;;)
+	{
+		while (scan_queue.next == scan_queue.tail && !scan_queue.done)
+			pthread_cond_wait(&scan_queue.queued, &scan_queue.lock);
+		if (scan_queue.next == scan_queue.tail)
+			break;
+		job = &scan_queue.jobs[scan_queue.next++ % SCAN_QUEUE_SIZE];
+		if (job->state == JOB_PARSED)
+			continue;
+		job->state = JOB_PARSING;
+		pthread_mutex_unlock(&scan_queue.lock);
+		scan_throttle();
+		parse_file(job);
+		pthread_mutex_lock(&scan_queue.lock);
+		job->state = JOB_PARSED;
+		pthread_cond_broadcast(&scan_queue.parsed);
+	}
+	pthread_mutex_unlock(&scan_queue.lock);
+
+	return NULL;
+}
+
+/* Write out the oldest job */
+static void
+scan_queue_pop(void)
+{
+	struct scan_job *job = &scan_queue.jobs[scan_queue.head % SCAN_QUEUE_SIZE];
+
+	pthread_mutex_lock(&scan_queue.lock);
+	if (scan_queue.next == scan_queue.head)
+	{
+		/* Nobody has picked it up yet */
+		scan_queue.next++;
+		pthread_mutex_unlock(&scan_queue.lock);
+		if (job->state != JOB_PARSED)
+		{
+			scan_throttle();
+			parse_file(job);
+		}
+	}
+	else
+	{
+		while (job->state != JOB_PARSED)
+			pthread_cond_wait(&scan_queue.parsed, &scan_queue.lock);
+		pthread_mutex_unlock(&scan_queue.lock);
+	}
+
+	if (job->is_dir)
+	{
+		int64_t detailID = insert_directory(job->name, job->path, BROWSEDIR_ID, job->parentID, job->object);
+		sql_exec(db, "UPDATE DETAILS set DIR_CHANGED = %lld where ID = %lld",
+		         (long long)job->changed, (long long)detailID);
+	}
+	else if (store_file(job) == 0)
+		scan_files++;
+	sql_batch_step(db);
+	free(job->name);
+	free(job->path);
+	free(job->parentID);
+	scan_queue.head++;
+}
+
+static void
+scan_queue_push(int is_dir, const char *name, const char *path, const char *parentID,
+                int object, media_types types, time_t changed, int64_t pending)
+{
+	struct scan_job *job;
+
+	if (scan_queue.tail - scan_queue.head == SCAN_QUEUE_SIZE)
+		scan_queue_pop();
+	job = &scan_queue.jobs[scan_queue.tail % SCAN_QUEUE_SIZE];
+	memset(job, 0, sizeof(*job));
+	job->is_dir = is_dir;
+	job->name = strdup(name);
+	job->path = strdup(path);
+	job->parentID = strdup(parentID);
+	job->object = object;
+	job->types = types;
+	job->changed = changed;
+	job->pending = pending;
+	if (is_dir)
+		job->state = JOB_PARSED;
+	else if (stat(path, &job->st) != 0)
+		memset(&job->st, 0, sizeof(job->st));
+	else if (!pending && use_metacache && !(is_image(name) && is_album_art(name)))
+		job->cached = metacache_find(path, &job->st, types, job->class, sizeof(job->class));
+	if (job->cached)
+	{
+		job->status = PARSE_CACHED;
+		if (strncmp(job->class, "item.audioItem", 14) == 0)
+			strcpy(job->base, MUSIC_DIR_ID);
+		else if (strncmp(job->class, "item.videoItem", 14) == 0)
+			strcpy(job->base, VIDEO_DIR_ID);
+		else
+			strcpy(job->base, IMAGE_DIR_ID);
+		job->state = JOB_PARSED;
+	}
+	else if (!is_dir && !pending && defer_parsing && job->st.st_ino && stub_file(job))
+		job->state = JOB_PARSED;
+
+	pthread_mutex_lock(&scan_queue.lock);
+	scan_queue.tail++;
+	pthread_cond_signal(&scan_queue.queued);
+	pthread_mutex_unlock(&scan_queue.lock);
+}
+
+/* Write out everything queued so far */
+static void
+scan_queue_flush(void)
+{
+	while (scan_queue.head != scan_queue.tail)
+		scan_queue_pop();
+}
+
+#if LIBAVCODEC_VERSION_MAJOR < 58
+/* Older libavcodec needs this before codecs are opened on several threads */
+static int
+lav_lock(void **mutex, enum AVLockOp op)
+{
+	switch (op)
+	{
+	case AV_LOCK_CREATE:
+		*mutex = malloc(sizeof(pthread_mutex_t));
+		if (!*mutex)
+			return 1;
+		return pthread_mutex_init(*mutex, NULL) != 0;
+	case AV_LOCK_OBTAIN:
+		return pthread_mutex_lock(*mutex) != 0;
+	case AV_LOCK_RELEASE:
+		return pthread_mutex_unlock(*mutex) != 0;
+	case AV_LOCK_DESTROY:
+		pthread_mutex_destroy(*mutex);
+		free(*mutex);
+		return 0;
+	}
+	return 1;
+}
+#endif
+
+static void
+scan_workers_start(void)
+{
+	int i, n = runtime_vars.scan_threads;
+
+	if (n <= 0)
+		n = sysconf(_SC_NPROCESSORS_ONLN);
+	/* This thread parses too, while it waits for the oldest job */
+	n--;
+	if (n <= 0)
+		return;
+#if LIBAVCODEC_VERSION_MAJOR < 58
+	av_lockmgr_register(lav_lock);
+#endif
+	scan_queue.workers = calloc(n, sizeof(pthread_t));
+	if (!scan_queue.workers)
+		return;
+	scan_queue.done = 0;
+	for (i = 0; i < n; i++)
+	{
+		if (pthread_create(&scan_queue.workers[i], NULL, scan_worker, NULL) != 0)
+		{
+			DPRINTF(E_WARN, L_SCANNER, "Failed to start scanner thread: %s\n", strerror(errno));
+			break;
+		}
+	}
+	scan_queue.nworkers = i;
+	DPRINTF(E_INFO, L_SCANNER, "Parsing metadata with %d extra threads\n", i);
+}
+
+static void
+scan_workers_stop(void)
+{
+	int i;
+
+	scan_queue_flush();
+	pthread_mutex_lock(&scan_queue.lock);
+	scan_queue.done = 1;
+	pthread_cond_broadcast(&scan_queue.queued);
+	pthread_mutex_unlock(&scan_queue.lock);
+	for (i = 0; i < scan_queue.nworkers; i++)
+		pthread_join(scan_queue.workers[i], NULL);
+	free(scan_queue.workers);
+	scan_queue.workers = NULL;
+	scan_queue.nworkers = 0;
+}
+
+/* Browse requests tell the scanner process which containers clients are
+ * looking at through this pipe, in records of a fixed size so that they
+ * can't be torn, and the second pass parses the files in those first. */
+#define SCAN_HINT_SIZE 128
+
+static int scan_hints[2] = { -1, -1 };
+
+int
+scan_hints_open(void)
+{
+	if (pipe2(scan_hints, O_CLOEXEC | O_NONBLOCK) != 0)
+	{
+		scan_hints[0] = scan_hints[1] = -1;
+		return -1;
+	}
+	return 0;
+}
+
+void
+scan_hints_close(int end)
+{
+	if (scan_hints[end] < 0)
+		return;
+	close(scan_hints[end]);
+	scan_hints[end] = -1;
+}
+
+void
+scan_hint(const char *id)
+{
+	char buf[SCAN_HINT_SIZE];
+	size_t len = strlen(id);
+
+	if (scan_hints[1] < 0 || len >= sizeof(buf))
+		return;
+	memset(buf, 0, sizeof(buf));
+	memcpy(buf, id, len);
+	/* If the pipe is full, the scanner has plenty to do already */
+	if (write(scan_hints[1], buf, sizeof(buf)) != sizeof(buf))
+		return;
+}
+
+/* Queue a stub to be parsed, from a row of ID, TYPES, PATH, OBJECT_ID */
+static void
+push_pending(char **row)
+{
+	char *parentID, *p, *name;
+
+	parentID = strdup(row[3] + strlen(BROWSEDIR_ID));
+	p = strrchr(parentID, '$');
+	if (!p)
+	{
+		free(parentID);
+		return;
+	}
+	*p++ = '\0';
+	name = escape_tag(basename(row[2]), 1);
+	scan_queue_push(0, name, row[2], parentID, strtol(p, NULL, 16),
+	                atoi(row[1]), 0, strtoll(row[0], NULL, 10));
+	free(name);
+	free(parentID);
+}
+
+/* Parse the stubs in the containers that were browsed since the last call.
+ * They are all written out before returning, so that the second pass
+ * can't come across them again.  Returns the number of hints. */
+static int
+parse_hinted(void)
+{
+	char buf[SCAN_HINT_SIZE];
+	char **result;
+	char *sql;
+	int i, rows, hints = 0, found = 0;
+
+	if (scan_hints[0] < 0)
+		return 0;
+	while (read(scan_hints[0], buf, sizeof(buf)) == sizeof(buf))
+	{
+		buf[sizeof(buf)-1] = '\0';
+		/* Whatever is queued already is still in PENDING */
+		if (!hints++)
+			scan_queue_flush();
+		/* The Folders under Music, Video and Pictures refer to Browse folders */
+		sql = sqlite3_mprintf("SELECT p.ID, p.TYPES, d.PATH, o.OBJECT_ID from OBJECTS o"
+		                      " join PENDING p on (p.ID = o.DETAIL_ID) join DETAILS d on (d.ID = p.ID)"
+		                      " where o.PARENT = (SELECT ID from OBJECTS where OBJECT_ID ="
+		                      " coalesce((SELECT REF_ID from OBJECTS where OBJECT_ID = '%q'), '%q'))"
+		                      " ORDER BY p.TIMESTAMP desc", buf, buf);
+		rows = 0;
+		if (sql_get_table(db, sql, &result, &rows, NULL) == SQLITE_OK)
+		{
+			for (i = 1; i <= rows; i++)
+				push_pending(result + i*4);
+			sqlite3_free_table(result);
+		}
+		sqlite3_free(sql);
+		if (rows)
+			DPRINTF(E_DEBUG, L_SCANNER, "Reading metadata from %d files in %s first\n", rows, buf);
+		found += rows;
+	}
+	if (hints)
+		scan_queue_flush();
+
+	return hints;
+}
+
+/* The second pass over the files that the walk only stored stubs for.
+ * The newest are parsed first, since those are what people are most
+ * likely to be looking for, unless a client is browsing a folder that
+ * still has stubs in it. */
+#define PENDING_BATCH 256
+
+static void
+parse_pending(void)
+{
+	char **result;
+	char *sql;
+	long long ts = INT64_MAX, id = INT64_MAX;
+	int i, ret, rows, total;
+
+	/* Left over from an earlier scan, and since removed */
+	sql_exec(db, "DELETE from PENDING where ID not in (SELECT ID from DETAILS)");
+	total = sql_get_int_field(db, "SELECT count(*) from PENDING");
+	if (total <= 0)
+		return;
+	DPRINTF(E_WARN, L_SCANNER, _("Reading metadata from %d files\n"), total);
+	do {
+		sql = sqlite3_mprintf("SELECT p.ID, p.TYPES, d.PATH, o.OBJECT_ID, p.TIMESTAMP from PENDING p"
+		                      " join DETAILS d on (d.ID = p.ID) join OBJECTS o on (o.DETAIL_ID = p.ID)"
+		                      " where (p.TIMESTAMP, p.ID) < (%lld, %lld)"
+		                      " ORDER BY p.TIMESTAMP desc, p.ID desc limit %d",
+		                      ts, id, PENDING_BATCH);
+		rows = 0;
+		ret = sql_get_table(db, sql, &result, &rows, NULL);
+		sqlite3_free(sql);
+		if (ret != SQLITE_OK)
+			break;
+		for (i = 1; i <= rows && !quitting; i++)
+		{
+			/* Pick up where we were with a fresh batch afterwards */
+			if (parse_hinted())
+				break;
+			push_pending(result + i*5);
+			id = strtoll(result[i*5], NULL, 10);
+			ts = strtoll(result[i*5+4], NULL, 10);
+		}
+		sqlite3_free_table(result);
+	} while (rows && !quitting);
+	scan_queue_flush();
+	/* Anything still there had lost its object */
+	if (!quitting)
+		sql_exec(db, "DELETE from PENDING");
+	DPRINTF(E_WARN, L_SCANNER, _("Reading metadata finished\n"));
+}
+
+/* The ctime to remember for a directory.  Something changed in the same
+ * second that we looked at it could have been missed, so a stamp that
+ * recent isn't kept. */
+static time_t
+dir_changed(const struct stat *st)
+{
+	return (st->st_ctime >= time(NULL)) ? 0 : st->st_ctime;
+}
+
+/* The entries of a directory that can hold the wanted media types, in
+ * sorted order.  The names are packed into large blocks rather than
+ * allocated one at a time as scandir() does, which adds up in directories
+ * with tens of thousands of files, and the directory stays open so that
+ * the entries can be checked relative to it instead of by full path. */
+#define NAME_BLOCK_SIZE 32768
+
+struct name_block {
+	struct name_block *next;
+	size_t used;
+	char data[NAME_BLOCK_SIZE];
+};
+
+struct dir_entry {
+	const char *name;
+	enum file_types type;
+};
+
+struct dir_list {
+	int fd;
+	int count;
+	struct dir_entry *entries;
+	struct name_block *blocks;
+};
+
+static int
+cmp_entry_coll(const void *a, const void *b)
+{
+	return strcoll(((const struct dir_entry *)a)->name, ((const struct dir_entry *)b)->name);
+}
+
+static int
+cmp_entry_name(const void *a, const void *b)
+{
+	return strcmp(((const struct dir_entry *)a)->name, ((const struct dir_entry *)b)->name);
+}
+
+static void
+free_directory(struct dir_list *list)
+{
+	struct name_block *block;
+
+	while( (block = list->blocks) )
+	{
+		list->blocks = block->next;
+		free(block);
+	}
+	free(list->entries);
+	list->entries = NULL;
+	list->count = 0;
+	if( list->fd >= 0 )
+		close(list->fd);
+	list->fd = -1;
+}
+
+static const char *
+add_name(struct dir_list *list, const char *name)
+{
+	struct name_block *block = list->blocks;
+	size_t len = strlen(name) + 1;
+
+	if( !block || block->used + len > NAME_BLOCK_SIZE )
+	{
+		block = malloc(sizeof(*block));
+		if( !block )
+			return NULL;
+		block->next = list->blocks;
+		block->used = 0;
+		list->blocks = block;
+	}
+	memcpy(block->data + block->used, name, len);
+	block->used += len;
+
+	return block->data + block->used - len;
+}
+
+/* List the entries of dir that can hold the given media types */
+static int
+list_directory(const char *dir, struct dir_list *list, media_types dir_types,
+               int (*compar)(const void *, const void *))
+{
+	int (*filter)(scan_filter *);
+	struct dirent *e;
+	DIR *d;
+	int fd, alloc = 0;
+
+	memset(list, 0, sizeof(*list));
+	list->fd = -1;
+	switch( dir_types )
+	{
+		case ALL_MEDIA:
+			filter = filter_avp;
+			break;
+		case TYPE_AUDIO:
+			filter = filter_a;
+			break;
+		case TYPE_AUDIO|TYPE_VIDEO:
+			filter = filter_av;
+			break;
+		case TYPE_AUDIO|TYPE_IMAGES:
+			filter = filter_ap;
+			break;
+		case TYPE_VIDEO:
+			filter = filter_v;
+			break;
+		case TYPE_VIDEO|TYPE_IMAGES:
+			filter = filter_vp;
+			break;
+		case TYPE_IMAGES:
+			filter = filter_p;
+			break;
+		default:
+			errno = EINVAL;
+			return -1;
+	}
+
+	list->fd = open(dir, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+	if( list->fd < 0 )
+		return -1;
+	/* closedir() takes the descriptor it was opened with along with it */
+	fd = dup(list->fd);
+	d = (fd < 0) ? NULL : fdopendir(fd);
+	if( !d )
+	{
+		if( fd >= 0 )
+			close(fd);
+		free_directory(list);
+		return -1;
+	}
+	while( (e = readdir(d)) )
+	{
+		struct dir_entry *entry;
+
+		if( !filter(e) )
+			continue;
+		if( list->count == alloc )
+		{
+			alloc = alloc ? alloc * 2 : 64;
+			entry = realloc(list->entries, alloc * sizeof(*entry));
+			if( !entry )
+				break;
+			list->entries = entry;
+		}
+		entry = &list->entries[list->count];
+		entry->name = add_name(list, e->d_name);
+		if( !entry->name )
+			break;
+		if( is_dir(e) == 1 )
+			entry->type = TYPE_DIR;
+		else if( is_reg(e) == 1 )
+			entry->type = TYPE_FILE;
+		else
+			entry->type = TYPE_UNKNOWN;
+		list->count++;
+	}
+	closedir(d);
+	if( e )
+	{
+		free_directory(list);
+		errno = ENOMEM;
+		return -1;
+	}
+	if( list->count > 1 )
+		qsort(list->entries, list->count, sizeof(*list->entries), compar);
+
+	return list->count;
+}
+
+static void
+ScanDirectory(const char *dir, const char *parent, media_types dir_types)
+{
+	struct dir_list list;
+	struct stat st;
+	int i, n, len, startID = 0;
+	char *full_path;
+	char *name = NULL;
+	enum file_types type;
+
+	DPRINTF(parent?E_INFO:E_WARN, L_SCANNER, _("Scanning %s\n"), dir);
+	n = list_directory(dir, &list, dir_types, cmp_entry_coll);
+	if( n < 0 )
+	{
+		DPRINTF(E_WARN, L_SCANNER, "Error scanning %s [%s]\n",
+			dir, strerror(errno));
+		return;
+	}
+
+	full_path = malloc(PATH_MAX);
+	if (!full_path)
 	{
-		DPRINTF(E_WARN, L_SCANNER, _("Scanning %s finished (%llu files)!\n"), dir, fileno);
+		DPRINTF(E_ERROR, L_SCANNER, "Memory allocation failed scanning %s\n", dir);
+		free_directory(&list);
+		return;
+	}
+
+	/* A directory with a parent was only just found, so it has no children yet */
+	snprintf(full_path, PATH_MAX, "%s%s", BROWSEDIR_ID, THISORNUL(parent));
+	startID = next_available_ids(full_path, n, parent != NULL);
+	len = snprintf(full_path, PATH_MAX, "%s/", dir);
+
+	for (i=0; i < n; i++)
+	{
+		const char *entry = list.entries[i].name;
+#if !USE_FORK
+		if( quitting )
+			break;
+#endif
+		if( len + strlen(entry) >= PATH_MAX )
+			continue;
+		strcpy(full_path + len, entry);
+		type = list.entries[i].type;
+		if( type == TYPE_UNKNOWN )
+			type = resolve_unknown_type(full_path, dir_types);
+		if( (type == TYPE_DIR) && (faccessat(list.fd, entry, R_OK|X_OK, 0) == 0) )
+		{
+			char *parent_id;
+			time_t changed = (fstatat(list.fd, entry, &st, 0) == 0) ? dir_changed(&st) : 0;
+			name = escape_tag(entry, 1);
+			scan_queue_push(1, name, full_path, THISORNUL(parent), i+startID, dir_types, changed, 0);
+			free(name);
+			xasprintf(&parent_id, "%s$%X", THISORNUL(parent), i+startID);
+			ScanDirectory(full_path, parent_id, dir_types);
+			free(parent_id);
+		}
+		else if( type == TYPE_FILE && (faccessat(list.fd, entry, R_OK, 0) == 0) )
+		{
+			name = escape_tag(entry, 1);
+			scan_queue_push(0, name, full_path, THISORNUL(parent), i+startID, dir_types, 0, 0);
+			free(name);
+		}
+	}
+	free_directory(&list);
+	free(full_path);
+	if( !parent )
+	{
+		scan_queue_flush();
+		DPRINTF(E_WARN, L_SCANNER, _("Scanning %s finished (%llu files)!\n"), dir, scan_files);
 	}
 }
 
@@ -837,47 +1959,391 @@ _notify_stop(void)
 #endif
 }
 
+static void
+scan_media_dir(struct media_dir_s *media_path)
+{
+	int64_t id;
+	char path[MAXPATHLEN];
+	char *bname, *parent = NULL;
+	char buf[8];
+	struct stat st;
+	time_t changed;
+
+	strncpyt(path, media_path->path, sizeof(path));
+	bname = basename(path);
+	changed = (stat(media_path->path, &st) == 0) ? dir_changed(&st) : 0;
+	/* If there are multiple media locations, add a level to the ContentDirectory */
+	if( !GETFLAG(MERGE_MEDIA_DIRS_MASK) && media_dirs->next )
+	{
+		int startID = get_next_available_id(BROWSEDIR_ID);
+		id = insert_directory(bname, path, BROWSEDIR_ID, "", startID);
+		sprintf(buf, "$%X", startID);
+		parent = buf;
+	}
+	else
+		id = GetFolderMetadata(bname, media_path->path, NULL, NULL, 0);
+	/* Use TIMESTAMP to store the media type */
+	sql_exec(db, "UPDATE DETAILS set TIMESTAMP = %d, DIR_CHANGED = %lld where ID = %lld",
+	         media_path->types, (long long)changed, (long long)id);
+	ScanDirectory(media_path->path, parent, media_path->types);
+	scan_queue_flush();
+	sql_exec(db, "INSERT into SETTINGS values (%Q, %Q)", "media_dir", media_path->path);
+}
+
+/* Drop a file, or a directory and everything that was found under it,
+ * without touching anything else. */
+static void
+remove_path(const char *path)
+{
+	char *range;
+
+	/* Don't insert files into containers we may be about to remove */
+	valid_cache = 0;
+	range = sqlite3_mprintf("(PATH = %Q or (PATH >= '%q/' and PATH < '%q0'))", path, path, path);
+	sql_exec(db, "DELETE from DETAILS where ID in (SELECT DETAIL_ID from OBJECTS where OBJECT_ID in"
+	             " (SELECT '%s$' || printf('%%X', ID) from PLAYLISTS where %s))", MUSIC_PLIST_ID, range);
+	sql_exec(db, "DELETE from OBJECTS where PARENT in (SELECT ID from OBJECTS where OBJECT_ID in"
+	             " (SELECT '%s$' || printf('%%X', ID) from PLAYLISTS where %s))", MUSIC_PLIST_ID, range);
+	sql_exec(db, "DELETE from OBJECTS where OBJECT_ID in"
+	             " (SELECT '%s$' || printf('%%X', ID) from PLAYLISTS where %s)", MUSIC_PLIST_ID, range);
+	sql_exec(db, "DELETE from PLAYLISTS where %s", range);
+	/* Virtual containers share DETAILS with one of their items, so leave
+	 * those to be pruned once they are empty.  They still need the artist
+	 * and album to be found by the scanner, so only the path goes. */
+	sql_exec(db, "DELETE from OBJECTS where DETAIL_ID in (SELECT ID from DETAILS where %s)"
+	             " and (OBJECT_ID glob '%s$*' or CLASS not glob 'container*')", range, BROWSEDIR_ID);
+	sql_exec(db, "UPDATE DETAILS set PATH = NULL where %s"
+	             " and exists (SELECT 1 from OBJECTS where DETAIL_ID = DETAILS.ID)", range);
+	sql_exec(db, "DELETE from DETAILS where %s", range);
+	sql_exec(db, "DELETE from CAPTIONS where %s", range);
+	sqlite3_free(range);
+}
+
+/* Clean up after remove_path() */
+static void
+prune_removed(void)
+{
+	/* Remove the artist, album, genre and date containers that only held
+	 * removed items, from the bottom up. */
+	do {
+		sql_exec(db, "DELETE from OBJECTS where CLASS glob 'container*'"
+		             " and PARENT_ID glob '*$*' and OBJECT_ID not glob '%s*' and PARENT_ID != '%s'"
+		             " and not exists (SELECT 1 from OBJECTS c where c.PARENT = OBJECTS.ID)",
+		             BROWSEDIR_ID"$", MUSIC_PLIST_ID);
+	} while( sqlite3_changes(db) > 0 );
+	sql_exec(db, "DELETE from DETAILS where PATH is NULL"
+	             " and not exists (SELECT 1 from OBJECTS where DETAIL_ID = DETAILS.ID)");
+	sql_exec(db, "DELETE from ALBUM_ART where ID not in"
+	             " (SELECT ALBUM_ART from DETAILS where ALBUM_ART is not NULL)");
+	/* Playlists elsewhere may have lost some of their entries */
+	sql_exec(db, "UPDATE PLAYLISTS set FOUND = (SELECT count(*) from OBJECTS where PARENT ="
+	             " (SELECT ID from OBJECTS where OBJECT_ID = '%s$' || printf('%%X', PLAYLISTS.ID)))",
+	             MUSIC_PLIST_ID);
+}
+
+/* Bring one directory that changed while we weren't watching back in
+ * line with the database.  Both listings are sorted by name, so that
+ * the entries that were added, removed or modified fall out of a single
+ * pass over them.  Returns the number of entries removed. */
+static int
+reconcile_directory(const char *dir, const char *objectID, time_t last, media_types types)
+{
+	struct dir_list list;
+	char **result;
+	char *full_path, *name, *sql;
+	const char *parentID = objectID + strlen(BROWSEDIR_ID);
+	int64_t parent;
+	int i, n, ret, row = 1, rows = 0, cols = 4, startID, removed = 0;
+	int len = strlen(dir) + 2;
+	int path_len;
+	enum file_types type;
+	struct stat st;
+	time_t changed;
+
+	if( stat(dir, &st) != 0 )
+	{
+		if( errno != ENOENT )
+			return 0;
+		DPRINTF(E_DEBUG, L_SCANNER, "Removing %s\n", dir);
+		remove_path(dir);
+		return 1;
+	}
+	if( st.st_ctime == last )
+		return 0;
+	changed = dir_changed(&st);
+	n = list_directory(dir, &list, types, cmp_entry_name);
+	if( n < 0 )
+	{
+		DPRINTF(E_WARN, L_SCANNER, "Error scanning %s [%s]\n", dir, strerror(errno));
+		return 0;
+	}
+	DPRINTF(E_INFO, L_SCANNER, _("Rescanning %s\n"), dir);
+	parent = sql_get_int_field(db, "SELECT ID from OBJECTS where OBJECT_ID = '%q'", objectID);
+	/* len counts bytes, while substr() counts characters in TEXT */
+	sql = sqlite3_mprintf("SELECT CAST(substr(CAST(d.PATH AS BLOB), %d) AS TEXT), d.TIMESTAMP, d.SIZE, o.CLASS"
+	                      " from OBJECTS o join DETAILS d on (d.ID = o.DETAIL_ID)"
+	                      " where o.PARENT = %lld and d.PATH >= '%q/' and d.PATH < '%q0' "
+	                      "UNION ALL SELECT CAST(substr(CAST(PATH AS BLOB), %d) AS TEXT), NULL, NULL, 'playlist' from PLAYLISTS"
+	                      " where PATH >= '%q/' and PATH < '%q0' and instr(substr(CAST(PATH AS BLOB), %d), '/') = 0 "
+	                      "ORDER BY 1",
+	                      len, (long long)parent, dir, dir, len, dir, dir, len);
+	ret = sql_get_table(db, sql, &result, &rows, NULL);
+	sqlite3_free(sql);
+	if( ret != SQLITE_OK )
+	{
+		free_directory(&list);
+		return 0;
+	}
+	full_path = malloc(PATH_MAX);
+	if( !full_path )
+	{
+		free_directory(&list);
+		sqlite3_free_table(result);
+		return 0;
+	}
+	path_len = snprintf(full_path, PATH_MAX, "%s/", dir);
+
+	for( i = 0; i < n || row <= rows; )
+	{
+		const char *db_name = (row <= rows) ? result[row*cols] : NULL;
+		const char *entry = (i < n) ? list.entries[i].name : NULL;
+		int cmp;
+
+		if( i >= n )
+			cmp = 1;
+		else if( !db_name )
+			cmp = -1;
+		else
+			cmp = strcmp(entry, db_name);
+		if( cmp > 0 )
+		{
+			/* Gone from the disk */
+			snprintf(full_path, PATH_MAX, "%s/%s", dir, db_name);
+			DPRINTF(E_DEBUG, L_SCANNER, "Removing %s\n", full_path);
+			remove_path(full_path);
+			removed++;
+			row++;
+			continue;
+		}
+		snprintf(full_path + path_len, PATH_MAX - path_len, "%s", entry);
+		type = list.entries[i].type;
+		if( type == TYPE_UNKNOWN )
+			type = resolve_unknown_type(full_path, types);
+		if( cmp == 0 )
+		{
+			const char *ts = result[row*cols+1];
+			const char *size = result[row*cols+2];
+			const char *class = result[row*cols+3];
+			int unchanged;
+
+			row++;
+			/* Directories are checked on their own */
+			if( type == TYPE_DIR )
+				unchanged = (strncmp(class, "container", 9) == 0);
+			else if( type != TYPE_FILE || fstatat(list.fd, entry, &st, 0) != 0 )
+				unchanged = 1;
+			/* Playlists don't keep a timestamp */
+			else if( strcmp(class, "playlist") == 0 )
+				unchanged = (st.st_mtime < last);
+			else
+				unchanged = (ts && size &&
+				             st.st_mtime == strtoll(ts, NULL, 10) &&
+				             st.st_size == strtoll(size, NULL, 10));
+			if( unchanged )
+			{
+				i++;
+				continue;
+			}
+			DPRINTF(E_DEBUG, L_SCANNER, "%s was modified\n", full_path);
+			remove_path(full_path);
+			removed++;
+		}
+		/* New or modified */
+		name = escape_tag(entry, 1);
+		if( (type == TYPE_DIR) && (faccessat(list.fd, entry, R_OK|X_OK, 0) == 0) )
+		{
+			char *parent_id;
+			time_t dir_stamp = (fstatat(list.fd, entry, &st, 0) == 0) ? dir_changed(&st) : 0;
+			startID = get_next_available_id(objectID);
+			scan_queue_push(1, name, full_path, parentID, startID, types, dir_stamp, 0);
+			xasprintf(&parent_id, "%s$%X", parentID, startID);
+			ScanDirectory(full_path, parent_id, types);
+			free(parent_id);
+		}
+		else if( type == TYPE_FILE && (faccessat(list.fd, entry, R_OK, 0) == 0) )
+		{
+			if( is_image(full_path) )
+				update_if_album_art(full_path);
+			scan_queue_push(0, name, full_path, parentID, get_next_available_id(objectID), types, 0, 0);
+		}
+		free(name);
+		i++;
+	}
+	free_directory(&list);
+	free(full_path);
+	sqlite3_free_table(result);
+	sql_exec(db, "UPDATE DETAILS set DIR_CHANGED = %lld where PATH = %Q", (long long)changed, dir);
+
+	return removed;
+}
+
+/* Look for changes made to a media_dir while we weren't running.  Adding,
+ * removing or renaming something changes the ctime of the directory it is
+ * in, so only the directories whose ctime moved need to be listed. */
+static int
+reconcile_media_dir(struct media_dir_s *media_path)
+{
+	char **result;
+	char *objectID, *sql;
+	int i, ret, rows = 0, removed = 0;
+
+	/* Leave it alone if it's just not mounted right now */
+	if( access(media_path->path, R_OK|X_OK) != 0 )
+	{
+		DPRINTF(E_WARN, L_SCANNER, "Could not access %s [%s]\n", media_path->path, strerror(errno));
+		return 0;
+	}
+	DPRINTF(E_WARN, L_SCANNER, _("Checking %s for changes\n"), media_path->path);
+	objectID = sql_get_text_field(db, "SELECT o.OBJECT_ID from OBJECTS o join DETAILS d on (d.ID = o.DETAIL_ID)"
+	                                  " where d.PATH = %Q and o.REF_ID is NULL", media_path->path);
+	removed += reconcile_directory(media_path->path, objectID ? objectID : BROWSEDIR_ID,
+	                               sql_get_int_field(db, "SELECT DIR_CHANGED from DETAILS where PATH = %Q",
+	                                                 media_path->path),
+	                               media_path->types);
+	sqlite3_free(objectID);
+	sql = sqlite3_mprintf("SELECT o.OBJECT_ID, d.PATH, d.DIR_CHANGED"
+	                      " from DETAILS d join OBJECTS o on (o.DETAIL_ID = d.ID)"
+	                      " where d.PATH >= '%q/' and d.PATH < '%q0'"
+	                      " and o.REF_ID is NULL and o.CLASS = 'container.storageFolder'"
+	                      " ORDER BY d.PATH", media_path->path, media_path->path);
+	ret = sql_get_table(db, sql, &result, &rows, NULL);
+	sqlite3_free(sql);
+	if( ret != SQLITE_OK )
+		return removed;
+	for( i = 1; i <= rows; i++ )
+	{
+		removed += reconcile_directory(result[i*3+1], result[i*3],
+		                               result[i*3+2] ? strtoll(result[i*3+2], NULL, 10) : 0,
+		                               media_path->types);
+	}
+	sqlite3_free_table(result);
+	scan_queue_flush();
+
+	return removed;
+}
+
+/* Bring an existing database in line with the configured media_dirs and
+ * with whatever changed in them since it was last written: forget the
+ * media_dirs that were removed, scan the ones that are new or whose media
+ * types changed, and reconcile the rest. */
+static void
+update_media_dirs(void)
+{
+	struct media_dir_s *media_path;
+	char **result;
+	int i, rows = 0, types, removed = 0;
+
+	if( sql_get_table(db, "SELECT VALUE from SETTINGS where KEY = 'media_dir'", &result, &rows, NULL) == SQLITE_OK )
+	{
+		for( i = 1; i <= rows; i++ )
+		{
+			for( media_path = media_dirs; media_path; media_path = media_path->next )
+				if( strcmp(result[i], media_path->path) == 0 )
+					break;
+			if( media_path )
+				continue;
+			DPRINTF(E_WARN, L_SCANNER, _("Removing %s from the database\n"), result[i]);
+			remove_path(result[i]);
+			sql_exec(db, "DELETE from SETTINGS where KEY = 'media_dir' and VALUE = %Q", result[i]);
+			removed++;
+		}
+		sqlite3_free_table(result);
+	}
+	for( media_path = media_dirs; media_path; media_path = media_path->next )
+	{
+		types = sql_get_int_field(db, "SELECT TIMESTAMP from DETAILS where PATH = %Q", media_path->path);
+		if( types == media_path->types )
+		{
+			removed += reconcile_media_dir(media_path);
+			continue;
+		}
+		if( types > 0 )
+		{
+			remove_path(media_path->path);
+			sql_exec(db, "DELETE from SETTINGS where KEY = 'media_dir' and VALUE = %Q", media_path->path);
+			removed++;
+		}
+		scan_media_dir(media_path);
+	}
+	if( removed )
+		prune_removed();
+}
+
 void
 start_scanner()
 {
 	struct media_dir_s *media_path;
-	char path[MAXPATHLEN];
+#ifdef SYS_ioprio_set
+	int ioprio = syscall(SYS_ioprio_get, IOPRIO_WHO_PROCESS, 0);
+#endif
 
 	if (setpriority(PRIO_PROCESS, 0, 15) == -1)
 		DPRINTF(E_WARN, L_INOTIFY,  "Failed to reduce scanner thread priority\n");
+#ifdef SYS_ioprio_set
+	/* The worker threads inherit this */
+	if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, IOPRIO_PRIO_VALUE(IOPRIO_CLASS_IDLE, 0)) == -1)
+		DPRINTF(E_WARN, L_SCANNER, "Failed to reduce scanner I/O priority\n");
+#endif
 	_notify_start();
 
 	setlocale(LC_COLLATE, "");
 
 	av_register_all();
 	av_log_set_level(AV_LOG_PANIC);
-	for( media_path = media_dirs; media_path != NULL; media_path = media_path->next )
+	use_metacache = (metacache_open() == 0);
+	sql_batch_begin(db);
+	scan_workers_start();
+	/* Walk the media_dirs storing stubs, which makes everything browsable
+	 * quickly, then go back and parse the files */
+	defer_parsing = 1;
+	if( GETFLAG(RESCAN_MASK) )
+		update_media_dirs();
+	else
 	{
-		int64_t id;
-		char *bname, *parent = NULL;
-		char buf[8];
-		strncpyt(path, media_path->path, sizeof(path));
-		bname = basename(path);
-		/* If there are multiple media locations, add a level to the ContentDirectory */
-		if( !GETFLAG(MERGE_MEDIA_DIRS_MASK) && media_dirs->next )
-		{
-			int startID = get_next_available_id("OBJECTS", BROWSEDIR_ID);
-			id = insert_directory(bname, path, BROWSEDIR_ID, "", startID);
-			sprintf(buf, "$%X", startID);
-			parent = buf;
-		}
-		else
-			id = GetFolderMetadata(bname, media_path->path, NULL, NULL, 0);
-		/* Use TIMESTAMP to store the media type */
-		sql_exec(db, "UPDATE DETAILS set TIMESTAMP = %d where ID = %lld", media_path->types, (long long)id);
-		ScanDirectory(media_path->path, parent, media_path->types);
-		sql_exec(db, "INSERT into SETTINGS values (%Q, %Q)", "media_dir", media_path->path);
+		for( media_path = media_dirs; media_path != NULL; media_path = media_path->next )
+			scan_media_dir(media_path);
 	}
+	defer_parsing = 0;
+	sql_batch_end(db);
+	sql_batch_begin(db);
+	parse_pending();
+	scan_workers_stop();
+	sql_batch_end(db);
+	/* Whatever a full scan didn't come across is gone */
+	metacache_close(!GETFLAG(RESCAN_MASK) && !quitting);
+	use_metacache = 0;
+	scan_hints_close(0);
+#ifdef SYS_ioprio_set
+	/* In case we didn't fork, and go on to serve files */
+	if (ioprio >= 0)
+		syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, ioprio);
+#endif
+	id_map_free(&next_ids);
+	id_map_free(&containers);
 	_notify_stop();
-	/* Create this index after scanning, so it doesn't slow down the scanning process.
-	 * This index is very useful for large libraries used with an XBox360 (or any
-	 * client that uses UPnPSearch on large containers). */
-	sql_exec(db, "create INDEX IDX_SEARCH_OPT ON OBJECTS(OBJECT_ID, CLASS, DETAIL_ID);");
+	/* An update only adds to tables that are already indexed */
+	if( !GETFLAG(RESCAN_MASK) )
+	{
+		/* Create this index after scanning, so it doesn't slow down the scanning process.
+		 * This index is very useful for large libraries used with an XBox360 (or any
+		 * client that uses UPnPSearch on large containers). */
+		sql_exec(db, "create INDEX IDX_SEARCH_OPT ON OBJECTS(OBJECT_ID, CLASS, DETAIL_ID);");
+		CreateSortIndexes();
+		/* Same goes for the full-text index used by "contains" searches.  Building it
+		 * in one pass is much faster than keeping it up to date row by row, so the
+		 * triggers that keep it in sync with inotify changes are only added now. */
+		CreateSearchIndex();
+	}
 
 	if( GETFLAG(NO_PLAYLIST_MASK) )
 	{
@@ -890,5 +2356,8 @@ start_scanner()
 
 	DPRINTF(E_DEBUG, L_SCANNER, "Initial file scan completed\n");
 	//JM: Set up a db version number, so we know if we need to rebuild due to a new structure.
-	sql_exec(db, "pragma user_version = %d;", DB_VERSION);
+	/* An update starts from a current database, and writing nothing
+	 * tells the main process that nothing changed. */
+	if( !GETFLAG(RESCAN_MASK) )
+		sql_exec(db, "pragma user_version = %d;", DB_VERSION);
 }
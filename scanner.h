@@ -69,7 +69,7 @@ int
 is_image(const char *file);
 
 int64_t
-get_next_available_id(const char *table, const char *parentID);
+get_next_available_id(const char *parentID);
 
 int64_t
 insert_directory(const char *name, const char *path, const char *base, const char *parentID, int objectID);
@@ -80,7 +80,24 @@ insert_file(char *name, const char *path, const char *parentID, int object, medi
 int
 CreateDatabase(void);
 
+int
+CreateSearchIndex(void);
+
+int
+UpgradeDatabase(int db_vers);
+
 void
 start_scanner();
 
+/* The pipe that Browse requests pass their ObjectID to the scanner
+ * process through.  end is 0 for the scanner's end, 1 for the other. */
+int
+scan_hints_open(void);
+
+void
+scan_hints_close(int end);
+
+void
+scan_hint(const char *id);
+
 #endif
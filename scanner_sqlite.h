@@ -26,10 +26,15 @@ char create_objectTable_sqlite[] = "CREATE TABLE OBJECTS ("
 					"ID INTEGER PRIMARY KEY AUTOINCREMENT, "
 					"OBJECT_ID TEXT UNIQUE NOT NULL, "
 					"PARENT_ID TEXT NOT NULL, "
+					"PARENT INTEGER DEFAULT NULL, "
 					"REF_ID TEXT DEFAULT NULL, "
 					"CLASS TEXT NOT NULL, "
 					"DETAIL_ID INTEGER DEFAULT NULL, "
-                                        "NAME TEXT DEFAULT NULL);";
+					"NAME TEXT DEFAULT NULL, "
+					"SORT_TITLE TEXT COLLATE NOCASE DEFAULT NULL, "
+					"SORT_DATE DATE DEFAULT NULL, "
+					"SORT_DISC INTEGER DEFAULT NULL, "
+                                        "SORT_TRACK INTEGER DEFAULT NULL);";
 
 char create_detailTable_sqlite[] = "CREATE TABLE DETAILS ("
 					"ID INTEGER PRIMARY KEY AUTOINCREMENT, "
@@ -54,7 +59,8 @@ char create_detailTable_sqlite[] = "CREATE TABLE DETAILS ("
 					"ALBUM_ART INTEGER DEFAULT 0, "
 					"ROTATION INTEGER, "
 					"DLNA_PN TEXT, "
-                                        "MIME TEXT);";
+					"MIME TEXT, "
+					"DIR_CHANGED INTEGER DEFAULT NULL);";
 
 char create_albumArtTable_sqlite[] = "CREATE TABLE ALBUM_ART ("
 					"ID INTEGER PRIMARY KEY AUTOINCREMENT, "
@@ -79,9 +85,62 @@ char create_playlistTable_sqlite[] = "CREATE TABLE PLAYLISTS ("
 					"FOUND INTEGER DEFAULT 0"
 					");";
 
+/* Files the scanner has only stored a stub for so far, with the mtime
+ * that decides the order they are parsed in */
+char create_pendingTable_sqlite[] = "CREATE TABLE PENDING ("
+					"ID INTEGER PRIMARY KEY, "
+					"TIMESTAMP INTEGER, "
+					"TYPES INTEGER"
+					");";
 char create_settingsTable_sqlite[] = "CREATE TABLE SETTINGS ("
 					"KEY TEXT NOT NULL, "
 					"VALUE TEXT"
 					");";
 
+char create_detailFtsTable_sqlite[] = "CREATE VIRTUAL TABLE DETAILS_FTS USING fts5("
+					"TITLE, CREATOR, ARTIST, ALBUM, GENRE, "
+					"content='DETAILS', content_rowid='ID', "
+					"tokenize='trigram'"
+					");";
+
+char create_detailFtsTriggers_sqlite[] = "CREATE TRIGGER DETAILS_FTS_AI AFTER INSERT ON DETAILS BEGIN "
+					"INSERT into DETAILS_FTS (rowid, TITLE, CREATOR, ARTIST, ALBUM, GENRE) "
+					"values (new.ID, new.TITLE, new.CREATOR, new.ARTIST, new.ALBUM, new.GENRE); "
+					"END; "
+					"CREATE TRIGGER DETAILS_FTS_AD AFTER DELETE ON DETAILS BEGIN "
+					"INSERT into DETAILS_FTS (DETAILS_FTS, rowid, TITLE, CREATOR, ARTIST, ALBUM, GENRE) "
+					"values ('delete', old.ID, old.TITLE, old.CREATOR, old.ARTIST, old.ALBUM, old.GENRE); "
+					"END; "
+					"CREATE TRIGGER DETAILS_FTS_AU AFTER UPDATE OF TITLE, CREATOR, ARTIST, ALBUM, GENRE ON DETAILS BEGIN "
+					"INSERT into DETAILS_FTS (DETAILS_FTS, rowid, TITLE, CREATOR, ARTIST, ALBUM, GENRE) "
+					"values ('delete', old.ID, old.TITLE, old.CREATOR, old.ARTIST, old.ALBUM, old.GENRE); "
+					"INSERT into DETAILS_FTS (rowid, TITLE, CREATOR, ARTIST, ALBUM, GENRE) "
+					"values (new.ID, new.TITLE, new.CREATOR, new.ARTIST, new.ALBUM, new.GENRE); "
+					"END;";
+
+/* PARENT is the ID of the PARENT_ID object, so that children can be looked
+ * up by integer.  The SORT_ columns are copies of the DETAILS columns that
+ * Browse sorts on, so that they can be indexed together with PARENT. */
+char create_objectTriggers_sqlite[] = "CREATE TRIGGER OBJECTS_AI AFTER INSERT ON OBJECTS BEGIN "
+					"UPDATE OBJECTS set "
+					"PARENT = (SELECT ID from OBJECTS where OBJECT_ID = new.PARENT_ID), "
+					"(SORT_TITLE, SORT_DATE, SORT_DISC, SORT_TRACK) = "
+					"(SELECT TITLE, DATE, DISC, TRACK from DETAILS where ID = new.DETAIL_ID) "
+					"where ID = new.ID; "
+					"UPDATE OBJECTS set PARENT = new.ID "
+					"where PARENT_ID = new.OBJECT_ID and PARENT is NULL; "
+					"END; "
+					"CREATE TRIGGER OBJECTS_SORT_AU AFTER UPDATE OF DETAIL_ID ON OBJECTS BEGIN "
+					"UPDATE OBJECTS set (SORT_TITLE, SORT_DATE, SORT_DISC, SORT_TRACK) = "
+					"(SELECT TITLE, DATE, DISC, TRACK from DETAILS where ID = new.DETAIL_ID) "
+					"where ID = new.ID; "
+					"END; "
+					"CREATE TRIGGER DETAILS_SORT_AU AFTER UPDATE OF TITLE, DATE, DISC, TRACK ON DETAILS BEGIN "
+					"UPDATE OBJECTS set (SORT_TITLE, SORT_DATE, SORT_DISC, SORT_TRACK) = "
+					"(new.TITLE, new.DATE, new.DISC, new.TRACK) where DETAIL_ID = new.ID; "
+					"END;";
 
+char create_sortIndexes_sqlite[] = "create INDEX IDX_SORT_TITLE ON OBJECTS(PARENT, SORT_TITLE); "
+					"create INDEX IDX_SORT_DATE ON OBJECTS(PARENT, SORT_DATE, SORT_TITLE); "
+					"create INDEX IDX_SORT_CLASS_TITLE ON OBJECTS(PARENT, CLASS, SORT_TITLE); "
+					"create INDEX IDX_SORT_CLASS_TRACK ON OBJECTS(PARENT, CLASS, SORT_DISC, SORT_TRACK, SORT_TITLE);";
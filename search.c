@@ -0,0 +1,744 @@
+/* MiniDLNA media server
+ *
+ * This file is part of MiniDLNA.
+ *
+ * MiniDLNA is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * MiniDLNA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MiniDLNA. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "upnpglobalvars.h"
+#include "upnphttp.h"
+#include "upnpsoap.h"
+#include "search.h"
+#include "utils.h"
+#include "log.h"
+
+/* Limits on what we accept from a client */
+#define SEARCH_MAX_DEPTH 32
+#define SEARCH_MAX_NODES 256
+
+#define PROP_ESCAPED	0x01	/* stored XML-escaped by the scanner */
+#define PROP_CLASS	0x02	/* upnp:class, stored without "object." */
+#define PROP_PARENT	0x04
+
+static const struct search_prop {
+	const char *name;
+	const char *column;
+	const char *fts_column;
+	int flags;
+} search_props[] = {
+	{ "@id",         "o.OBJECT_ID", NULL,      0 },
+	{ "@parentID",   "o.PARENT_ID", NULL,      PROP_PARENT },
+	{ "@refID",      "o.REF_ID",    NULL,      0 },
+	{ "upnp:class",  "o.CLASS",     NULL,      PROP_CLASS },
+	{ "dc:title",    "d.TITLE",     "TITLE",   PROP_ESCAPED },
+	{ "dc:creator",  "d.CREATOR",   "CREATOR", PROP_ESCAPED },
+	{ "dc:date",     "d.DATE",      NULL,      PROP_ESCAPED },
+	{ "upnp:artist", "d.ARTIST",    "ARTIST",  PROP_ESCAPED },
+	{ "upnp:actor",  "d.ARTIST",    "ARTIST",  PROP_ESCAPED },
+	{ "upnp:album",  "d.ALBUM",     "ALBUM",   PROP_ESCAPED },
+	{ "upnp:genre",  "d.GENRE",     "GENRE",   PROP_ESCAPED },
+	{ NULL, NULL, NULL, 0 }
+};
+
+enum search_op {
+	SEARCH_OR,
+	SEARCH_AND,
+	SEARCH_EQ,
+	SEARCH_NE,
+	SEARCH_LT,
+	SEARCH_LE,
+	SEARCH_GT,
+	SEARCH_GE,
+	SEARCH_CONTAINS,
+	SEARCH_NOT_CONTAINS,
+	SEARCH_DERIVED,
+	SEARCH_STARTS,
+	SEARCH_EXISTS
+};
+
+static const struct {
+	const char *name;
+	const char *sql;
+	enum search_op op;
+} search_ops[] = {
+	{ "=",              "=",  SEARCH_EQ },
+	{ "!=",             "!=", SEARCH_NE },
+	{ "<",              "<",  SEARCH_LT },
+	{ "<=",             "<=", SEARCH_LE },
+	{ ">",              ">",  SEARCH_GT },
+	{ ">=",             ">=", SEARCH_GE },
+	{ "contains",       NULL, SEARCH_CONTAINS },
+	{ "doesNotContain", NULL, SEARCH_NOT_CONTAINS },
+	{ "derivedfrom",    NULL, SEARCH_DERIVED },
+	{ "startsWith",     NULL, SEARCH_STARTS },
+	{ "exists",         NULL, SEARCH_EXISTS },
+	{ NULL, NULL, 0 }
+};
+
+struct search_node {
+	enum search_op op;
+	const struct search_prop *prop;
+	const char *sql_op;
+	char *value;		/* unescaped operand; NULL for "exists false" */
+	struct search_node *left;
+	struct search_node *right;
+};
+
+enum token_type {
+	TOK_END,
+	TOK_LPAREN,
+	TOK_RPAREN,
+	TOK_WORD,
+	TOK_STRING,
+	TOK_ERROR
+};
+
+struct search_parser {
+	const char *pos;
+	enum token_type type;
+	const char *tok;
+	int len;
+	int depth;
+	int nodes;
+	int params;
+};
+
+/* The SOAP argument is still XML-escaped, so decode it once before
+ * tokenizing.  Quoted values then only use the \" and \\ escapes. */
+static char *
+xml_decode(const char *str)
+{
+	static const struct {
+		const char *entity;
+		char c;
+	} entities[] = {
+		{ "&quot;", '"' },
+		{ "&apos;", '\'' },
+		{ "&lt;", '<' },
+		{ "&gt;", '>' },
+		{ "&amp;", '&' },
+		{ NULL, 0 }
+	};
+	char *buf, *d;
+	int i, len;
+
+	buf = d = malloc(strlen(str) + 1);
+	if (!buf)
+		return NULL;
+	while (*str)
+	{
+		if (*str == '&')
+		{
+			for (i = 0; entities[i].entity; i++)
+			{
+				len = strlen(entities[i].entity);
+				if (strncmp(str, entities[i].entity, len) == 0)
+					break;
+			}
+			if (entities[i].entity)
+			{
+				*d++ = entities[i].c;
+				str += len;
+				continue;
+			}
+		}
+		*d++ = *str++;
+	}
+	*d = '\0';
+
+	return buf;
+}
+
+static void
+next_token(struct search_parser *p)
+{
+	const char *s = p->pos, *e;
+
+	while (isspace(*s))
+		s++;
+	p->tok = s;
+	switch (*s)
+	{
+	case '\0':
+		p->type = TOK_END;
+		e = s;
+		break;
+	case '(':
+		p->type = TOK_LPAREN;
+		e = s + 1;
+		break;
+	case ')':
+		p->type = TOK_RPAREN;
+		e = s + 1;
+		break;
+	case '"':
+		for (e = s + 1; *e && *e != '"'; e++)
+		{
+			if (*e == '\\' && e[1])
+				e++;
+		}
+		if (!*e)
+		{
+			p->type = TOK_ERROR;
+			break;
+		}
+		p->type = TOK_STRING;
+		p->tok = s + 1;
+		p->len = e - p->tok;
+		p->pos = e + 1;
+		return;
+	case '=':
+	case '!':
+	case '<':
+	case '>':
+		for (e = s; *e && strchr("=!<>", *e); e++)
+			continue;
+		p->type = TOK_WORD;
+		break;
+	default:
+		for (e = s; *e && !isspace(*e) && !strchr("()\"=!<>", *e); e++)
+			continue;
+		p->type = TOK_WORD;
+		break;
+	}
+	p->len = e - s;
+	p->pos = e;
+}
+
+static int
+token_is(const struct search_parser *p, const char *word)
+{
+	return (p->type == TOK_WORD && strlen(word) == p->len &&
+	        strncmp(p->tok, word, p->len) == 0);
+}
+
+static char *
+token_value(const struct search_parser *p)
+{
+	char *value, *d;
+	int i;
+
+	value = d = malloc(p->len + 1);
+	if (!value)
+		return NULL;
+	for (i = 0; i < p->len; i++)
+	{
+		if (p->tok[i] == '\\' && i + 1 < p->len)
+			i++;
+		*d++ = p->tok[i];
+	}
+	*d = '\0';
+
+	return value;
+}
+
+static void
+free_node(struct search_node *node)
+{
+	if (!node)
+		return;
+	free_node(node->left);
+	free_node(node->right);
+	free(node->value);
+	free(node);
+}
+
+static struct search_node *parse_or(struct search_parser *p);
+
+static struct search_node *
+parse_rel(struct search_parser *p)
+{
+	struct search_node *node;
+	int i;
+
+	if (p->type != TOK_WORD || p->nodes >= SEARCH_MAX_NODES)
+		return NULL;
+	for (i = 0; search_props[i].name; i++)
+		if (token_is(p, search_props[i].name))
+			break;
+	if (!search_props[i].name)
+	{
+		DPRINTF(E_DEBUG, L_HTTP, "Unsupported search property: %.*s\n", p->len, p->tok);
+		return NULL;
+	}
+	node = calloc(1, sizeof(struct search_node));
+	if (!node)
+		return NULL;
+	node->prop = &search_props[i];
+	p->nodes++;
+
+	next_token(p);
+	for (i = 0; search_ops[i].name; i++)
+		if (token_is(p, search_ops[i].name))
+			break;
+	if (!search_ops[i].name)
+		goto error;
+	node->op = search_ops[i].op;
+	node->sql_op = search_ops[i].sql;
+
+	next_token(p);
+	if (node->op == SEARCH_EXISTS)
+	{
+		if (token_is(p, "true"))
+			node->value = strdup("");
+		else if (!token_is(p, "false"))
+			goto error;
+	}
+	else
+	{
+		if (p->type != TOK_STRING)
+			goto error;
+		node->value = token_value(p);
+		if (!node->value)
+			goto error;
+		/* derivedfrom on upnp:class needs both ends of a range */
+		p->params += (node->op == SEARCH_DERIVED) ? 2 : 1;
+	}
+	next_token(p);
+
+	return node;
+error:
+	free_node(node);
+	return NULL;
+}
+
+static struct search_node *
+parse_primary(struct search_parser *p)
+{
+	struct search_node *node;
+
+	if (p->type != TOK_LPAREN)
+		return parse_rel(p);
+	if (++p->depth > SEARCH_MAX_DEPTH)
+		return NULL;
+	next_token(p);
+	node = parse_or(p);
+	if (!node)
+		return NULL;
+	if (p->type != TOK_RPAREN)
+	{
+		free_node(node);
+		return NULL;
+	}
+	p->depth--;
+	next_token(p);
+
+	return node;
+}
+
+static struct search_node *
+parse_logic(struct search_parser *p, enum search_op op)
+{
+	struct search_node *node, *right, *parent;
+	const char *word = (op == SEARCH_AND) ? "and" : "or";
+
+	node = (op == SEARCH_AND) ? parse_primary(p) : parse_logic(p, SEARCH_AND);
+	while (node && token_is(p, word))
+	{
+		next_token(p);
+		right = (op == SEARCH_AND) ? parse_primary(p) : parse_logic(p, SEARCH_AND);
+		parent = right ? calloc(1, sizeof(struct search_node)) : NULL;
+		if (!parent)
+		{
+			free_node(node);
+			free_node(right);
+			return NULL;
+		}
+		parent->op = op;
+		parent->left = node;
+		parent->right = right;
+		p->nodes++;
+		node = parent;
+	}
+
+	return node;
+}
+
+static struct search_node *
+parse_or(struct search_parser *p)
+{
+	return parse_logic(p, SEARCH_OR);
+}
+
+static int
+add_param(struct search_criteria *sc, char *value)
+{
+	sc->params[sc->nparams++] = value;
+	return sc->nparams;
+}
+
+/* Escape LIKE wildcards in a literal, and add the requested ones */
+static char *
+like_pattern(const char *value, int leading, int *escaped)
+{
+	char *pattern, *d;
+
+	pattern = d = malloc(strlen(value) * 2 + 3);
+	if (!pattern)
+		return NULL;
+	*escaped = 0;
+	if (leading)
+		*d++ = '%';
+	for (; *value; value++)
+	{
+		if (*value == '%' || *value == '_' || *value == '\\')
+		{
+			*d++ = '\\';
+			*escaped = 1;
+		}
+		*d++ = *value;
+	}
+	*d++ = '%';
+	*d = '\0';
+
+	return pattern;
+}
+
+static int
+utf8_strlen(const char *s)
+{
+	int len = 0;
+
+	for (; *s; s++)
+		if ((*s & 0xC0) != 0x80)
+			len++;
+
+	return len;
+}
+
+static int
+emit_rel(struct search_node *node, struct search_criteria *sc, struct string_s *sql)
+{
+	const struct search_prop *prop = node->prop;
+	const char *column = prop->column;
+	char *value, *upper, *pattern;
+	int escaped;
+
+	if (prop->flags & PROP_PARENT)
+		sc->flags |= SEARCH_PARENT_ID;
+	if (node->op == SEARCH_EXISTS)
+	{
+		strcatf(sql, "%s is %sNULL", column, node->value ? "not " : "");
+		return 0;
+	}
+
+	if (prop->flags & PROP_CLASS)
+	{
+		const char *class = node->value;
+		if (strncmp(class, "object.", 7) == 0)
+			class += 7;
+		else if (strcmp(class, "object") == 0)
+			class = "";
+		value = strdup(class);
+	}
+	else if (prop->flags & PROP_ESCAPED)
+		value = escape_tag(node->value, 1);
+	else
+		value = strdup(node->value);
+	if (!value)
+		return -1;
+
+	switch (node->op)
+	{
+	case SEARCH_DERIVED:
+		if (prop->flags & PROP_CLASS)
+		{
+			/* Classes are dotted paths, so every class derived from
+			 * "a.b" sorts between "a.b" and "a.c", and can be found with
+			 * a range scan on the CLASS index. */
+			if (!*value)
+			{
+				strcatf(sql, "%s >= ?%d", column, add_param(sc, value));
+				return 0;
+			}
+			upper = strdup(value);
+			if (!upper)
+			{
+				free(value);
+				return -1;
+			}
+			upper[strlen(upper)-1]++;
+			strcatf(sql, "(%s >= ?%d", column, add_param(sc, value));
+			strcatf(sql, " and %s < ?%d)", column, add_param(sc, upper));
+			return 0;
+		}
+		/* fall through */
+	case SEARCH_STARTS:
+	case SEARCH_CONTAINS:
+	case SEARCH_NOT_CONTAINS:
+		pattern = like_pattern(value, node->op == SEARCH_CONTAINS ||
+		                              node->op == SEARCH_NOT_CONTAINS, &escaped);
+		if (!pattern)
+		{
+			free(value);
+			return -1;
+		}
+		/* The trigram index can't handle ESCAPE, or patterns shorter
+		 * than three characters. */
+		if (node->op == SEARCH_CONTAINS && prop->fts_column &&
+		    GETFLAG(FTS_SEARCH_MASK) && !escaped && utf8_strlen(value) >= 3)
+			strcatf(sql, "o.DETAIL_ID in (select rowid from DETAILS_FTS where %s like ?%d)",
+			        prop->fts_column, add_param(sc, pattern));
+		else
+			strcatf(sql, "%s %slike ?%d%s", column,
+			        node->op == SEARCH_NOT_CONTAINS ? "not " : "",
+			        add_param(sc, pattern), escaped ? " escape '\\'" : "");
+		free(value);
+		break;
+	default:
+		strcatf(sql, "%s %s ?%d", column, node->sql_op, add_param(sc, value));
+		break;
+	}
+
+	return 0;
+}
+
+static int
+emit_node(struct search_node *node, struct search_criteria *sc, struct string_s *sql)
+{
+	if (node->op != SEARCH_AND && node->op != SEARCH_OR)
+		return emit_rel(node, sc, sql);
+
+	strcatf(sql, "(");
+	if (emit_node(node->left, sc, sql) != 0)
+		return -1;
+	strcatf(sql, node->op == SEARCH_AND ? " and " : " or ");
+	if (emit_node(node->right, sc, sql) != 0)
+		return -1;
+	strcatf(sql, ")");
+
+	return 0;
+}
+
+int
+search_parse(const char *str, struct search_criteria *sc)
+{
+	struct search_parser p;
+	struct search_node *root = NULL;
+	struct string_s sql;
+	char *buf;
+	int ret = -1;
+
+	memset(sc, 0, sizeof(struct search_criteria));
+	memset(&p, 0, sizeof(p));
+	if (!str)
+	{
+		sc->where = strdup("1 = 1");
+		return sc->where ? 0 : -1;
+	}
+
+	buf = xml_decode(str);
+	if (!buf)
+		return -1;
+	p.pos = buf;
+	next_token(&p);
+	if (p.type == TOK_END || token_is(&p, "*"))
+	{
+		next_token(&p);
+		if (p.type == TOK_END)
+		{
+			sc->where = strdup("1 = 1");
+			ret = sc->where ? 0 : -1;
+			goto done;
+		}
+		goto error;
+	}
+
+	root = parse_or(&p);
+	if (!root || p.type != TOK_END)
+		goto error;
+
+	/* The longest thing a node can produce is a full-text subquery */
+	sql.size = p.nodes * 128 + 1;
+	sql.off = 0;
+	sql.data = malloc(sql.size);
+	sc->params = calloc(p.params + 1, sizeof(char *));
+	sc->where = sql.data;
+	if (!sql.data || !sc->params)
+		goto error;
+	if (emit_node(root, sc, &sql) != 0 || sql.off >= sql.size)
+		goto error;
+	ret = 0;
+	goto done;
+
+error:
+	DPRINTF(E_WARN, L_HTTP, "Unsupported or invalid SearchCriteria: %s\n", str);
+	search_free(sc);
+done:
+	free_node(root);
+	free(buf);
+
+	return ret;
+}
+
+int
+search_bind(sqlite3_stmt *stmt, const struct search_criteria *sc)
+{
+	int i, ret = SQLITE_OK;
+
+	for (i = 0; i < sc->nparams && ret == SQLITE_OK; i++)
+		ret = sqlite3_bind_text(stmt, i + 1, sc->params[i], -1, SQLITE_STATIC);
+
+	return ret;
+}
+
+void
+search_free(struct search_criteria *sc)
+{
+	int i;
+
+	for (i = 0; i < sc->nparams; i++)
+		free(sc->params[i]);
+	free(sc->params);
+	free(sc->where);
+	memset(sc, 0, sizeof(struct search_criteria));
+}
+
+/* Object IDs are paths, so the descendants of X are exactly the IDs in
+ * ["X$", "X%"), which SQLite can scan as an index range.  The container
+ * ID is bound to the placeholder after the criteria's own. */
+char *
+search_subtree(const char *ContainerID, const struct search_criteria *sc)
+{
+	if (*ContainerID != '*')
+		return sqlite3_mprintf("(OBJECT_ID >= ?%d || '$' and OBJECT_ID < ?%d || '%%')",
+		                       sc->nparams + 1, sc->nparams + 1);
+	if (sc->flags & SEARCH_PARENT_ID)
+		return sqlite3_mprintf("1");
+	return sqlite3_mprintf("(OBJECT_ID glob '*$*')");
+}
+
+/* Below a container, the container itself is added with a UNION ALL.
+ * A compound select can only be ordered by its result columns, so the
+ * order has to come from parse_sort_criteria() with SORT_RESULT_COLUMNS. */
+char *
+search_select(const char *ContainerID, const char *subtree,
+              const struct search_criteria *sc, const char *groupBy, const char *orderBy)
+{
+	int n = sc->nparams;
+
+	return sqlite3_mprintf(BROWSE_SELECT_COLUMNS
+	                       "from OBJECTS o left join DETAILS d on (d.ID = o.DETAIL_ID)"
+	                       " where %s and (%s) %s "
+	                       "%z %s"
+	                       " limit ?%d, ?%d",
+	                       subtree, sc->where, groupBy,
+	                       (*ContainerID == '*') ? NULL :
+	                       sqlite3_mprintf("UNION ALL " BROWSE_SELECT_COLUMNS
+	                                       "from OBJECTS o left join DETAILS d on (d.ID = o.DETAIL_ID)"
+	                                       " where OBJECT_ID = ?%d and (%s) ", n+1, sc->where),
+	                       orderBy ? orderBy : "", n+2, n+3);
+}
+
+char *
+parse_sort_criteria(char *sortCriteria, int flags, int *error)
+{
+	int result = (flags & SORT_RESULT_COLUMNS);
+	char *order = NULL;
+	char *item, *saveptr;
+	int i, ret, reverse, title_sorted = 0;
+	struct string_s str;
+	*error = 0;
+
+	if (force_sort_criteria)
+		sortCriteria = strdup(force_sort_criteria);
+	if (!sortCriteria)
+		return NULL;
+
+	if ((item = strtok_r(sortCriteria, ",", &saveptr)))
+	{
+		order = malloc(4096);
+		str.data = order;
+		str.size = 4096;
+		str.off = 0;
+		strcatf(&str, "order by ");
+	}
+	for (i = 0; item != NULL; i++)
+	{
+		reverse = 0;
+		if (i)
+			strcatf(&str, ", ");
+		if (*item == '+')
+		{
+			item++;
+		}
+		else if (*item == '-')
+		{
+			reverse = 1;
+			item++;
+		}
+		else
+		{
+			DPRINTF(E_ERROR, L_HTTP, "No order specified [%s]\n", item);
+			goto bad_direction;
+		}
+		if (strcasecmp(item, "upnp:class") == 0)
+		{
+			strcatf(&str, "o.CLASS");
+		}
+		else if (strcasecmp(item, "dc:title") == 0)
+		{
+			strcatf(&str, result ? "d.TITLE" : "o.SORT_TITLE");
+			title_sorted = 1;
+		}
+		else if (strcasecmp(item, "dc:date") == 0)
+		{
+			strcatf(&str, result ? "d.DATE" : "o.SORT_DATE");
+		}
+		else if (strcasecmp(item, "upnp:originalTrackNumber") == 0)
+		{
+			strcatf(&str, result ? "d.DISC, d.TRACK" : "o.SORT_DISC, o.SORT_TRACK");
+		}
+		else if (strcasecmp(item, "upnp:album") == 0)
+		{
+			strcatf(&str, "d.ALBUM");
+		}
+		else
+		{
+			DPRINTF(E_ERROR, L_HTTP, "Unhandled SortCriteria [%s]\n", item);
+		bad_direction:
+			*error = -1;
+			if (i)
+			{
+				ret = strlen(order);
+				order[ret-2] = '\0';
+			}
+			i--;
+			goto unhandled_order;
+		}
+
+		if (reverse)
+			strcatf(&str, " DESC");
+		unhandled_order:
+		item = strtok_r(NULL, ",", &saveptr);
+	}
+	if (i <= 0)
+	{
+		free(order);
+		if (force_sort_criteria)
+			free(sortCriteria);
+		return NULL;
+	}
+	/* Add a "tiebreaker" sort order */
+	if (!title_sorted)
+		strcatf(&str, result ? ", d.TITLE ASC" : ", o.SORT_TITLE ASC");
+
+	if (force_sort_criteria)
+		free(sortCriteria);
+
+	return order;
+}
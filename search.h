@@ -0,0 +1,54 @@
+/* MiniDLNA media server
+ *
+ * This file is part of MiniDLNA.
+ *
+ * MiniDLNA is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * MiniDLNA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MiniDLNA. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __SEARCH_H__
+#define __SEARCH_H__
+
+#include <sqlite3.h>
+
+/* Set if the criteria refer to @parentID, in which case the search
+ * container itself is also a candidate for the OBJECT_ID match. */
+#define SEARCH_PARENT_ID 0x01
+
+/* A compiled UPnP SearchCriteria string.  The where clause only contains
+ * column names, operators and numbered placeholders (?1 .. ?nparams), so
+ * the same criteria structure always produces the same SQL text. */
+struct search_criteria {
+	char *where;
+	char **params;
+	int nparams;
+	int flags;
+};
+
+/* Sort on the DETAILS columns a Browse or Search returns, rather than
+ * on the indexed copies in OBJECTS that Browse uses. */
+#define SORT_RESULT_COLUMNS 0x01
+
+int search_parse(const char *str, struct search_criteria *sc);
+int search_bind(sqlite3_stmt *stmt, const struct search_criteria *sc);
+void search_free(struct search_criteria *sc);
+
+/* The Search statement takes the criteria's placeholders, then the
+ * container ID, StartingIndex and RequestedCount. */
+char *search_subtree(const char *ContainerID, const struct search_criteria *sc);
+char *search_select(const char *ContainerID, const char *subtree,
+                    const struct search_criteria *sc, const char *groupBy, const char *orderBy);
+
+/* Turn a UPnP SortCriteria string into an "order by" clause, or NULL.
+ * error is set to -1 for criteria that were left out. */
+char *parse_sort_criteria(char *sortCriteria, int flags, int *error);
+
+#endif
@@ -0,0 +1,446 @@
+/* MiniDLNA media server
+ *
+ * This file is part of MiniDLNA.
+ *
+ * MiniDLNA is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * MiniDLNA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MiniDLNA. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "upnpglobalvars.h"
+#include "upnphttp.h"
+#include "upnpsoap.h"
+#include "snapshot.h"
+#include "sql.h"
+#include "log.h"
+
+/* A read-only copy of everything a default-ordered Browse returns, laid out
+ * as parent -> children arrays over a pool of interned strings.  It lives in
+ * a file under db_path and is mapped, so forked children share its pages. */
+#define SNAPSHOT_MAGIC   "MDSNAP01"
+#define SNAPSHOT_COLUMNS 25
+/* Seconds without database changes before we rebuild */
+#define SNAPSHOT_SETTLE  10
+
+struct snapshot_header {
+	char magic[8];
+	uint32_t updateID;
+	uint32_t count;		/* number of objects */
+	uint32_t ids;		/* offset of the object indexes sorted by OBJECT_ID */
+	uint32_t strings;	/* offset of the string pool */
+};
+
+struct snapshot_object {
+	uint32_t first_child;
+	uint32_t nchildren;
+	uint32_t col[SNAPSHOT_COLUMNS];	/* string pool offsets, 0 for NULL */
+};
+
+static struct {
+	void *map;
+	size_t size;
+	int changes;
+	/* What the database looked like when we last checked */
+	uint32_t seen_updateID;
+	int seen_changes;
+	time_t seen_time;
+} snap;
+
+struct pool {
+	char *data;
+	uint32_t len;
+	uint32_t size;
+	uint32_t *hash;
+	uint32_t hsize;
+	uint32_t hcount;
+};
+
+static uint32_t
+pool_hash(const char *s, size_t len)
+{
+	uint32_t h = 2166136261u;
+
+	while (len--)
+		h = (h ^ (unsigned char)*s++) * 16777619u;
+	return h;
+}
+
+static int
+pool_grow_hash(struct pool *p)
+{
+	uint32_t *old = p->hash, oldsize = p->hsize, i, h;
+
+	p->hsize = oldsize ? oldsize * 2 : 65536;
+	p->hash = calloc(p->hsize, sizeof(uint32_t));
+	if (!p->hash)
+		return -1;
+	for (i = 0; i < oldsize; i++)
+	{
+		if (!old[i])
+			continue;
+		h = pool_hash(p->data + old[i], strlen(p->data + old[i]));
+		while (p->hash[h & (p->hsize - 1)])
+			h++;
+		p->hash[h & (p->hsize - 1)] = old[i];
+	}
+	free(old);
+
+	return 0;
+}
+
+/* Returns the pool offset of s, adding it if we haven't seen it yet */
+static uint32_t
+pool_add(struct pool *p, const char *s)
+{
+	size_t len;
+	uint32_t h, off;
+
+	if (!s)
+		return 0;
+	if (p->hcount * 4 >= p->hsize * 3 && pool_grow_hash(p) != 0)
+		return UINT32_MAX;
+	len = strlen(s);
+	for (h = pool_hash(s, len); (off = p->hash[h & (p->hsize - 1)]); h++)
+	{
+		if (strcmp(p->data + off, s) == 0)
+			return off;
+	}
+	if (p->len + len + 1 > p->size)
+	{
+		char *data;
+		uint32_t size = p->size;
+
+		while (p->len + len + 1 > size)
+			size *= 2;
+		if (size < p->size || !(data = realloc(p->data, size)))
+			return UINT32_MAX;
+		p->data = data;
+		p->size = size;
+	}
+	off = p->len;
+	memcpy(p->data + off, s, len + 1);
+	p->len += len + 1;
+	p->hash[h & (p->hsize - 1)] = off;
+	p->hcount++;
+
+	return off;
+}
+
+static const struct snapshot_object *sort_objects;
+static const char *sort_strings;
+
+static int
+cmp_ids(const void *a, const void *b)
+{
+	return strcmp(sort_strings + sort_objects[*(const uint32_t *)a].col[0],
+	              sort_strings + sort_objects[*(const uint32_t *)b].col[0]);
+}
+
+static int
+find_object(const struct snapshot_object *objects, const uint32_t *ids,
+            const char *strings, uint32_t count, const char *id)
+{
+	uint32_t lo = 0, hi = count, mid;
+	int cmp;
+
+	while (lo < hi)
+	{
+		mid = lo + (hi - lo) / 2;
+		cmp = strcmp(id, strings + objects[ids[mid]].col[0]);
+		if (cmp == 0)
+			return ids[mid];
+		if (cmp < 0)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+
+	return -1;
+}
+
+static int
+write_all(int fd, const void *buf, size_t len)
+{
+	const char *p = buf;
+	ssize_t n;
+
+	while (len)
+	{
+		n = write(fd, p, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return -1;
+		p += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+static int
+snapshot_build(const char *path, uint32_t id)
+{
+	struct snapshot_header hdr;
+	struct snapshot_object *objects = NULL, *o;
+	struct pool pool;
+	uint32_t *ids = NULL;
+	uint32_t count = 0, alloc = 0, group = 0, i;
+	sqlite3_stmt *stmt = NULL;
+	int c, parent, fd = -1, ret = -1;
+
+	memset(&pool, 0, sizeof(pool));
+	pool.size = 1 << 20;
+	pool.data = malloc(pool.size);
+	if (!pool.data || pool_grow_hash(&pool) != 0)
+		goto error;
+	/* Offset 0 stands for NULL */
+	pool.data[0] = '\0';
+	pool.len = 1;
+
+	/* Grouped by parent, and within that in the default Browse order */
+	if (sqlite3_prepare_v2(db, BROWSE_SELECT_COLUMNS
+	                       "from OBJECTS o left join DETAILS d on (d.ID = o.DETAIL_ID)"
+	                       " order by o.PARENT, o.PARENT_ID, o.NAME, o.ID",
+	                       -1, &stmt, NULL) != SQLITE_OK ||
+	    sqlite3_column_count(stmt) != SNAPSHOT_COLUMNS)
+	{
+		DPRINTF(E_ERROR, L_DB_SQL, "Snapshot query failed: %s\n", sqlite3_errmsg(db));
+		goto error;
+	}
+	while ((c = sqlite3_step(stmt)) == SQLITE_ROW)
+	{
+		if (count == alloc)
+		{
+			alloc = alloc ? alloc * 2 : 65536;
+			o = realloc(objects, alloc * sizeof(*objects));
+			if (!o)
+				goto error;
+			objects = o;
+		}
+		o = &objects[count];
+		memset(o, 0, sizeof(*o));
+		for (c = 0; c < SNAPSHOT_COLUMNS; c++)
+		{
+			o->col[c] = pool_add(&pool, (const char *)sqlite3_column_text(stmt, c));
+			if (o->col[c] == UINT32_MAX)
+				goto error;
+		}
+		count++;
+	}
+	if (c != SQLITE_DONE)
+		goto error;
+	sqlite3_finalize(stmt);
+	stmt = NULL;
+
+	ids = malloc((count ? count : 1) * sizeof(*ids));
+	if (!ids)
+		goto error;
+	for (i = 0; i < count; i++)
+		ids[i] = i;
+	sort_objects = objects;
+	sort_strings = pool.data;
+	qsort(ids, count, sizeof(*ids), cmp_ids);
+
+	/* Point each container at its run of children */
+	for (i = 1; i <= count; i++)
+	{
+		if (i < count && objects[i].col[1] == objects[group].col[1])
+			continue;
+		parent = find_object(objects, ids, pool.data, count, pool.data + objects[group].col[1]);
+		if (parent >= 0)
+		{
+			objects[parent].first_child = group;
+			objects[parent].nchildren = i - group;
+		}
+		group = i;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, SNAPSHOT_MAGIC, sizeof(hdr.magic));
+	hdr.updateID = id;
+	hdr.count = count;
+	hdr.ids = sizeof(hdr) + count * sizeof(*objects);
+	hdr.strings = hdr.ids + count * sizeof(*ids);
+
+	fd = open(path, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+	if (fd < 0)
+	{
+		DPRINTF(E_ERROR, L_GENERAL, "Unable to create %s: %s\n", path, strerror(errno));
+		goto error;
+	}
+	if (write_all(fd, &hdr, sizeof(hdr)) != 0 ||
+	    write_all(fd, objects, count * sizeof(*objects)) != 0 ||
+	    write_all(fd, ids, count * sizeof(*ids)) != 0 ||
+	    write_all(fd, pool.data, pool.len) != 0)
+	{
+		DPRINTF(E_ERROR, L_GENERAL, "Unable to write %s: %s\n", path, strerror(errno));
+		goto error;
+	}
+	ret = 0;
+error:
+	if (fd >= 0)
+		close(fd);
+	sqlite3_finalize(stmt);
+	free(objects);
+	free(ids);
+	free(pool.data);
+	free(pool.hash);
+
+	return ret;
+}
+
+void
+snapshot_close(void)
+{
+	if (snap.map)
+		munmap(snap.map, snap.size);
+	snap.map = NULL;
+	snap.size = 0;
+}
+
+static int
+snapshot_load(const char *path)
+{
+	struct stat st;
+	void *map;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(struct snapshot_header))
+	{
+		close(fd);
+		return -1;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return -1;
+	snapshot_close();
+	snap.map = map;
+	snap.size = st.st_size;
+
+	return 0;
+}
+
+void
+snapshot_update(time_t now)
+{
+	char path[PATH_MAX], tmp[PATH_MAX];
+	uint32_t id = updateID;
+	int changes;
+
+	if (!GETFLAG(BROWSE_SNAPSHOT_MASK) || scanning)
+		return;
+	changes = sql_changes(db);
+	if (snap.map && snap.changes == changes &&
+	    ((struct snapshot_header *)snap.map)->updateID == id)
+		return;
+	if (snap.seen_updateID != id || snap.seen_changes != changes || !snap.seen_time)
+	{
+		snap.seen_updateID = id;
+		snap.seen_changes = changes;
+		snap.seen_time = now;
+		return;
+	}
+	if (now - snap.seen_time < SNAPSHOT_SETTLE)
+		return;
+
+	snprintf(path, sizeof(path), "%s/browse.snapshot", db_path);
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	DPRINTF(E_DEBUG, L_GENERAL, "Rebuilding Browse snapshot for update %u\n", id);
+	if (snapshot_build(tmp, id) != 0 || rename(tmp, path) != 0 || snapshot_load(path) != 0)
+	{
+		unlink(tmp);
+		/* Try again after another quiet period */
+		snap.seen_time = now;
+		return;
+	}
+	snap.changes = changes;
+}
+
+int
+snapshot_browse(const char *id, int start, int count, int *total,
+                snapshot_callback cb, void *args)
+{
+	static char *buf;
+	static size_t bufsize;
+	const struct snapshot_header *hdr = snap.map;
+	const struct snapshot_object *objects, *o;
+	const uint32_t *ids;
+	const char *strings;
+	char *argv[SNAPSHOT_COLUMNS], *p;
+	size_t need, len[SNAPSHOT_COLUMNS];
+	int parent, end, i, c;
+
+	if (!hdr || scanning || !GETFLAG(BROWSE_SNAPSHOT_MASK) ||
+	    hdr->updateID != updateID || snap.changes != sql_changes(db))
+		return -1;
+	objects = (const struct snapshot_object *)(hdr + 1);
+	ids = (const uint32_t *)((const char *)hdr + hdr->ids);
+	strings = (const char *)hdr + hdr->strings;
+
+	parent = find_object(objects, ids, strings, hdr->count, id);
+	if (parent < 0)
+		return -1;
+	*total = objects[parent].nchildren;
+	end = *total;
+	if (count >= 0 && start + count < end)
+		end = start + count;
+
+	for (i = start; i < end; i++)
+	{
+		o = &objects[objects[parent].first_child + i];
+		/* The callback edits some of its strings in place, and may
+		 * lengthen a MIME type a little, so hand it padded copies. */
+		need = 0;
+		for (c = 0; c < SNAPSHOT_COLUMNS; c++)
+		{
+			len[c] = o->col[c] ? strlen(strings + o->col[c]) : 0;
+			need += len[c] + 8;
+		}
+		if (need > bufsize)
+		{
+			p = realloc(buf, need);
+			if (!p)
+				break;
+			buf = p;
+			bufsize = need;
+		}
+		for (p = buf, c = 0; c < SNAPSHOT_COLUMNS; c++)
+		{
+			if (!o->col[c])
+			{
+				argv[c] = NULL;
+				continue;
+			}
+			argv[c] = p;
+			memcpy(p, strings + o->col[c], len[c] + 1);
+			p += len[c] + 8;
+		}
+		if (cb(args, SNAPSHOT_COLUMNS, argv, NULL) != 0)
+			break;
+	}
+
+	return i - start;
+}
@@ -0,0 +1,35 @@
+/* MiniDLNA media server
+ *
+ * This file is part of MiniDLNA.
+ *
+ * MiniDLNA is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * MiniDLNA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MiniDLNA. If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __SNAPSHOT_H__
+#define __SNAPSHOT_H__
+
+#include <time.h>
+
+typedef int (*snapshot_callback)(void *args, int argc, char **argv, char **colnames);
+
+/* Rebuild the snapshot once the database has stopped changing */
+void snapshot_update(time_t now);
+
+/* Call cb for the children of id, in the default Browse order, with the
+ * same columns as BROWSE_SELECT_COLUMNS.  Returns -1 if the snapshot
+ * can't answer for id, otherwise the number of rows passed to cb. */
+int snapshot_browse(const char *id, int start, int count, int *total,
+                    snapshot_callback cb, void *args);
+
+void snapshot_close(void);
+
+#endif
@@ -16,13 +16,94 @@
  * along with MiniDLNA. If not, see <http://www.gnu.org/licenses/>.
  */
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/time.h>
 
 #include "sql.h"
 #include "upnpglobalvars.h"
 #include "log.h"
 
+/* Open a connection to the media database.  The database is kept in WAL
+ * mode, so readers see the last committed state while the scanner or the
+ * inotify thread write.  Connections never checkpoint on their own; the
+ * main loop does it when it won't compete with streaming. */
+int
+sql_open(const char *path, sqlite3 **db)
+{
+	if (sqlite3_open(path, db) != SQLITE_OK)
+		return -1;
+	sqlite3_busy_timeout(*db, 5000);
+	sql_exec(*db, "pragma page_size = 4096");
+	sql_exec(*db, "pragma journal_mode = WAL");
+	sql_exec(*db, "pragma synchronous = NORMAL");
+	sql_exec(*db, "pragma wal_autocheckpoint = 0");
+	sql_exec(*db, "pragma journal_size_limit = %d", WAL_SIZE_LIMIT);
+	/* This one is stored in the file, so setting it is a write */
+	if (sql_get_int_field(*db, "pragma default_cache_size") != 8192)
+		sql_exec(*db, "pragma default_cache_size = 8192;");
+
+	return 0;
+}
+
+/* A counter that moves whenever the database content changes, whether
+ * through this connection or any other one */
+int
+sql_changes(sqlite3 *db)
+{
+	return sql_get_int_field(db, "pragma data_version") + sqlite3_total_changes(db);
+}
+
+/* The scanner and the inotify thread insert each file with a handful of
+ * statements.  Grouping many files into one transaction saves a commit
+ * per statement, while committing every SQL_BATCH_FILES files or
+ * SQL_BATCH_MSEC keeps new entries showing up in Browse soon enough. */
+static __thread struct {
+	int files;
+	struct timeval start;
+} batch;
+
+static long
+batch_msec(void)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	return (now.tv_sec - batch.start.tv_sec) * 1000 +
+	       (now.tv_usec - batch.start.tv_usec) / 1000;
+}
+
+void
+sql_batch_begin(sqlite3 *db)
+{
+	if (!sqlite3_get_autocommit(db))
+		return;
+	if (sql_exec(db, "BEGIN") != SQLITE_OK)
+		return;
+	batch.files = 0;
+	gettimeofday(&batch.start, NULL);
+}
+
+/* Count one more file, and commit if the batch is due */
+void
+sql_batch_step(sqlite3 *db)
+{
+	if (sqlite3_get_autocommit(db))
+		return;
+	if (++batch.files < SQL_BATCH_FILES && batch_msec() < SQL_BATCH_MSEC)
+		return;
+	sql_batch_end(db);
+	sql_batch_begin(db);
+}
+
+void
+sql_batch_end(sqlite3 *db)
+{
+	if (!sqlite3_get_autocommit(db))
+		sql_exec(db, "COMMIT");
+}
+
 int
 sql_exec(sqlite3 *db, const char *fmt, ...)
 {
@@ -259,6 +340,164 @@ sql_get_text_field(sqlite3 *db, const char *fmt, ...)
 	return str;
 }
 
+/* Statements whose text only depends on the shape of a client request
+ * (not on its values) are kept prepared, so their plans are reused.  Like
+ * db, the cache is per thread, so that evicting a slot never finalizes a
+ * statement another thread's connection is stepping.  A thread that used
+ * it calls sql_finalize_cached() before closing its connection. */
+#define SQL_STMT_CACHE_SIZE 16
+
+static __thread struct {
+	sqlite3 *db;
+	char *sql;
+	sqlite3_stmt *stmt;
+	unsigned int used;
+} stmt_cache[SQL_STMT_CACHE_SIZE];
+static __thread unsigned int stmt_cache_clock;
+
+sqlite3_stmt *
+sql_prepare_cached(sqlite3 *db, const char *sql)
+{
+	int i, lru = 0;
+
+	for (i = 0; i < SQL_STMT_CACHE_SIZE; i++)
+	{
+		if (stmt_cache[i].stmt && stmt_cache[i].db == db &&
+		    strcmp(stmt_cache[i].sql, sql) == 0)
+		{
+			stmt_cache[i].used = ++stmt_cache_clock;
+			return stmt_cache[i].stmt;
+		}
+		if (stmt_cache[i].used < stmt_cache[lru].used)
+			lru = i;
+	}
+
+	if (stmt_cache[lru].stmt)
+	{
+		sqlite3_finalize(stmt_cache[lru].stmt);
+		free(stmt_cache[lru].sql);
+		stmt_cache[lru].stmt = NULL;
+		stmt_cache[lru].used = 0;
+	}
+	if (sqlite3_prepare_v2(db, sql, -1, &stmt_cache[lru].stmt, NULL) != SQLITE_OK)
+	{
+		DPRINTF(E_ERROR, L_DB_SQL, "prepare failed: %s\n%s\n", sqlite3_errmsg(db), sql);
+		sqlite3_finalize(stmt_cache[lru].stmt);
+		stmt_cache[lru].stmt = NULL;
+		return NULL;
+	}
+	stmt_cache[lru].sql = strdup(sql);
+	if (!stmt_cache[lru].sql)
+	{
+		sqlite3_finalize(stmt_cache[lru].stmt);
+		stmt_cache[lru].stmt = NULL;
+		return NULL;
+	}
+	stmt_cache[lru].db = db;
+	stmt_cache[lru].used = ++stmt_cache_clock;
+
+	return stmt_cache[lru].stmt;
+}
+
+void
+sql_finalize_cached(sqlite3 *db)
+{
+	int i;
+
+	for (i = 0; i < SQL_STMT_CACHE_SIZE; i++)
+	{
+		if (!stmt_cache[i].stmt || stmt_cache[i].db != db)
+			continue;
+		sqlite3_finalize(stmt_cache[i].stmt);
+		free(stmt_cache[i].sql);
+		stmt_cache[i].stmt = NULL;
+		stmt_cache[i].used = 0;
+	}
+}
+
+static int
+sql_step(sqlite3_stmt *stmt)
+{
+	int counter, result;
+
+	for (counter = 0;
+	     ((result = sqlite3_step(stmt)) == SQLITE_BUSY || result == SQLITE_LOCKED) && counter < 2;
+	     counter++)
+	{
+		/* While SQLITE_BUSY has a built in timeout,
+		 * SQLITE_LOCKED does not, so sleep */
+		if (result == SQLITE_LOCKED)
+			sleep(1);
+	}
+
+	return result;
+}
+
+/* Run a cached statement that returns a single integer.  The statement
+ * is reset afterwards, so it doesn't hold a read lock on the database. */
+int
+sql_step_int(sqlite3_stmt *stmt)
+{
+	int ret;
+
+	switch (sql_step(stmt))
+	{
+		case SQLITE_DONE:
+			ret = 0;
+			break;
+		case SQLITE_ROW:
+			ret = sqlite3_column_int(stmt, 0);
+			break;
+		default:
+			DPRINTF(E_WARN, L_DB_SQL, "%s: step failed: %s\n%s\n", __func__,
+				sqlite3_errmsg(sqlite3_db_handle(stmt)), sqlite3_sql(stmt));
+			ret = -1;
+			break;
+	}
+	sqlite3_reset(stmt);
+	sqlite3_clear_bindings(stmt);
+
+	return ret;
+}
+
+/* Like sqlite3_exec(), but for an already prepared (and bound) statement */
+int
+sql_step_callback(sqlite3_stmt *stmt, int (*callback)(void *, int, char **, char **), void *arg)
+{
+	char **argv;
+	int argc, i, result;
+
+	argc = sqlite3_column_count(stmt);
+	argv = calloc(argc * 2, sizeof(char *));
+	if (!argv)
+		result = SQLITE_NOMEM;
+	else
+	{
+		for (i = 0; i < argc; i++)
+			argv[argc + i] = (char *)sqlite3_column_name(stmt, i);
+		while ((result = sql_step(stmt)) == SQLITE_ROW)
+		{
+			for (i = 0; i < argc; i++)
+				argv[i] = (char *)sqlite3_column_text(stmt, i);
+			if (callback(arg, argc, argv, argv + argc) != 0)
+			{
+				result = SQLITE_ABORT;
+				break;
+			}
+		}
+		free(argv);
+	}
+	if (result == SQLITE_DONE)
+		result = SQLITE_OK;
+	else if (result != SQLITE_ABORT)
+		DPRINTF(E_WARN, L_DB_SQL, "%s: step failed: %s\n%s\n", __func__,
+			sqlite3_errmsg(sqlite3_db_handle(stmt)), sqlite3_sql(stmt));
+	sqlite3_reset(stmt);
+	sqlite3_clear_bindings(stmt);
+
+	return result;
+}
+
 int
 db_upgrade(sqlite3 *db)
 {
@@ -272,9 +511,6 @@ db_upgrade(sqlite3 *db)
 		return -2;
 	if (db_vers < 1)
 		return -1;
-	if (db_vers < 9)
-		return db_vers;
-	sql_exec(db, "PRAGMA user_version = %d", DB_VERSION);
 
-	return 0;
+	return db_vers;
 }
@@ -34,11 +34,27 @@
 #define sqlite3_prepare_v2 sqlite3_prepare
 #endif
 
+/* Checkpoint while streaming only once the WAL grows past this */
+#define WAL_SIZE_LIMIT (64*1024*1024)
+
+/* Commit a batch of writes after this many files, or this many ms */
+#define SQL_BATCH_FILES 500
+#define SQL_BATCH_MSEC  1000
+
+int sql_open(const char *path, sqlite3 **db);
+int sql_changes(sqlite3 *db);
+void sql_batch_begin(sqlite3 *db);
+void sql_batch_step(sqlite3 *db);
+void sql_batch_end(sqlite3 *db);
 int sql_exec(sqlite3 *db, const char *fmt, ...);
 int sql_get_table(sqlite3 *db, const char *zSql, char ***pazResult, int *pnRow, int *pnColumn);
 int sql_get_int_field(sqlite3 *db, const char *fmt, ...);
 int64_t sql_get_int64_field(sqlite3 *db, const char *fmt, ...);
 char * sql_get_text_field(sqlite3 *db, const char *fmt, ...);
+sqlite3_stmt *sql_prepare_cached(sqlite3 *db, const char *sql);
+void sql_finalize_cached(sqlite3 *db);
+int sql_step_int(sqlite3_stmt *stmt);
+int sql_step_callback(sqlite3_stmt *stmt, int (*callback)(void *, int, char **, char **), void *arg);
 int db_upgrade(sqlite3 *db);
 
 #endif
@@ -0,0 +1,194 @@
+/* MiniDLNA media server
+ *
+ * This file is part of MiniDLNA.
+ *
+ * MiniDLNA is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * MiniDLNA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MiniDLNA. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sqlite3.h>
+
+#include "config.h"
+#include "upnpglobalvars.h"
+#include "upnphttp.h"
+#include "upnpsoap.h"
+#include "search.h"
+#include "utils.h"
+#include "scanner_sqlite.h"
+
+/* Runs sorted Searches the way SearchContentDirectory() builds them,
+ * against a small database with the scanner's schema, and checks that the
+ * common Browse orders come straight from an index. */
+
+static const char *fill_sql =
+	"INSERT into DETAILS (ID, TITLE, MIME) values (1, 'Charlie', 'audio/mpeg');"
+	"INSERT into DETAILS (ID, TITLE, MIME) values (2, 'alpha', 'audio/mpeg');"
+	"INSERT into DETAILS (ID, TITLE, MIME) values (3, 'Bravo', 'audio/mpeg');"
+	"INSERT into OBJECTS (OBJECT_ID, PARENT_ID, CLASS) values ('0', '-1', 'container.storageFolder');"
+	"INSERT into OBJECTS (OBJECT_ID, PARENT_ID, CLASS) values ('1', '0', 'container.storageFolder');"
+	"INSERT into OBJECTS (OBJECT_ID, PARENT_ID, CLASS) values ('1$4', '1', 'container.storageFolder');"
+	"INSERT into OBJECTS (OBJECT_ID, PARENT_ID, CLASS, DETAIL_ID) values ('1$4$0', '1$4', 'item.audioItem.musicTrack', 1);"
+	"INSERT into OBJECTS (OBJECT_ID, PARENT_ID, CLASS, DETAIL_ID) values ('1$4$1', '1$4', 'item.audioItem.musicTrack', 2);"
+	"INSERT into OBJECTS (OBJECT_ID, PARENT_ID, CLASS, DETAIL_ID) values ('1$4$2', '1$4', 'item.audioItem.musicTrack', 3);";
+
+static int
+run_search(sqlite3 *db, const char *ContainerID, const char *SortCriteria, const char *expect)
+{
+	struct search_criteria criteria;
+	char sort[64], titles[256] = "";
+	char *subtree, *orderBy, *sql;
+	const char *title;
+	sqlite3_stmt *stmt;
+	int n, ret;
+
+	if (search_parse("upnp:class derivedfrom &quot;object.item.audioItem&quot;", &criteria) != 0)
+		return 1;
+	n = criteria.nparams;
+	if (strcmp(ContainerID, "0") == 0)
+		ContainerID = "*";
+	strncpyt(sort, SortCriteria, sizeof(sort));
+	orderBy = parse_sort_criteria(sort, SORT_RESULT_COLUMNS, &ret);
+	subtree = search_subtree(ContainerID, &criteria);
+	sql = search_select(ContainerID, subtree, &criteria, "group by DETAIL_ID", orderBy);
+	ret = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
+	if (ret != SQLITE_OK)
+	{
+		printf("FAIL %s %s: %s\n", ContainerID, SortCriteria, sqlite3_errmsg(db));
+		goto done;
+	}
+	search_bind(stmt, &criteria);
+	if (*ContainerID != '*')
+		sqlite3_bind_text(stmt, n+1, ContainerID, -1, SQLITE_STATIC);
+	sqlite3_bind_int(stmt, n+2, 0);
+	sqlite3_bind_int(stmt, n+3, -1);
+	while (sqlite3_step(stmt) == SQLITE_ROW)
+	{
+		title = (const char *)sqlite3_column_text(stmt, 6);
+		if (titles[0])
+			strncat(titles, ",", sizeof(titles) - strlen(titles) - 1);
+		strncat(titles, title ? title : "", sizeof(titles) - strlen(titles) - 1);
+	}
+	sqlite3_finalize(stmt);
+	ret = strcmp(titles, expect) != 0;
+	printf("%s %s %s: %s\n", ret ? "FAIL" : "ok", ContainerID, SortCriteria, titles);
+done:
+	sqlite3_free(sql);
+	sqlite3_free(subtree);
+	free(orderBy);
+	search_free(&criteria);
+
+	return ret != 0;
+}
+
+/* Plan a Browse the way BrowseContentDirectory() builds it, with orderBy
+ * followed by the o.ID tiebreaker and after as the keyset seek if any. */
+static int
+check_plan(sqlite3 *db, const char *orderBy, const char *after, const char *index)
+{
+	char order[256], *sql;
+	const char *detail;
+	sqlite3_stmt *stmt;
+	int desc, found = 0, sorted = 0, ret;
+
+	desc = strlen(orderBy) > 5 && strcmp(orderBy + strlen(orderBy) - 5, " DESC") == 0;
+	snprintf(order, sizeof(order), "%s, o.ID%s", orderBy, desc ? " DESC" : "");
+	sql = sqlite3_mprintf("EXPLAIN QUERY PLAN " BROWSE_SELECT_COLUMNS
+	                      "from OBJECTS o left join DETAILS d on (d.ID = o.DETAIL_ID)"
+	                      " where o.PARENT = (SELECT ID from OBJECTS where OBJECT_ID = ?)"
+	                      "%s%s %s limit ?, ?;", after ? " and " : "", after ? after : "", order);
+	ret = sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
+	sqlite3_free(sql);
+	if (ret != SQLITE_OK)
+	{
+		printf("FAIL plan %s: %s\n", order, sqlite3_errmsg(db));
+		return 1;
+	}
+	while (sqlite3_step(stmt) == SQLITE_ROW)
+	{
+		detail = (const char *)sqlite3_column_text(stmt, 3);
+		if (!detail)
+			continue;
+		if (strstr(detail, "TEMP B-TREE"))
+			sorted = 1;
+		if (strstr(detail, index))
+			found = 1;
+	}
+	sqlite3_finalize(stmt);
+	ret = sorted || !found;
+	printf("%s plan %s%s%s: %s%s\n", ret ? "FAIL" : "ok", order, after ? " after " : "", after ? after : "",
+	       found ? index : "no index", sorted ? ", temp b-tree" : "");
+
+	return ret;
+}
+
+static int
+check_sort_plan(sqlite3 *db, const char *SortCriteria, const char *after, const char *index)
+{
+	char sort[64], *orderBy;
+	int ret;
+
+	strncpyt(sort, SortCriteria, sizeof(sort));
+	orderBy = parse_sort_criteria(sort, 0, &ret);
+	if (!orderBy)
+	{
+		printf("FAIL plan %s: no order\n", SortCriteria);
+		return 1;
+	}
+	ret = check_plan(db, orderBy, after, index);
+	free(orderBy);
+
+	return ret;
+}
+
+int
+main(int argc, char **argv)
+{
+	sqlite3 *db;
+	int fails = 0;
+
+	if (sqlite3_open(":memory:", &db) != SQLITE_OK ||
+	    sqlite3_exec(db, create_objectTable_sqlite, NULL, NULL, NULL) != SQLITE_OK ||
+	    sqlite3_exec(db, create_detailTable_sqlite, NULL, NULL, NULL) != SQLITE_OK ||
+	    sqlite3_exec(db, create_objectTriggers_sqlite, NULL, NULL, NULL) != SQLITE_OK ||
+	    sqlite3_exec(db, "create INDEX IDX_OBJECTS_PARENT ON OBJECTS(PARENT, NAME);", NULL, NULL, NULL) != SQLITE_OK ||
+	    sqlite3_exec(db, create_sortIndexes_sqlite, NULL, NULL, NULL) != SQLITE_OK ||
+	    sqlite3_exec(db, fill_sql, NULL, NULL, NULL) != SQLITE_OK)
+	{
+		printf("FAIL setting up the database: %s\n", sqlite3_errmsg(db));
+		return 1;
+	}
+
+	fails += run_search(db, "0", "+dc:title", "alpha,Bravo,Charlie");
+	fails += run_search(db, "0", "-dc:title", "Charlie,Bravo,alpha");
+	/* Below the root, the container itself is added with a UNION ALL */
+	fails += run_search(db, "1$4", "+dc:title", "alpha,Bravo,Charlie");
+	fails += run_search(db, "1$4", "-dc:title", "Charlie,Bravo,alpha");
+	fails += run_search(db, "1$4", "+upnp:class,+dc:date", "alpha,Bravo,Charlie");
+	fails += run_search(db, "1$4", "+upnp:originalTrackNumber", "alpha,Bravo,Charlie");
+
+	/* The default order, then FLAG_FORCE_SORT's and the LG one */
+	fails += check_plan(db, "order by o.NAME", NULL, "IDX_OBJECTS_PARENT");
+	fails += check_plan(db, "order by o.CLASS, o.SORT_DISC, o.SORT_TRACK, o.SORT_TITLE", NULL, "IDX_SORT_CLASS_TRACK");
+	fails += check_plan(db, "order by o.CLASS, o.SORT_TITLE", NULL, "IDX_SORT_CLASS_TITLE");
+	fails += check_sort_plan(db, "+dc:title", NULL, "IDX_SORT_TITLE");
+	fails += check_sort_plan(db, "-dc:title", NULL, "IDX_SORT_TITLE");
+	fails += check_sort_plan(db, "+dc:date", NULL, "IDX_SORT_DATE");
+	/* The keyset seeks for the next page */
+	fails += check_plan(db, "order by o.NAME", "(o.NAME, o.ID) > (?1, ?2)", "IDX_OBJECTS_PARENT");
+	fails += check_sort_plan(db, "+dc:title", "(o.SORT_TITLE, o.ID) > (?1, ?2)", "IDX_SORT_TITLE");
+
+	sqlite3_close(db);
+
+	return fails ? 1 : 0;
+}
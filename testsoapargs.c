@@ -0,0 +1,180 @@
+/* MiniDLNA media server
+ *
+ * This file is part of MiniDLNA.
+ *
+ * MiniDLNA is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ *
+ * MiniDLNA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with MiniDLNA. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "upnpreplyparse.h"
+
+/* Checks that ParseSoapArgs() finds the same arguments as ParseNameValue()
+ * did in request bodies recorded from clients.  Given a number of
+ * iterations, it also times both, lookups and clean up included. */
+
+static const char *arg_names[SOAP_ARG_COUNT] = {
+	"ObjectID", "ContainerID", "BrowseFlag", "Filter", "StartingIndex",
+	"RequestedCount", "SortCriteria", "SearchCriteria", "ConnectionID",
+	"DeviceID", "varName", "PosSecond"
+};
+
+static const struct {
+	const char *name;
+	uint32_t flags;
+	const char *body;
+} bodies[] = {
+	{ "Browse", 0,
+	  "<?xml version=\"1.0\" encoding=\"utf-8\"?>\r\n"
+	  "<s:Envelope xmlns:s=\"http://schemas.xmlsoap.org/soap/envelope/\" "
+	  "s:encodingStyle=\"http://schemas.xmlsoap.org/soap/encoding/\">"
+	  "<s:Body><u:Browse xmlns:u=\"urn:schemas-upnp-org:service:ContentDirectory:1\">"
+	  "<ObjectID>64$1$2</ObjectID>"
+	  "<BrowseFlag>BrowseDirectChildren</BrowseFlag>"
+	  "<Filter>dc:title,res,res@duration,res@size,upnp:albumArtURI,upnp:album,upnp:artist</Filter>"
+	  "<StartingIndex>200</StartingIndex>"
+	  "<RequestedCount>100</RequestedCount>"
+	  "<SortCriteria>+upnp:originalTrackNumber,+dc:title</SortCriteria>"
+	  "</u:Browse></s:Body></s:Envelope>\r\n" },
+	{ "Browse metadata", 0,
+	  "<?xml version=\"1.0\"?>\n"
+	  "<SOAP-ENV:Envelope xmlns:SOAP-ENV=\"http://schemas.xmlsoap.org/soap/envelope/\" "
+	  "SOAP-ENV:encodingStyle=\"http://schemas.xmlsoap.org/soap/encoding/\">\n"
+	  "  <SOAP-ENV:Body>\n"
+	  "    <m:Browse xmlns:m=\"urn:schemas-upnp-org:service:ContentDirectory:1\">\n"
+	  "      <ObjectID xmlns:dt=\"urn:schemas-microsoft-com:datatypes\" dt:dt=\"string\">0</ObjectID>\n"
+	  "      <BrowseFlag xmlns:dt=\"urn:schemas-microsoft-com:datatypes\" dt:dt=\"string\">BrowseMetadata</BrowseFlag>\n"
+	  "      <Filter xmlns:dt=\"urn:schemas-microsoft-com:datatypes\" dt:dt=\"string\">*</Filter>\n"
+	  "      <StartingIndex xmlns:dt=\"urn:schemas-microsoft-com:datatypes\" dt:dt=\"ui4\">0</StartingIndex>\n"
+	  "      <RequestedCount xmlns:dt=\"urn:schemas-microsoft-com:datatypes\" dt:dt=\"ui4\">0</RequestedCount>\n"
+	  "      <SortCriteria xmlns:dt=\"urn:schemas-microsoft-com:datatypes\" dt:dt=\"string\"/>\n"
+	  "    </m:Browse>\n"
+	  "  </SOAP-ENV:Body>\n"
+	  "</SOAP-ENV:Envelope>\n" },
+	{ "Search", 0,
+	  "<?xml version=\"1.0\" encoding=\"utf-8\"?>"
+	  "<s:Envelope xmlns:s=\"http://schemas.xmlsoap.org/soap/envelope/\" "
+	  "s:encodingStyle=\"http://schemas.xmlsoap.org/soap/encoding/\">"
+	  "<s:Body><u:Search xmlns:u=\"urn:schemas-upnp-org:service:ContentDirectory:1\">"
+	  "<ContainerID>0</ContainerID>"
+	  "<SearchCriteria>(upnp:class derivedfrom &quot;object.item.audioItem&quot;) and "
+	  "(dc:title contains &quot;love&quot; or upnp:artist contains &quot;love&quot;)</SearchCriteria>"
+	  "<Filter>*</Filter>"
+	  "<StartingIndex>0</StartingIndex>"
+	  "<RequestedCount>50</RequestedCount>"
+	  "<SortCriteria>+dc:title</SortCriteria>"
+	  "</u:Search></s:Body></s:Envelope>" },
+	{ "GetCurrentConnectionInfo", XML_STORE_EMPTY_FL,
+	  "<?xml version=\"1.0\" encoding=\"utf-8\"?>"
+	  "<s:Envelope xmlns:s=\"http://schemas.xmlsoap.org/soap/envelope/\" "
+	  "s:encodingStyle=\"http://schemas.xmlsoap.org/soap/encoding/\">"
+	  "<s:Body><u:GetCurrentConnectionInfo xmlns:u=\"urn:schemas-upnp-org:service:ConnectionManager:1\">"
+	  "<ConnectionID>0</ConnectionID>"
+	  "</u:GetCurrentConnectionInfo></s:Body></s:Envelope>" }
+};
+
+#define NBODIES (sizeof(bodies) / sizeof(bodies[0]))
+
+static int
+check_body(int n)
+{
+	struct NameValueParserData data;
+	struct SoapArgs args;
+	char buf[4096];
+	const char *old;
+	int len = strlen(bodies[n].body), i, ret = 0;
+
+	ParseNameValue(bodies[n].body, len, &data, bodies[n].flags);
+	memcpy(buf, bodies[n].body, len + 1);
+	ParseSoapArgs(buf, len, &args, bodies[n].flags);
+	for (i = 0; i < SOAP_ARG_COUNT; i++)
+	{
+		old = GetValueFromNameValueList(&data, arg_names[i]);
+		if (!old && !args.value[i])
+			continue;
+		if (!old || !args.value[i] || strcmp(old, args.value[i]) != 0)
+		{
+			printf("FAIL %s %s: \"%s\", was \"%s\"\n", bodies[n].name, arg_names[i],
+			       args.value[i] ? args.value[i] : "(null)", old ? old : "(null)");
+			ret = 1;
+		}
+	}
+	ClearNameValueList(&data);
+	if (!ret)
+		printf("ok %s\n", bodies[n].name);
+
+	return ret;
+}
+
+static double
+elapsed_ns(const struct timespec *t0, int iterations)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return ((t.tv_sec - t0->tv_sec) * 1e9 + (t.tv_nsec - t0->tv_nsec)) / iterations;
+}
+
+static void
+bench_body(int n, int iterations)
+{
+	struct NameValueParserData data;
+	struct SoapArgs args;
+	struct timespec t0;
+	char buf[4096];
+	volatile const char *sink;
+	double old_ns, new_ns;
+	int len = strlen(bodies[n].body), i, j;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (i = 0; i < iterations; i++)
+	{
+		ParseNameValue(bodies[n].body, len, &data, bodies[n].flags);
+		for (j = 0; j < SOAP_ARG_COUNT; j++)
+			sink = GetValueFromNameValueList(&data, arg_names[j]);
+		ClearNameValueList(&data);
+	}
+	old_ns = elapsed_ns(&t0, iterations);
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (i = 0; i < iterations; i++)
+	{
+		/* The copy stands in for reading the request into req_buf */
+		memcpy(buf, bodies[n].body, len + 1);
+		ParseSoapArgs(buf, len, &args, bodies[n].flags);
+		for (j = 0; j < SOAP_ARG_COUNT; j++)
+			sink = args.value[j];
+	}
+	new_ns = elapsed_ns(&t0, iterations);
+	(void)sink;
+
+	printf("%s (%d bytes): ParseNameValue %.0f ns, ParseSoapArgs %.0f ns\n",
+	       bodies[n].name, len, old_ns, new_ns);
+}
+
+int
+main(int argc, char **argv)
+{
+	int iterations = argc > 1 ? atoi(argv[1]) : 0;
+	int fails = 0;
+	unsigned int n;
+
+	for (n = 0; n < NBODIES; n++)
+		fails += check_body(n);
+	for (n = 0; iterations > 0 && n < NBODIES; n++)
+		bench_body(n, iterations);
+
+	return fails ? 1 : 0;
+}
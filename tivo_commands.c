@@ -402,7 +402,8 @@ SendContainer(struct upnphttp *h, const char *objectID, int itemStart, int itemC
 
 	if( recurse )
 	{
-		which = sqlite3_mprintf("OBJECT_ID glob '%q$*'", objectID);
+		/* All IDs starting with "<objectID>$", as an index range */
+		which = sqlite3_mprintf("(OBJECT_ID >= '%q$' and OBJECT_ID < '%q%%')", objectID, objectID);
 		strcpy(groupBy, "group by DETAIL_ID");
 	}
 	else
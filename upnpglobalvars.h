@@ -66,7 +66,7 @@
 #endif
 
 #define USE_FORK 1
-#define DB_VERSION 9
+#define DB_VERSION 14
 
 #ifdef ENABLE_NLS
 #define _(string) gettext(string)
@@ -188,6 +188,10 @@ extern uint32_t runtime_flags;
 #define SYSTEMD_MASK          0x0010
 #define MERGE_MEDIA_DIRS_MASK 0x0020
 #define WIDE_LINKS_MASK       0x0040
+#define FTS_SEARCH_MASK       0x0080
+#define BROWSE_SNAPSHOT_MASK  0x0100
+#define RESCAN_MASK           0x0200
+#define FANOTIFY_MASK         0x0400
 
 #define SETFLAG(mask)	runtime_flags |= mask
 #define GETFLAG(mask)	(runtime_flags & mask)
@@ -217,7 +221,8 @@ extern int sssdp;
 extern const char *minissdpdsocketpath;
 
 /* UPnP-A/V [DLNA] */
-extern sqlite3 *db;
+/* Each thread talks to the database through its own connection */
+extern __thread sqlite3 *db;
 #define FRIENDLYNAME_MAX_LEN 64
 extern char friendly_name[];
 extern char db_path[];
@@ -225,6 +230,8 @@ extern char log_path[];
 extern struct media_dir_s *media_dirs;
 extern struct album_art_name_s *album_art_names;
 extern short int scanning;
+/* The scanner is only checking for changes made while we weren't running */
+extern short int updating;
 extern volatile short int quitting;
 extern volatile uint32_t updateID;
 extern const char *force_sort_criteria;
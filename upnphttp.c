@@ -81,6 +81,7 @@
 #include "clients.h"
 #include "process.h"
 #include "sendfile.h"
+#include "inotify.h"
 
 #define MAX_BUFFER_SIZE 2147483647
 #define MIN_BUFFER_SIZE 65536
@@ -609,6 +610,9 @@ SendResp_presentation(struct upnphttp * h)
 	struct string_s str;
 	char body[4096];
 	int a, v, p, i;
+#ifdef HAVE_INOTIFY
+	struct watch_stats ws;
+#endif
 
 	INIT_STR(str, body);
 
@@ -634,6 +638,20 @@ SendResp_presentation(struct upnphttp * h)
 		strcatf(&str,
 			"<br><i>* Media scan in progress</i><br>");
 
+#ifdef HAVE_INOTIFY
+	inotify_watch_stats(&ws);
+	if (ws.backend)
+		strcatf(&str,
+			"<h3>File watching</h3>"
+			"<table border=1 cellpadding=10>"
+			"<tr><td>Using</td><td>%s</td></tr>"
+			"<tr><td>%s</td><td>%u</td></tr>"
+			"<tr><td>Memory used</td><td>%lu KiB</td></tr>"
+			"</table>", ws.backend,
+			(strcmp(ws.backend, "fanotify") == 0 ? "Media directories marked" : "Directories watched"),
+			ws.watches, (unsigned long)((ws.bytes + 1023) / 1024));
+#endif
+
 	strcatf(&str,
 		"<h3>Connected clients</h3>"
 		"<table border=1 cellpadding=10>"
@@ -1288,6 +1306,8 @@ send_file(struct upnphttp * h, int sendfd, off_t offset, off_t end_offset)
 			else
 			{
 				//DPRINTF(E_DEBUG, L_HTTP, "sent %lld bytes to %d. offset is now %lld.\n", ret, h->socket, offset);
+				if (stream_stats)
+					__sync_fetch_and_add(&stream_stats->sent, ret);
 				continue;
 			}
 		}
@@ -1314,6 +1334,8 @@ send_file(struct upnphttp * h, int sendfd, off_t offset, off_t end_offset)
 				break;
 		}
 		offset += ret;
+		if (stream_stats)
+			__sync_fetch_and_add(&stream_stats->sent, ret);
 	}
 	free(buf);
 }
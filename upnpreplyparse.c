@@ -98,6 +98,101 @@ ClearNameValueList(struct NameValueParserData * pdata)
     }
 }
 
+#define SOAP_ARG(n) { #n, sizeof(#n) - 1 }
+static const struct {
+    const char * name;
+    int len;
+} soap_args[SOAP_ARG_COUNT] = {
+    SOAP_ARG(ObjectID),
+    SOAP_ARG(ContainerID),
+    SOAP_ARG(BrowseFlag),
+    SOAP_ARG(Filter),
+    SOAP_ARG(StartingIndex),
+    SOAP_ARG(RequestedCount),
+    SOAP_ARG(SortCriteria),
+    SOAP_ARG(SearchCriteria),
+    SOAP_ARG(ConnectionID),
+    SOAP_ARG(DeviceID),
+    SOAP_ARG(varName),
+    SOAP_ARG(PosSecond)
+};
+
+/* Single pass over a SOAP request body that picks out the arguments we
+ * know about, without copying them.  The values are terminated in place,
+ * so the buffer is modified.  As with ParseNameValue(), element namespaces
+ * are ignored, the last occurrence of an element wins, and empty values
+ * are only returned with XML_STORE_EMPTY_FL.  Returns the number of
+ * arguments found. */
+int
+ParseSoapArgs(char * buffer, int bufsize,
+              struct SoapArgs * args, uint32_t flags)
+{
+    char * p = buffer;
+    char * end = buffer + bufsize;
+    char * name, * value;
+    int namelen, i, found = 0;
+
+    memset(args, 0, sizeof(*args));
+    while(p < end - 1 && (p = memchr(p, '<', end - 1 - p)))
+    {
+        if(p[1] == '?' || p[1] == '/' || p[1] == '!')
+        {
+            p++;
+            continue;
+        }
+        name = ++p;
+        while(p < end && !IS_WHITE_SPACE(*p) && *p != '>' && *p != '/')
+        {
+            if(*p++ == ':')
+                name = p;
+        }
+        namelen = p - name;
+        /* skip over any attributes */
+        while(p < end && *p != '>')
+        {
+            if(*p == '"' || *p == '\'')
+            {
+                char sep = *p++;
+                while(p < end && *p != sep)
+                    p++;
+            }
+            p++;
+        }
+        if(p >= end)
+            break;
+        if(p[-1] == '/' || namelen == 0)
+            continue;
+        p++;
+        while(p < end && IS_WHITE_SPACE(*p))
+            p++;
+        value = p;
+        if(!(p = memchr(p, '<', end - p)))
+            break;
+        if(p == value && !(flags & XML_STORE_EMPTY_FL))
+            continue;
+        for(i = 0; i < SOAP_ARG_COUNT; i++)
+        {
+            if(soap_args[i].len == namelen &&
+               memcmp(soap_args[i].name, name, namelen) == 0)
+            {
+                if(!args->value[i])
+                    found++;
+                args->value[i] = value;
+                args->len[i] = p - value;
+                break;
+            }
+        }
+    }
+    /* Only now that the closing tags have been seen can they be overwritten */
+    for(i = 0; i < SOAP_ARG_COUNT; i++)
+    {
+        if(args->value[i])
+            args->value[i][args->len[i]] = '\0';
+    }
+
+    return found;
+}
+
 char * 
 GetValueFromNameValueList(struct NameValueParserData * pdata,
                           const char * Name)
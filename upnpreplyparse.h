@@ -49,6 +49,30 @@ struct NameValueParserData {
 
 #define XML_STORE_EMPTY_FL  0x01
 
+/* SOAP action arguments known to ParseSoapArgs() */
+enum SoapArg {
+    SOAP_ObjectID,
+    SOAP_ContainerID,
+    SOAP_BrowseFlag,
+    SOAP_Filter,
+    SOAP_StartingIndex,
+    SOAP_RequestedCount,
+    SOAP_SortCriteria,
+    SOAP_SearchCriteria,
+    SOAP_ConnectionID,
+    SOAP_DeviceID,
+    SOAP_varName,
+    SOAP_PosSecond,
+    SOAP_ARG_COUNT
+};
+
+/* Each value points into the parsed buffer, and is NUL-terminated there.
+ * Arguments that were not found are NULL. */
+struct SoapArgs {
+    char * value[SOAP_ARG_COUNT];
+    int len[SOAP_ARG_COUNT];
+};
+
 /* ParseNameValue() */
 void
 ParseNameValue(const char * buffer, int bufsize,
@@ -58,6 +82,10 @@ ParseNameValue(const char * buffer, int bufsize,
 void
 ClearNameValueList(struct NameValueParserData * pdata);
 
+int
+ParseSoapArgs(char * buffer, int bufsize,
+              struct SoapArgs * args, uint32_t flags);
+
 /* GetValueFromNameValueList() */
 char *
 GetValueFromNameValueList(struct NameValueParserData * pdata,
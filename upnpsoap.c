@@ -69,6 +69,8 @@
 #include "upnpreplyparse.h"
 #include "getifaddr.h"
 #include "scanner.h"
+#include "search.h"
+#include "snapshot.h"
 #include "sql.h"
 #include "log.h"
 
@@ -191,11 +193,11 @@ IsAuthorizedValidated(struct upnphttp * h, const char * action)
 		"</u:%sResponse>";
 
 	char body[512];
-	struct NameValueParserData data;
+	struct SoapArgs data;
 	const char * id;
 
-	ParseNameValue(h->req_buf + h->req_contentoff, h->req_contentlen, &data, XML_STORE_EMPTY_FL);
-	id = GetValueFromNameValueList(&data, "DeviceID");
+	ParseSoapArgs(h->req_buf + h->req_contentoff, h->req_contentlen, &data, XML_STORE_EMPTY_FL);
+	id = data.value[SOAP_DeviceID];
 	if(id)
 	{
 		int bodylen;
@@ -206,8 +208,6 @@ IsAuthorizedValidated(struct upnphttp * h, const char * action)
 	}
 	else
 		SoapError(h, 402, "Invalid Args");
-
-	ClearNameValueList(&data);	
 }
 
 static void
@@ -339,13 +339,13 @@ GetCurrentConnectionInfo(struct upnphttp * h, const char * action)
 		"</u:%sResponse>";
 
 	char body[sizeof(resp)+128];
-	struct NameValueParserData data;
+	struct SoapArgs data;
 	const char *id_str;
 	int id;
 	char *endptr = NULL;
 
-	ParseNameValue(h->req_buf + h->req_contentoff, h->req_contentlen, &data, XML_STORE_EMPTY_FL);
-	id_str = GetValueFromNameValueList(&data, "ConnectionID");
+	ParseSoapArgs(h->req_buf + h->req_contentoff, h->req_contentlen, &data, XML_STORE_EMPTY_FL);
+	id_str = data.value[SOAP_ConnectionID];
 	DPRINTF(E_INFO, L_HTTP, "GetCurrentConnectionInfo(%s)\n", id_str);
 	if(id_str)
 		id = strtol(id_str, &endptr, 10);
@@ -365,7 +365,6 @@ GetCurrentConnectionInfo(struct upnphttp * h, const char * action)
 			action);	
 		BuildSendAndCloseSoapResp(h, body, bodylen);
 	}
-	ClearNameValueList(&data);	
 }
 
 /* Standard DLNA/UPnP filter flags */
@@ -564,104 +563,6 @@ set_filter_flags(char *filter, struct upnphttp *h)
 	return flags;
 }
 
-static char *
-parse_sort_criteria(char *sortCriteria, int *error)
-{
-	char *order = NULL;
-	char *item, *saveptr;
-	int i, ret, reverse, title_sorted = 0;
-	struct string_s str;
-	*error = 0;
-
-	if( force_sort_criteria )
-		sortCriteria = strdup(force_sort_criteria);
-	if( !sortCriteria )
-		return NULL;
-
-	if( (item = strtok_r(sortCriteria, ",", &saveptr)) )
-	{
-		order = malloc(4096);
-		str.data = order;
-		str.size = 4096;
-		str.off = 0;
-		strcatf(&str, "order by ");
-	}
-	for( i = 0; item != NULL; i++ )
-	{
-		reverse=0;
-		if( i )
-			strcatf(&str, ", ");
-		if( *item == '+' )
-		{
-			item++;
-		}
-		else if( *item == '-' )
-		{
-			reverse = 1;
-			item++;
-		}
-		else
-		{
-			DPRINTF(E_ERROR, L_HTTP, "No order specified [%s]\n", item);
-			goto bad_direction;
-		}
-		if( strcasecmp(item, "upnp:class") == 0 )
-		{
-			strcatf(&str, "o.CLASS");
-		}
-		else if( strcasecmp(item, "dc:title") == 0 )
-		{
-			strcatf(&str, "d.TITLE");
-			title_sorted = 1;
-		}
-		else if( strcasecmp(item, "dc:date") == 0 )
-		{
-			strcatf(&str, "d.DATE");
-		}
-		else if( strcasecmp(item, "upnp:originalTrackNumber") == 0 )
-		{
-			strcatf(&str, "d.DISC, d.TRACK");
-		}
-		else if( strcasecmp(item, "upnp:album") == 0 )
-		{
-			strcatf(&str, "d.ALBUM");
-		}
-		else
-		{
-			DPRINTF(E_ERROR, L_HTTP, "Unhandled SortCriteria [%s]\n", item);
-		bad_direction:
-			*error = -1;
-			if( i )
-			{
-				ret = strlen(order);
-				order[ret-2] = '\0';
-			}
-			i--;
-			goto unhandled_order;
-		}
-
-		if( reverse )
-			strcatf(&str, " DESC");
-		unhandled_order:
-		item = strtok_r(NULL, ",", &saveptr);
-	}
-	if( i <= 0 )
-	{
-		free(order);
-		if( force_sort_criteria )
-			free(sortCriteria);
-		return NULL;
-	}
-	/* Add a "tiebreaker" sort order */
-	if( !title_sorted )
-		strcatf(&str, ", TITLE ASC");
-
-	if( force_sort_criteria )
-		free(sortCriteria);
-
-	return order;
-}
-
 inline static void
 add_resized_res(int srcw, int srch, int reqw, int reqh, char *dlna_pn,
                 char *detailID, struct Response *args)
@@ -744,10 +645,13 @@ get_child_count(const char *object, struct magic_container_s *magic)
 
 	if (magic && magic->child_count)
 		ret = sql_get_int_field(db, "SELECT count(*) from %s", magic->child_count);
-	else if (magic && magic->objectid && *(magic->objectid))
-		ret = sql_get_int_field(db, "SELECT count(*) from OBJECTS where PARENT_ID = '%s';", *(magic->objectid));
 	else
-		ret = sql_get_int_field(db, "SELECT count(*) from OBJECTS where PARENT_ID = '%s';", object);
+	{
+		if (magic && magic->objectid && *(magic->objectid))
+			object = *(magic->objectid);
+		ret = sql_get_int_field(db, "SELECT count(*) from OBJECTS where PARENT = "
+		                            "(SELECT ID from OBJECTS where OBJECT_ID = '%q')", object);
+	}
 
 	return (ret > 0) ? ret : 0;
 }
@@ -761,12 +665,6 @@ object_exists(const char *object)
 	return (ret > 0);
 }
 
-#define COLUMNS "o.DETAIL_ID, o.CLASS," \
-                " d.SIZE, d.TITLE, d.DURATION, d.BITRATE, d.SAMPLERATE, d.ARTIST," \
-                " d.ALBUM, d.GENRE, d.COMMENT, d.CHANNELS, d.TRACK, d.DATE, d.RESOLUTION," \
-                " d.THUMBNAIL, d.CREATOR, d.DLNA_PN, d.MIME, d.ALBUM_ART, d.ROTATION, d.DISC "
-#define SELECT_COLUMNS "SELECT o.OBJECT_ID, o.PARENT_ID, o.REF_ID, " COLUMNS
-
 #define NON_ZERO(x) (x && atoi(x))
 #define IS_ZERO(x) (!x || !atoi(x))
 
@@ -1173,6 +1071,225 @@ callback(void *args, int argc, char **argv, char **azColName)
 	return 0;
 }
 
+/* Remember where the last page of a Browse ended, so that a client asking
+ * for the next page can seek past the last row it got, instead of making
+ * SQLite sort and skip over all of the earlier rows again. */
+#define BROWSE_CURSOR_CACHE_SIZE 16
+#define BROWSE_MAX_KEYS 8
+
+/* The cursor values are ?1 .. ?nkeys.  Everything else that changes from
+ * page to page is bound after them, so that each page reuses the same
+ * cached statement. */
+#define BROWSE_PARAM_ID (BROWSE_MAX_KEYS + 1)
+#define BROWSE_PARAM_OFFSET (BROWSE_MAX_KEYS + 2)
+#define BROWSE_PARAM_COUNT (BROWSE_MAX_KEYS + 3)
+
+struct browse_key {
+	char expr[64];
+	int desc;
+};
+
+static struct {
+	char *key;
+	unsigned int updateID;
+	int index;
+	int nkeys;
+	sqlite3_value *values[BROWSE_MAX_KEYS];
+} browse_cursors[BROWSE_CURSOR_CACHE_SIZE];
+static int browse_cursors_next;
+
+/* Split an "order by" clause into its sort keys, adding a tiebreaker so the
+ * order is total, and the last row of a page says where the next one starts. */
+static int
+browse_sort_keys(const char *orderBy, struct browse_key *keys)
+{
+	char buf[512], *item, *saveptr, *dir;
+	int n = 0;
+
+	if (!orderBy)
+	{
+		/* The order of IDX_OBJECTS_PARENT */
+		strcpy(keys[0].expr, "o.NAME");
+		strcpy(keys[1].expr, "o.ID");
+		keys[0].desc = keys[1].desc = 0;
+		return 2;
+	}
+	if (strncmp(orderBy, "order by ", 9) != 0 || strlen(orderBy + 9) >= sizeof(buf))
+		return 0;
+	strcpy(buf, orderBy + 9);
+	for (item = strtok_r(buf, ",", &saveptr); item; item = strtok_r(NULL, ",", &saveptr))
+	{
+		if (n >= BROWSE_MAX_KEYS - 1)
+			return 0;
+		while (isspace(*item))
+			item++;
+		keys[n].desc = 0;
+		dir = strrchr(item, ' ');
+		if (dir && strcasecmp(dir + 1, "DESC") == 0)
+		{
+			keys[n].desc = 1;
+			*dir = '\0';
+		}
+		else if (dir && strcasecmp(dir + 1, "ASC") == 0)
+			*dir = '\0';
+		if (strlen(item) >= sizeof(keys[n].expr))
+			return 0;
+		strcpy(keys[n].expr, item);
+		n++;
+	}
+	/* Follow the direction of the last key, so that an index can still be
+	 * scanned backwards for descending orders */
+	strcpy(keys[n].expr, "o.ID");
+	keys[n].desc = n ? keys[n-1].desc : 0;
+
+	return n + 1;
+}
+
+/* Rows that sort after the cursor row.  The cursor values are bound to
+ * ?1 .. ?nkeys, and NULLs sort first, as they do in SQLite. */
+static void
+browse_after(struct string_s *str, const struct browse_key *keys, int nkeys, sqlite3_value **values)
+{
+	int i, null, rowvalue = 1;
+
+	for (i = 0; i < nkeys; i++)
+		if (keys[i].desc || sqlite3_value_type(values[i]) == SQLITE_NULL)
+			rowvalue = 0;
+	/* The simple case can be used as an index range */
+	if (rowvalue)
+	{
+		strcatf(str, "(");
+		for (i = 0; i < nkeys; i++)
+			strcatf(str, "%s%s", i ? ", " : "", keys[i].expr);
+		strcatf(str, ") > (");
+		for (i = 0; i < nkeys; i++)
+			strcatf(str, "%s?%d", i ? ", " : "", i + 1);
+		strcatf(str, ")");
+		return;
+	}
+
+	for (i = 0; i < nkeys; i++)
+	{
+		null = (sqlite3_value_type(values[i]) == SQLITE_NULL);
+		strcatf(str, "(");
+		if (!keys[i].desc)
+		{
+			if (null)
+				strcatf(str, "%s is not NULL", keys[i].expr);
+			else
+				strcatf(str, "%s > ?%d", keys[i].expr, i + 1);
+		}
+		else
+		{
+			if (null)
+				strcatf(str, "0");
+			else
+				strcatf(str, "(%s < ?%d or %s is NULL)", keys[i].expr, i + 1, keys[i].expr);
+		}
+		if (i == nkeys - 1)
+			break;
+		if (null)
+			strcatf(str, " or (%s is NULL and ", keys[i].expr);
+		else
+			strcatf(str, " or (%s = ?%d and ", keys[i].expr, i + 1);
+	}
+	for (i = 0; i < nkeys; i++)
+		strcatf(str, i ? "))" : ")");
+}
+
+/* Like sqlite3_exec(callback), but also keeps a copy of the sort keys of the
+ * last row, which follow the ncols columns the callback knows about. */
+static int
+browse_step(sqlite3_stmt *stmt, struct Response *args, int *rows,
+            int nkeys, sqlite3_value **values)
+{
+	char *argv[32];
+	int ncols, i, ret;
+
+	ncols = sqlite3_column_count(stmt) - nkeys;
+	if (ncols > 32)
+		return SQLITE_ERROR;
+	*rows = 0;
+	while ((ret = sqlite3_step(stmt)) == SQLITE_ROW)
+	{
+		for (i = 0; i < ncols; i++)
+			argv[i] = (char *)sqlite3_column_text(stmt, i);
+		if (callback(args, ncols, argv, NULL) != 0)
+		{
+			ret = SQLITE_ABORT;
+			break;
+		}
+		for (i = 0; i < nkeys; i++)
+		{
+			sqlite3_value_free(values[i]);
+			values[i] = sqlite3_value_dup(sqlite3_column_value(stmt, ncols + i));
+		}
+		(*rows)++;
+	}
+	if (ret == SQLITE_DONE)
+		ret = SQLITE_OK;
+	sqlite3_reset(stmt);
+	sqlite3_clear_bindings(stmt);
+
+	return ret;
+}
+
+static void
+browse_cursor_save(char *key, int index, int nkeys, sqlite3_value **values)
+{
+	int i, c;
+
+	for (i = 0; i < nkeys; i++)
+	{
+		if (!values[i])
+		{
+			sqlite3_free(key);
+			return;
+		}
+	}
+	for (c = 0; c < BROWSE_CURSOR_CACHE_SIZE; c++)
+		if (browse_cursors[c].key && strcmp(browse_cursors[c].key, key) == 0)
+			break;
+	if (c == BROWSE_CURSOR_CACHE_SIZE)
+	{
+		c = browse_cursors_next;
+		browse_cursors_next = (c + 1) % BROWSE_CURSOR_CACHE_SIZE;
+	}
+	sqlite3_free(browse_cursors[c].key);
+	for (i = 0; i < browse_cursors[c].nkeys; i++)
+		sqlite3_value_free(browse_cursors[c].values[i]);
+	browse_cursors[c].key = key;
+	browse_cursors[c].updateID = updateID;
+	browse_cursors[c].index = index;
+	browse_cursors[c].nkeys = nkeys;
+	for (i = 0; i < nkeys; i++)
+	{
+		browse_cursors[c].values[i] = values[i];
+		values[i] = NULL;
+	}
+}
+
+static int
+browse_cursor_find(const char *key, int index, int nkeys)
+{
+	int c;
+
+	if (index <= 0)
+		return -1;
+	for (c = 0; c < BROWSE_CURSOR_CACHE_SIZE; c++)
+	{
+		if (!browse_cursors[c].key || strcmp(browse_cursors[c].key, key) != 0)
+			continue;
+		if (browse_cursors[c].updateID != updateID ||
+		    browse_cursors[c].index != index ||
+		    browse_cursors[c].nkeys != nkeys)
+			return -1;
+		return c;
+	}
+
+	return -1;
+}
+
 static void
 BrowseContentDirectory(struct upnphttp * h, const char * action)
 {
@@ -1196,21 +1313,29 @@ BrowseContentDirectory(struct upnphttp * h, const char * action)
 	const char *refid_sql = "o.REF_ID";
 	char where[256] = "";
 	char *orderBy = NULL;
-	struct NameValueParserData data;
+	struct SoapArgs data;
 	int RequestedCount = 0;
 	int StartingIndex = 0;
+	struct browse_key keys[BROWSE_MAX_KEYS];
+	sqlite3_value *values[BROWSE_MAX_KEYS] = { NULL };
+	struct string_s order, after;
+	char order_buf[512], after_buf[1024], keycols[512];
+	char *cursor_key = NULL;
+	sqlite3_stmt *stmt;
+	int nkeys = 0, cursor = -1, rows = 0, i;
+	int snapshot = -1;
 
 	memset(&args, 0, sizeof(args));
 	memset(&str, 0, sizeof(str));
 
-	ParseNameValue(h->req_buf + h->req_contentoff, h->req_contentlen, &data, 0);
+	ParseSoapArgs(h->req_buf + h->req_contentoff, h->req_contentlen, &data, 0);
 
-	ObjectID = GetValueFromNameValueList(&data, "ObjectID");
-	Filter = GetValueFromNameValueList(&data, "Filter");
-	BrowseFlag = GetValueFromNameValueList(&data, "BrowseFlag");
-	SortCriteria = GetValueFromNameValueList(&data, "SortCriteria");
+	ObjectID = data.value[SOAP_ObjectID];
+	Filter = data.value[SOAP_Filter];
+	BrowseFlag = data.value[SOAP_BrowseFlag];
+	SortCriteria = data.value[SOAP_SortCriteria];
 
-	if( (ptr = GetValueFromNameValueList(&data, "RequestedCount")) )
+	if( (ptr = data.value[SOAP_RequestedCount]) )
 		RequestedCount = atoi(ptr);
 	if( RequestedCount < 0 )
 	{
@@ -1219,7 +1344,7 @@ BrowseContentDirectory(struct upnphttp * h, const char * action)
 	}
 	if( !RequestedCount )
 		RequestedCount = -1;
-	if( (ptr = GetValueFromNameValueList(&data, "StartingIndex")) )
+	if( (ptr = data.value[SOAP_StartingIndex]) )
 		StartingIndex = atoi(ptr);
 	if( StartingIndex < 0 )
 	{
@@ -1231,7 +1356,7 @@ BrowseContentDirectory(struct upnphttp * h, const char * action)
 		SoapError(h, 402, "Invalid Args");
 		goto browse_error;
 	}
-	if( !ObjectID && !(ObjectID = GetValueFromNameValueList(&data, "ContainerID")) )
+	if( !ObjectID && !(ObjectID = data.value[SOAP_ContainerID]) )
 	{
 		SoapError(h, 402, "Invalid Args");
 		goto browse_error;
@@ -1278,7 +1403,7 @@ BrowseContentDirectory(struct upnphttp * h, const char * action)
 			if (magic->refid_sql)
 				refid_sql = magic->refid_sql;
 		}
-		sql = sqlite3_mprintf("SELECT %s, %s, %s, " COLUMNS
+		sql = sqlite3_mprintf("SELECT %s, %s, %s, " BROWSE_COLUMNS
 				      "from OBJECTS o left join DETAILS d on (d.ID = o.DETAIL_ID)"
 				      " where OBJECT_ID = '%q';",
 				      objectid_sql, parentid_sql, refid_sql, id);
@@ -1312,35 +1437,37 @@ BrowseContentDirectory(struct upnphttp * h, const char * action)
 			}
 		}
 		if (!where[0])
-			sqlite3_snprintf(sizeof(where), where, "PARENT_ID = '%q'", ObjectID);
+			sqlite3_snprintf(sizeof(where), where, "o.PARENT = "
+			                 "(SELECT ID from OBJECTS where OBJECT_ID = ?%d)", BROWSE_PARAM_ID);
+		/* Have the scanner fill in this container next */
+		if (scanning)
+			scan_hint(ObjectID);
 
-		if (!totalMatches)
-			totalMatches = get_child_count(ObjectID, magic);
 		ret = 0;
 		if (SortCriteria && !orderBy)
 		{
 			__SORT_LIMIT
-			orderBy = parse_sort_criteria(SortCriteria, &ret);
+			orderBy = parse_sort_criteria(SortCriteria, 0, &ret);
 		}
 		else if (!orderBy)
 		{
 			if( strncmp(ObjectID, MUSIC_PLIST_ID, strlen(MUSIC_PLIST_ID)) == 0 )
 			{
 				if( strcmp(ObjectID, MUSIC_PLIST_ID) == 0 )
-					ret = xasprintf(&orderBy, "order by d.TITLE");
+					ret = xasprintf(&orderBy, "order by o.SORT_TITLE");
 				else
 					ret = xasprintf(&orderBy, "order by length(OBJECT_ID), OBJECT_ID");
 			}
 			else if( args.flags & FLAG_FORCE_SORT )
 			{
 				__SORT_LIMIT
-				ret = xasprintf(&orderBy, "order by o.CLASS, d.DISC, d.TRACK, d.TITLE");
+				ret = xasprintf(&orderBy, "order by o.CLASS, o.SORT_DISC, o.SORT_TRACK, o.SORT_TITLE");
 			}
 			/* LG TV ordering bug */
 			else if( args.client == ELGDevice )
-				ret = xasprintf(&orderBy, "order by o.CLASS, d.TITLE");
+				ret = xasprintf(&orderBy, "order by o.CLASS, o.SORT_TITLE");
 			else
-				orderBy = parse_sort_criteria(SortCriteria, &ret);
+				orderBy = parse_sort_criteria(SortCriteria, 0, &ret);
 			if( ret == -1 )
 			{
 				free(orderBy);
@@ -1355,13 +1482,95 @@ BrowseContentDirectory(struct upnphttp * h, const char * action)
 			goto browse_error;
 		}
 
-		sql = sqlite3_mprintf("SELECT %s, %s, %s, " COLUMNS
-		                      "from OBJECTS o left join DETAILS d on (d.ID = o.DETAIL_ID)"
-				      " where %s %s limit %d, %d;",
-				      objectid_sql, parentid_sql, refid_sql,
-				      where, THISORNUL(orderBy), StartingIndex, RequestedCount);
-		DPRINTF(E_DEBUG, L_HTTP, "Browse SQL: %s\n", sql);
-		ret = sqlite3_exec(db, sql, callback, (void *) &args, &zErrMsg);
+		if (!magic && !orderBy)
+			snapshot = snapshot_browse(ObjectID, StartingIndex, RequestedCount,
+			                           &totalMatches, callback, (void *) &args);
+		if (snapshot >= 0)
+		{
+			ret = SQLITE_OK;
+			sql = NULL;
+		}
+		else
+		{
+			if (!totalMatches)
+				totalMatches = get_child_count(ObjectID, magic);
+			if (!magic)
+				nkeys = browse_sort_keys(orderBy, keys);
+			if (nkeys > 0)
+			{
+				/* Sort by exactly the keys we will seek on */
+				memset(&order, 0, sizeof(order));
+				order.data = order_buf;
+				order.size = sizeof(order_buf);
+				memset(&after, 0, sizeof(after));
+				after.data = after_buf;
+				after.size = sizeof(after_buf);
+				strcatf(&order, "order by ");
+				for (i = 0; i < nkeys; i++)
+				{
+					strcatf(&order, "%s%s%s", i ? ", " : "", keys[i].expr, keys[i].desc ? " DESC" : "");
+					strcatf(&after, ", %s", keys[i].expr);
+				}
+				strcatf(&after, " ");
+				if (order.off >= order.size || after.off >= sizeof(keycols))
+					nkeys = 0;
+			}
+			if (nkeys > 0)
+			{
+				strcpy(keycols, after_buf);
+				after.off = 0;
+				after_buf[0] = '\0';
+				cursor_key = sqlite3_mprintf("%08x\x1f%s\x1f%s", h->clientaddr.s_addr, ObjectID, order_buf);
+				cursor = cursor_key ? browse_cursor_find(cursor_key, StartingIndex, nkeys) : -1;
+				if (cursor >= 0)
+				{
+					browse_after(&after, keys, nkeys, browse_cursors[cursor].values);
+					if (after.off >= after.size)
+						cursor = -1;
+				}
+			}
+
+			if (cursor >= 0)
+				sql = sqlite3_mprintf("SELECT %s, %s, %s, " BROWSE_COLUMNS "%s"
+				                      "from OBJECTS o left join DETAILS d on (d.ID = o.DETAIL_ID)"
+				                      " where %s and %s %s limit ?%d;",
+				                      objectid_sql, parentid_sql, refid_sql, keycols,
+				                      where, after_buf, order_buf, BROWSE_PARAM_COUNT);
+			else
+				sql = sqlite3_mprintf("SELECT %s, %s, %s, " BROWSE_COLUMNS "%s"
+				                      "from OBJECTS o left join DETAILS d on (d.ID = o.DETAIL_ID)"
+				                      " where %s %s limit ?%d, ?%d;",
+				                      objectid_sql, parentid_sql, refid_sql, nkeys > 0 ? keycols : "",
+				                      where, nkeys > 0 ? order_buf : THISORNUL(orderBy),
+				                      BROWSE_PARAM_OFFSET, BROWSE_PARAM_COUNT);
+			DPRINTF(E_DEBUG, L_HTTP, "Browse SQL: %s\n", sql);
+			stmt = sql ? sql_prepare_cached(db, sql) : NULL;
+			if (stmt)
+			{
+				for (i = 0; cursor >= 0 && i < nkeys; i++)
+				{
+					if (sqlite3_value_type(browse_cursors[cursor].values[i]) != SQLITE_NULL)
+						sqlite3_bind_value(stmt, i + 1, browse_cursors[cursor].values[i]);
+				}
+				/* Unused ones, like the ID for a magic container, stay NULL */
+				sqlite3_bind_text(stmt, BROWSE_PARAM_ID, ObjectID, -1, SQLITE_STATIC);
+				sqlite3_bind_int(stmt, BROWSE_PARAM_OFFSET, StartingIndex);
+				sqlite3_bind_int(stmt, BROWSE_PARAM_COUNT, RequestedCount);
+				ret = browse_step(stmt, &args, &rows, nkeys, values);
+			}
+			else
+				ret = SQLITE_ERROR;
+			if (ret != SQLITE_OK)
+				zErrMsg = sqlite3_mprintf("%s", sqlite3_errmsg(db));
+			else if (nkeys > 0 && rows > 0 && cursor_key)
+			{
+				browse_cursor_save(cursor_key, StartingIndex + rows, nkeys, values);
+				cursor_key = NULL;
+			}
+			sqlite3_free(cursor_key);
+			for (i = 0; i < BROWSE_MAX_KEYS; i++)
+				sqlite3_value_free(values[i]);
+		}
 	}
 	if( (ret != SQLITE_OK) && (zErrMsg != NULL) )
 	{
@@ -1388,280 +1597,83 @@ BrowseContentDirectory(struct upnphttp * h, const char * action)
 	                    args.returned, totalMatches, updateID);
 	BuildSendAndCloseSoapResp(h, str.data, str.off);
 browse_error:
-	ClearNameValueList(&data);
 	free(orderBy);
 	free(str.data);
 }
 
-static inline void
-charcat(struct string_s *str, char c)
-{
-	if (str->size <= str->off)
-	{
-		str->data[str->size-1] = '\0';
-		return;
-	}
-	str->data[str->off] = c;
-	str->off += 1;
-}
+/* Counting every match of a big Search is often more expensive than
+ * fetching a page of results, and clients repeat the same Search for each
+ * page, so remember the last few counts until the database changes.
+ * updateID alone lags behind the scanner, so the change counter is
+ * checked too. */
+#define SEARCH_COUNT_CACHE_SIZE 8
+
+static struct {
+	char *key;
+	unsigned int updateID;
+	int changes;
+	int count;
+} search_counts[SEARCH_COUNT_CACHE_SIZE];
+static int search_counts_next;
 
-static inline char *
-parse_search_criteria(const char *str, char *sep)
+static int
+search_count(const char *subtree, const char *ContainerID, const struct search_criteria *criteria)
 {
-	struct string_s criteria;
-	int len;
-	int literal = 0, like = 0;
-	const char *s;
-
-	if (!str)
-		return strdup("1 = 1");
-
-	len = strlen(str) + 32;
-	criteria.data = malloc(len);
-	criteria.size = len;
-	criteria.off = 0;
-
-	s = str;
-
-	while (isspace(*s))
-		s++;
-
-	while (*s)
+	sqlite3_stmt *stmt;
+	char *key, *sql;
+	int i, n, count, changes;
+
+	changes = sql_changes(db);
+	key = sqlite3_mprintf("%s\x1f%s\x1f%s", ContainerID, subtree, criteria->where);
+	for (i = 0; key && i < criteria->nparams; i++)
+		key = sqlite3_mprintf("%z\x1f%s", key, criteria->params[i]);
+	for (i = 0; key && i < SEARCH_COUNT_CACHE_SIZE; i++)
 	{
-		if (literal)
+		if (search_counts[i].key && search_counts[i].updateID == updateID &&
+		    search_counts[i].changes == changes && strcmp(search_counts[i].key, key) == 0)
 		{
-			switch (*s) {
-			case '&':
-				if (strncmp(s, "&quot;", 6) == 0)
-					s += 5;
-				else if (strncmp(s, "&apos;", 6) == 0)
-				{
-					strcatf(&criteria, "'");
-					s += 6;
-					continue;
-				}
-				else
-					break;
-			case '"':
-				literal = 0;
-				if (like)
-				{
-					charcat(&criteria, '%');
-					like--;
-				}
-				charcat(&criteria, '"');
-				break;
-			case '\\':
-				if (strncmp(s, "\\&quot;", 7) == 0)
-				{
-					strcatf(&criteria, "&amp;quot;");
-					s += 7;
-					continue;
-				}
-				break;
-			case 'o':
-				if (strncmp(s, "object.", 7) == 0)
-					s += 7;
-				else if (strncmp(s, "object\"", 7) == 0 ||
-				         strncmp(s, "object&quot;", 12) == 0)
-				{
-					s += 6;
-					continue;
-				}
-			default:
-				charcat(&criteria, *s);
-				break;
-			}
+			sqlite3_free(key);
+			return search_counts[i].count;
 		}
-		else
-		{
-			switch (*s) {
-			case '\\':
-				if (strncmp(s, "\\&quot;", 7) == 0)
-				{
-					strcatf(&criteria, "&amp;quot;");
-					s += 7;
-					continue;
-				}
-				else
-					charcat(&criteria, *s);
-				break;
-			case '"':
-				literal = 1;
-				charcat(&criteria, *s);
-				if (like == 2)
-				{
-					charcat(&criteria, '%');
-					like--;
-				}
-				break;
-			case '&':
-				if (strncmp(s, "&quot;", 6) == 0)
-				{
-					literal = 1;
-					strcatf(&criteria, "\"");
-					if (like == 2)
-					{
-						charcat(&criteria, '%');
-						like--;
-					}
-					s += 5;
-				}
-				else if (strncmp(s, "&apos;", 6) == 0)
-				{
-					strcatf(&criteria, "'");
-					s += 5;
-				}
-				else if (strncmp(s, "&lt;", 4) == 0)
-				{
-					strcatf(&criteria, "<");
-					s += 3;
-				}
-				else if (strncmp(s, "&gt;", 4) == 0)
-				{
-					strcatf(&criteria, ">");
-					s += 3;
-				}
-				else
-					charcat(&criteria, *s);
-				break;
-			case '@':
-				if (strncmp(s, "@refID", 6) == 0)
-				{
-					strcatf(&criteria, "REF_ID");
-					s += 6;
-					continue;
-				}
-				else if (strncmp(s, "@id", 3) == 0)
-				{
-					strcatf(&criteria, "OBJECT_ID");
-					s += 3;
-					continue;
-				}
-				else if (strncmp(s, "@parentID", 9) == 0)
-				{
-					strcatf(&criteria, "PARENT_ID");
-					s += 9;
-					strcpy(sep, "*");
-					continue;
-				}
-				else
-					charcat(&criteria, *s);
-				break;
-			case 'c':
-				if (strncmp(s, "contains", 8) == 0)
-				{
-					strcatf(&criteria, "like");
-					s += 8;
-					like = 2;
-					continue;
-				}
-				else
-					charcat(&criteria, *s);
-				break;
-			case 'd':
-				if (strncmp(s, "derivedfrom", 11) == 0)
-				{
-					strcatf(&criteria, "like");
-					s += 11;
-					like = 1;
-					continue;
-				}
-				else if (strncmp(s, "dc:date", 7) == 0)
-				{
-					strcatf(&criteria, "d.DATE");
-					s += 7;
-					continue;
-				}
-				else if (strncmp(s, "dc:title", 8) == 0)
-				{
-					strcatf(&criteria, "d.TITLE");
-					s += 8;
-					continue;
-				}
-				else if (strncmp(s, "dc:creator", 10) == 0)
-				{
-					strcatf(&criteria, "d.CREATOR");
-					s += 10;
-					continue;
-				}
-				else
-					charcat(&criteria, *s);
-				break;
-			case 'e':
-				if (strncmp(s, "exists", 6) == 0)
-				{
-					s += 6;
-					while (isspace(*s))
-						s++;
-					if (strncmp(s, "true", 4) == 0)
-					{
-						strcatf(&criteria, "is not NULL");
-						s += 3;
-					}
-					else if (strncmp(s, "false", 5) == 0)
-					{
-						strcatf(&criteria, "is NULL");
-						s += 4;
-					}
-				}
-				else
-					charcat(&criteria, *s);
-				break;
-			case 'u':
-				if (strncmp(s, "upnp:class", 10) == 0)
-				{
-					strcatf(&criteria, "o.CLASS");
-					s += 10;
-					continue;
-				}
-				else if (strncmp(s, "upnp:actor", 10) == 0)
-				{
-					strcatf(&criteria, "d.ARTIST");
-					s += 10;
-					continue;
-				}
-				else if (strncmp(s, "upnp:artist", 11) == 0)
-				{
-					strcatf(&criteria, "d.ARTIST");
-					s += 11;
-					continue;
-				}
-				else if (strncmp(s, "upnp:album", 10) == 0)
-				{
-					strcatf(&criteria, "d.ALBUM");
-					s += 10;
-					continue;
-				}
-				else if (strncmp(s, "upnp:genre", 10) == 0)
-				{
-					strcatf(&criteria, "d.GENRE");
-					s += 10;
-					continue;
-				}
-				else
-					charcat(&criteria, *s);
-				break;
-			case '(':
-				if (s > str && !isspace(s[-1]))
-					charcat(&criteria, ' ');
-				charcat(&criteria, *s);
-				break;
-			case ')':
-				charcat(&criteria, *s);
-				if (!isspace(s[1]))
-					charcat(&criteria, ' ');
-				break;
-			default:
-				charcat(&criteria, *s);
-				break;
-			}
-		}
-		s++;
 	}
-	charcat(&criteria, '\0');
 
-	return criteria.data;
+	/* With max_search_count set, stop counting once we know there are more
+	 * matches than that; a negative limit means no limit to SQLite. */
+	n = criteria->nparams;
+	sql = sqlite3_mprintf("SELECT (select count(*) from (select distinct DETAIL_ID"
+	                      " from OBJECTS o left join DETAILS d on (o.DETAIL_ID = d.ID)"
+	                      " where %s and (%s) limit ?%d))"
+	                      " + "
+	                      "(select count(*) from OBJECTS o left join DETAILS d on (o.DETAIL_ID = d.ID)"
+	                      " where (OBJECT_ID = ?%d) and (%s))",
+	                      subtree, criteria->where, n+2, n+1, criteria->where);
+	stmt = sql_prepare_cached(db, sql);
+	sqlite3_free(sql);
+	if (!stmt)
+	{
+		sqlite3_free(key);
+		return -1;
+	}
+	search_bind(stmt, criteria);
+	sqlite3_bind_text(stmt, n+1, ContainerID, -1, SQLITE_STATIC);
+	sqlite3_bind_int(stmt, n+2, runtime_vars.max_search_count > 0 ?
+	                            runtime_vars.max_search_count + 1 : -1);
+	count = sql_step_int(stmt);
+	if (count < 0 || !key)
+	{
+		sqlite3_free(key);
+		return count;
+	}
+
+	i = search_counts_next;
+	search_counts_next = (i + 1) % SEARCH_COUNT_CACHE_SIZE;
+	sqlite3_free(search_counts[i].key);
+	search_counts[i].key = key;
+	search_counts[i].updateID = updateID;
+	search_counts[i].changes = changes;
+	search_counts[i].count = count;
+
+	return count;
 }
 
 static void
@@ -1674,39 +1686,41 @@ SearchContentDirectory(struct upnphttp * h, const char * action)
 			"&lt;DIDL-Lite"
 			CONTENT_DIRECTORY_SCHEMAS;
 	struct magic_container_s *magic;
-	char *zErrMsg = NULL;
-	char *sql, *ptr;
+	char *sql, *ptr, *subtree;
+	sqlite3_stmt *stmt;
 	struct Response args;
 	struct string_s str;
+	struct search_criteria criteria;
 	int totalMatches;
-	int ret;
+	int ret, n;
 	const char *ContainerID;
 	char *Filter, *SearchCriteria, *SortCriteria;
-	char *orderBy = NULL, *where = NULL, sep[] = "$*";
+	char *orderBy = NULL;
 	char groupBy[] = "group by DETAIL_ID";
-	struct NameValueParserData data;
+	struct SoapArgs data;
 	int RequestedCount = 0;
 	int StartingIndex = 0;
 
 	memset(&args, 0, sizeof(args));
 	memset(&str, 0, sizeof(str));
+	memset(&criteria, 0, sizeof(criteria));
 
-	ParseNameValue(h->req_buf + h->req_contentoff, h->req_contentlen, &data, 0);
+	ParseSoapArgs(h->req_buf + h->req_contentoff, h->req_contentlen, &data, 0);
 
-	ContainerID = GetValueFromNameValueList(&data, "ContainerID");
-	Filter = GetValueFromNameValueList(&data, "Filter");
-	SearchCriteria = GetValueFromNameValueList(&data, "SearchCriteria");
-	SortCriteria = GetValueFromNameValueList(&data, "SortCriteria");
+	ContainerID = data.value[SOAP_ContainerID];
+	Filter = data.value[SOAP_Filter];
+	SearchCriteria = data.value[SOAP_SearchCriteria];
+	SortCriteria = data.value[SOAP_SortCriteria];
 
-	if( (ptr = GetValueFromNameValueList(&data, "RequestedCount")) )
+	if( (ptr = data.value[SOAP_RequestedCount]) )
 		RequestedCount = atoi(ptr);
 	if( !RequestedCount )
 		RequestedCount = -1;
-	if( (ptr = GetValueFromNameValueList(&data, "StartingIndex")) )
+	if( (ptr = data.value[SOAP_StartingIndex]) )
 		StartingIndex = atoi(ptr);
 	if( !ContainerID )
 	{
-		if( !(ContainerID = GetValueFromNameValueList(&data, "ObjectID")) )
+		if( !(ContainerID = data.value[SOAP_ObjectID]) )
 		{
 			SoapError(h, 402, "Invalid Args");
 			goto search_error;
@@ -1751,20 +1765,23 @@ SearchContentDirectory(struct upnphttp * h, const char * action)
 	    GETFLAG(DLNA_STRICT_MASK) )
 		groupBy[0] = '\0';
 
-	where = parse_search_criteria(SearchCriteria, sep);
-	DPRINTF(E_DEBUG, L_HTTP, "Translated SearchCriteria: %s\n", where);
+	if( search_parse(SearchCriteria, &criteria) != 0 )
+	{
+		SoapError(h, 708, "Unsupported or invalid search criteria");
+		goto search_error;
+	}
+	DPRINTF(E_DEBUG, L_HTTP, "Translated SearchCriteria: %s\n", criteria.where);
+	/* The criteria use placeholders ?1 .. ?n, so the container ID and
+	 * the limits get the ones after that. */
+	n = criteria.nparams;
+	subtree = search_subtree(ContainerID, &criteria);
 
-	totalMatches = sql_get_int_field(db, "SELECT (select count(distinct DETAIL_ID)"
-	                                     " from OBJECTS o left join DETAILS d on (o.DETAIL_ID = d.ID)"
-	                                     " where (OBJECT_ID glob '%q%s') and (%s))"
-	                                     " + "
-	                                     "(select count(*) from OBJECTS o left join DETAILS d on (o.DETAIL_ID = d.ID)"
-	                                     " where (OBJECT_ID = '%q') and (%s))",
-	                                     ContainerID, sep, where, ContainerID, where);
+	totalMatches = search_count(subtree, ContainerID, &criteria);
 	if( totalMatches < 0 )
 	{
 		/* Must be invalid SQL, so most likely bad or unhandled search criteria. */
 		SoapError(h, 708, "Unsupported or invalid search criteria");
+		sqlite3_free(subtree);
 		goto search_error;
 	}
 	/* Does the object even exist? */
@@ -1773,38 +1790,38 @@ SearchContentDirectory(struct upnphttp * h, const char * action)
 		if( !object_exists(ContainerID) )
 		{
 			SoapError(h, 710, "No such container");
+			sqlite3_free(subtree);
 			goto search_error;
 		}
 	}
 	ret = 0;
 	__SORT_LIMIT
-	orderBy = parse_sort_criteria(SortCriteria, &ret);
+	orderBy = parse_sort_criteria(SortCriteria, SORT_RESULT_COLUMNS, &ret);
 	/* If it's a DLNA client, return an error for bad sort criteria */
 	if( ret < 0 && ((args.flags & FLAG_DLNA) || GETFLAG(DLNA_STRICT_MASK)) )
 	{
 		SoapError(h, 709, "Unsupported or invalid sort criteria");
+		sqlite3_free(subtree);
 		goto search_error;
 	}
 
-	sql = sqlite3_mprintf( SELECT_COLUMNS
-	                      "from OBJECTS o left join DETAILS d on (d.ID = o.DETAIL_ID)"
-	                      " where OBJECT_ID glob '%q%s' and (%s) %s "
-	                      "%z %s"
-	                      " limit %d, %d",
-	                      ContainerID, sep, where, groupBy,
-	                      (*ContainerID == '*') ? NULL :
-	                      sqlite3_mprintf("UNION ALL " SELECT_COLUMNS
-	                                      "from OBJECTS o left join DETAILS d on (d.ID = o.DETAIL_ID)"
-	                                      " where OBJECT_ID = '%q' and (%s) ", ContainerID, where),
-	                      orderBy, StartingIndex, RequestedCount);
+	sql = search_select(ContainerID, subtree, &criteria, groupBy, orderBy);
 	DPRINTF(E_DEBUG, L_HTTP, "Search SQL: %s\n", sql);
-	ret = sqlite3_exec(db, sql, callback, (void *) &args, &zErrMsg);
-	if( (ret != SQLITE_OK) && (zErrMsg != NULL) )
+	stmt = sql_prepare_cached(db, sql);
+	sqlite3_free(sql);
+	if( stmt )
 	{
-		DPRINTF(E_WARN, L_HTTP, "SQL error: %s\nBAD SQL: %s\n", zErrMsg, sql);
-		sqlite3_free(zErrMsg);
+		search_bind(stmt, &criteria);
+		if( *ContainerID != '*' )
+			sqlite3_bind_text(stmt, n+1, ContainerID, -1, SQLITE_STATIC);
+		sqlite3_bind_int(stmt, n+2, StartingIndex);
+		sqlite3_bind_int(stmt, n+3, RequestedCount);
+		sql_step_callback(stmt, callback, (void *) &args);
 	}
-	sqlite3_free(sql);
+	sqlite3_free(subtree);
+	/* DLNA allows TotalMatches to be 0 when the count is unknown */
+	if( runtime_vars.max_search_count > 0 && totalMatches > runtime_vars.max_search_count )
+		totalMatches = 0;
 	ret = strcatf(&str, "&lt;/DIDL-Lite&gt;</Result>\n"
 	                    "<NumberReturned>%u</NumberReturned>\n"
 	                    "<TotalMatches>%u</TotalMatches>\n"
@@ -1813,9 +1830,8 @@ SearchContentDirectory(struct upnphttp * h, const char * action)
 	                    args.returned, totalMatches, updateID);
 	BuildSendAndCloseSoapResp(h, str.data, str.off);
 search_error:
-	ClearNameValueList(&data);
 	free(orderBy);
-	free(where);
+	search_free(&criteria);
 	free(str.data);
 }
 
@@ -1837,13 +1853,11 @@ QueryStateVariable(struct upnphttp * h, const char * action)
         "</u:%sResponse>";
 
 	char body[512];
-	struct NameValueParserData data;
+	struct SoapArgs data;
 	const char * var_name;
 
-	ParseNameValue(h->req_buf + h->req_contentoff, h->req_contentlen, &data, 0);
-	/*var_name = GetValueFromNameValueList(&data, "QueryStateVariable"); */
-	/*var_name = GetValueFromNameValueListIgnoreNS(&data, "varName");*/
-	var_name = GetValueFromNameValueList(&data, "varName");
+	ParseSoapArgs(h->req_buf + h->req_contentoff, h->req_contentlen, &data, 0);
+	var_name = data.value[SOAP_varName];
 
 	DPRINTF(E_INFO, L_HTTP, "QueryStateVariable(%.40s)\n", var_name);
 
@@ -1864,8 +1878,6 @@ QueryStateVariable(struct upnphttp * h, const char * action)
 		DPRINTF(E_WARN, L_HTTP, "%s: Unknown: %s\n", action, THISORNUL(var_name));
 		SoapError(h, 404, "Invalid Var");
 	}
-
-	ClearNameValueList(&data);	
 }
 
 static void
@@ -1919,12 +1931,12 @@ SamsungSetBookmark(struct upnphttp * h, const char * action)
 	    " xmlns:u=\"urn:schemas-upnp-org:service:ContentDirectory:1\">"
 	    "</u:X_SetBookmarkResponse>";
 
-	struct NameValueParserData data;
+	struct SoapArgs data;
 	char *ObjectID, *PosSecond;
 
-	ParseNameValue(h->req_buf + h->req_contentoff, h->req_contentlen, &data, 0);
-	ObjectID = GetValueFromNameValueList(&data, "ObjectID");
-	PosSecond = GetValueFromNameValueList(&data, "PosSecond");
+	ParseSoapArgs(h->req_buf + h->req_contentoff, h->req_contentlen, &data, 0);
+	ObjectID = data.value[SOAP_ObjectID];
+	PosSecond = data.value[SOAP_PosSecond];
 
 	if ( atoi(PosSecond) < 30 )
 		PosSecond = "0";
@@ -1944,8 +1956,6 @@ SamsungSetBookmark(struct upnphttp * h, const char * action)
 	}
 	else
 		SoapError(h, 402, "Invalid Args");
-
-	ClearNameValueList(&data);	
 }
 
 static const struct 
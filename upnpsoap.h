@@ -33,6 +33,13 @@
 #define PV_NAMESPACE \
 	" xmlns:pv=\"http://www.pv.com/pvns/\""
 
+/* The columns passed to the Browse and Search result callback */
+#define BROWSE_COLUMNS "o.DETAIL_ID, o.CLASS," \
+                " d.SIZE, d.TITLE, d.DURATION, d.BITRATE, d.SAMPLERATE, d.ARTIST," \
+                " d.ALBUM, d.GENRE, d.COMMENT, d.CHANNELS, d.TRACK, d.DATE, d.RESOLUTION," \
+                " d.THUMBNAIL, d.CREATOR, d.DLNA_PN, d.MIME, d.ALBUM_ART, d.ROTATION, d.DISC "
+#define BROWSE_SELECT_COLUMNS "SELECT o.OBJECT_ID, o.PARENT_ID, o.REF_ID, " BROWSE_COLUMNS
+
 struct Response
 {
 	struct string_s *str;